@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "helper.h"
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "plot.h"
+#include "autotune.h"
+
+// {{{ autotune          calibrate core, threads, stagger and async mode
+
+// Hashing time per core and thread count, and bytes per request size of
+// the disk test
+#define TUNE_MS         1500
+#define TUNE_DISKBYTES  (64 * 1024 * 1024)
+#define TUNE_VERSION    1
+
+struct tuneprofile {
+    uint32_t cpus;          // logical cores the profile was made on
+    uint32_t core;
+    uint32_t threads;
+    uint32_t stagger;       // 0: from memory, like without a profile
+    uint32_t async;
+    double noncesmin;       // hashing rate of core and threads
+    double diskmbs;         // sequential write rate with stagger sized requests
+};
+
+struct tunethread {
+    pthread_t thread;
+    char *cache;
+    uint64_t hashed;
+};
+
+const char *corenames[] = { "ORIG", "SSE4", "AVX2" };
+volatile int tunestop;
+
+void *
+tune_i(void *x_void_ptr) {
+    struct tunethread *tt = x_void_ptr;
+
+    while (!tunestop) {
+        hashchunk(tt->cache, noncearguments, addr, tt->hashed, 0, noncearguments);
+        tt->hashed += noncearguments;
+    }
+    return NULL;
+}
+
+// Nonces per minute of a core with nthreads hashing threads
+double
+tunehash(uint32_t core, uint32_t nthreads) {
+    struct tunethread *tt = calloc(nthreads, sizeof *tt);
+    pthread_attr_t attr;
+    uint64_t start, hashed = 0;
+    uint32_t t;
+
+    if (tt == NULL || initstackattr(&attr)) {
+        printf("Error allocating memory.\n");
+        exit(-1);
+    }
+    selectcore(core);
+    tunestop = 0;
+
+    start = getMS();
+    for (t = 0; t < nthreads; t++) {
+        if ((tt[t].cache = alloc(NONCE_SIZE, noncearguments)) == NULL
+            || pthread_create(&tt[t].thread, &attr, tune_i, &tt[t])) {
+            printf("Error creating thread. Out of memory? Try fewer threads.\n");
+            exit(-1);
+        }
+    }
+    usleep(TUNE_MS * 1000);
+    tunestop = 1;
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(tt[t].thread, NULL);
+        hashed += tt[t].hashed;
+        free(tt[t].cache);
+    }
+    free(tt);
+    pthread_attr_destroy(&attr);
+
+    return (double)hashed * 60000000 / (getMS() - start);
+}
+
+// Sequential write rate in MB/s with requests of len bytes, like the scoop
+// blocks of a writer thread, including the final sync
+double
+tunedisk(const char *dir, const char *buf, uint32_t len) {
+    char name[PATH_MAX];
+    uint64_t start, done;
+    int fd;
+
+    snprintf(name, sizeof name, "%s.autotune.%d", dir, (int)getpid());
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        printf("Cannot create %s for the disk test: %s\n", name, strerror(errno));
+        return 0;
+    }
+    start = getMS();
+    for (done = 0; done < TUNE_DISKBYTES; done += len) {
+        if (write(fd, buf, len) != (ssize_t)len) {
+            printf("Error while writing %s: %s\n", name, strerror(errno));
+            break;
+        }
+    }
+    fdatasync(fd);
+    start = getMS() - start;
+    close(fd);
+    unlink(name);
+
+    return (done < TUNE_DISKBYTES) ? 0 : (double)done / 1048576 * 1000000 / start;
+}
+
+// Every supported core at 1, half the physical, all physical and all
+// logical cores, then the smallest write request that gets within 10% of
+// the best disk rate. The stagger size follows from that request size (a
+// scoop of every nonce of a round per request) as long as memory allows,
+// and async mode is used whenever memory holds two of those buffers.
+void
+tune(struct tuneprofile *tp) {
+    const uint32_t sizes[] = { 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+    uint32_t logical  = getNumberOfCores();
+    uint32_t physical = getNumberOfPhysicalCores();
+    uint32_t counts[] = { 1, physical / 2, physical, logical };
+    uint32_t core, c, k, last;
+    uint64_t memstag = (uint64_t)(freemem() * 0.8) / NONCE_SIZE / numfiles;
+    double rate, best = 0, rates[3];
+    char *buf;
+
+    memset(tp, 0, sizeof *tp);
+    tp->cpus = logical;
+    printf("Autotune: %u physical, %u logical cores.\n", physical, logical);
+
+    for (core = 0; core < 3; core++) {
+        if ((core == 1 && !__builtin_cpu_supports("sse4.1")) || (core == 2 && !__builtin_cpu_supports("avx2")))
+            continue;
+        for (c = 0, last = 0; c < 4; c++) {
+            if (counts[c] <= last)
+                continue;
+            last = counts[c];
+            rate = tunehash(core, counts[c]);
+            printf("Autotune: %s core, %u threads: %.0f nonces/min\n", corenames[core], counts[c], rate);
+            // More threads or a wider core have to be clearly faster
+            if (rate > best * 1.02) {
+                best          = rate;
+                tp->core      = core;
+                tp->threads   = counts[c];
+                tp->noncesmin = rate;
+            }
+        }
+    }
+
+    // Raw devices and sinks are not written to here: stagger from memory
+    if (plotfiles[0].rawdevice || sinkmode != SINK_FILE) {
+        tp->async = 1;
+        return;
+    }
+    mkdir(plotfiles[0].outputdir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+    if ((buf = malloc(sizes[2])) == NULL) {
+        printf("Error allocating memory.\n");
+        exit(-1);
+    }
+    // Incompressible, for filesystems that compress
+    for (k = 0; k < sizes[2]; k++)
+        buf[k] = rand();
+    for (k = 0, best = 0; k < 3; k++) {
+        rates[k] = tunedisk(plotfiles[0].outputdir, buf, sizes[k]);
+        printf("Autotune: %u KB writes to %s: %.1f MB/s\n", sizes[k] / 1024, plotfiles[0].outputdir, rates[k]);
+        if (rates[k] > best)
+            best = rates[k];
+    }
+    free(buf);
+    if (best == 0) {
+        tp->async = 1;
+        return;
+    }
+    for (k = 0; rates[k] < best * 0.9; k++)
+        ;
+    tp->diskmbs = rates[k];
+    tp->stagger = sizes[k] / SCOOP_SIZE;
+
+    if (memstag >= 2 * (uint64_t)tp->stagger) {
+        tp->async = 1;
+    }
+    else {
+        // Short of memory: double buffering is only worth half the stagger
+        // size when neither hashing nor writing is 10 times faster
+        double hashmbs = tp->noncesmin / 60 * NONCE_SIZE / 1048576;
+
+        tp->async = (hashmbs < tp->diskmbs * 10 && tp->diskmbs < hashmbs * 10);
+        if (memstag < (uint64_t)tp->stagger * (1 + tp->async))
+            tp->stagger = memstag / (1 + tp->async);
+    }
+}
+
+// $HOME/.engraver/<hostname>.profile
+void
+tunepath(char *path, size_t size, int create) {
+    char host[256] = "localhost";
+    const char *home = getenv("HOME");
+
+    gethostname(host, sizeof host - 1);
+    snprintf(path, size, "%s/.engraver", home ? home : ".");
+    if (create)
+        mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR);
+    snprintf(path + strlen(path), size - strlen(path), "/%s.profile", host);
+}
+
+int
+tuneload(const char *path, struct tuneprofile *tp) {
+    char line[256], key[64];
+    double value;
+    uint32_t version = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return -1;
+    memset(tp, 0, sizeof *tp);
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63[^=]=%lf", key, &value) != 2)
+            continue;
+        if (!strcmp(key, "version"))        version       = value;
+        else if (!strcmp(key, "cpus"))      tp->cpus      = value;
+        else if (!strcmp(key, "core"))      tp->core      = value;
+        else if (!strcmp(key, "threads"))   tp->threads   = value;
+        else if (!strcmp(key, "stagger"))   tp->stagger   = value;
+        else if (!strcmp(key, "async"))     tp->async     = value;
+        else if (!strcmp(key, "noncesmin")) tp->noncesmin = value;
+        else if (!strcmp(key, "diskmbs"))   tp->diskmbs   = value;
+    }
+    fclose(f);
+    // Made on other hardware (or by another version): tune again
+    if (version != TUNE_VERSION || tp->cpus != (uint32_t)getNumberOfCores() || tp->threads == 0 || tp->core > 2)
+        return -1;
+    return 0;
+}
+
+void
+tunesave(const char *path, struct tuneprofile *tp) {
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        printf("Cannot save the autotune profile %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(f, "# engraver autotune profile, delete it or use --autotune=force to tune again\n");
+    fprintf(f, "version=%d\ncpus=%u\ncore=%u\nthreads=%u\nstagger=%u\nasync=%u\nnoncesmin=%.0f\ndiskmbs=%.1f\n",
+            TUNE_VERSION, tp->cpus, tp->core, tp->threads, tp->stagger, tp->async, tp->noncesmin, tp->diskmbs);
+    fclose(f);
+}
+
+// Loads the profile of this host (tuning first if there is none, or if
+// forced) and applies every setting the user did not give
+void
+autotune(int force, int coregiven) {
+    struct tuneprofile tp;
+    char path[PATH_MAX];
+
+    tunepath(path, sizeof path, 0);
+    if (force || tuneload(path, &tp) < 0) {
+        tune(&tp);
+        tunepath(path, sizeof path, 1);
+        tunesave(path, &tp);
+    }
+    printf("Autotune profile %s: %s core, %u threads, stagger size %u%s (%.0f nonces/min, %.1f MB/s).\n",
+           path, corenames[tp.core], tp.threads, tp.stagger, tp.async ? ", async" : "", tp.noncesmin, tp.diskmbs);
+
+    if (!coregiven)
+        selecttype = tp.core;
+    if (threads == 0)
+        threads = tp.threads;
+    if (!asyncmode)
+        asyncmode = tp.async;
+    // As a memory limit, so that calcstagger still fits it to the nonces
+    if (staggersize == 0 && maxmemory == 0 && tp.stagger > 0) {
+        uint64_t limit = (uint64_t)(freemem() * 0.8);
+
+        maxmemory = (uint64_t)tp.stagger * NONCE_SIZE * (1 + asyncmode) * numfiles;
+        if (maxmemory > limit)
+            maxmemory = limit;
+    }
+}
+
+// }}}
@@ -0,0 +1,5 @@
+#include <stdint.h>
+
+// --autotune: measure the cores, thread counts and write sizes of this
+// host once and plot with the best of them
+void autotune(int force, int coregiven);
@@ -0,0 +1,282 @@
+// Microbenchmarks of the hashing kernels and nonce engines (make bench).
+// Every case is timed repeats times and the median is reported, as CSV or
+// JSON, so hosts and builds can be compared without disk I/O in the way.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "shabal.h"
+#include "mshabal256.h"
+#include "mshabal.h"
+#include "nonce.h"
+#include "check.h"
+#include "engraver.h"
+
+// The plot test.pl checks by MD5: 128 nonces of this account from nonce 0.
+// Its XXH64 is checked here, so no MD5 implementation is needed.
+#define GOLDEN_ADDR     11424087411148401423ULL
+#define GOLDEN_NONCES   128
+#define GOLDEN_XXH64    0x2eb29893f809f6b0ULL
+
+// A case is run at least this long per repeat
+#define BENCH_MIN_NS    20000000ULL
+
+int repeats = 7;
+int json    = 0;
+int rows    = 0;
+
+char *data[8];
+char *cache;
+char out[8][64];
+
+// {{{ timing
+
+uint64_t
+nowns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+cmpdouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+typedef void (*benchfn)(uint32_t size);
+
+// Median time of one call of fn in ns. The number of calls per repeat is
+// doubled until a repeat takes at least BENCH_MIN_NS.
+double
+measure(benchfn fn, uint32_t size) {
+    double t[repeats];
+    uint64_t iters = 1, i, ns;
+    int r;
+
+    for (;;) {
+        ns = nowns();
+        for (i = 0; i < iters; i++)
+            fn(size);
+        ns = nowns() - ns;
+        if (ns >= BENCH_MIN_NS)
+            break;
+        iters *= 2;
+    }
+    for (r = 0; r < repeats; r++) {
+        ns = nowns();
+        for (i = 0; i < iters; i++)
+            fn(size);
+        t[r] = (double)(nowns() - ns) / iters;
+    }
+    qsort(t, repeats, sizeof *t, cmpdouble);
+    return t[repeats / 2];
+}
+
+// lanes messages (or nonces) of bytes each per call
+void
+report(const char *kernel, const char *variant, uint32_t lanes, uint64_t bytes, double ns) {
+    double mbs = (double)bytes * lanes / ns * 1000000000.0 / 1048576;
+    double ops = (double)lanes / ns * 1000000000.0;
+
+    if (json) {
+        printf("%s\n  {\"kernel\": \"%s\", \"case\": \"%s\", \"lanes\": %u, \"bytes\": %" PRIu64 ", \"median_ns\": %.1f, \"mb_per_s\": %.2f, \"per_s\": %.2f}",
+               rows ? "," : "", kernel, variant, lanes, bytes, ns, mbs, ops);
+    }
+    else {
+        printf("%s,%s,%u,%" PRIu64 ",%.1f,%.2f,%.2f\n", kernel, variant, lanes, bytes, ns, mbs, ops);
+    }
+    rows++;
+    fflush(stdout);
+}
+
+// }}}
+// {{{ kernels           Shabal256 on messages of one size
+
+void
+shabalk(uint32_t size) {
+    shabal_context x;
+
+    shabal_init(&x, 256);
+    shabal(&x, data[0], size);
+    shabal_close(&x, 0, 0, out[0]);
+}
+
+void
+sse4k(uint32_t size) {
+    mshabal_context x;
+
+    sse4_mshabal_init(&x, 256);
+    sse4_mshabal(&x, data[0], data[1], data[2], data[3], size);
+    sse4_mshabal_close(&x, 0, 0, 0, 0, 0, out[0], out[1], out[2], out[3]);
+}
+
+void
+avx2k(uint32_t size) {
+    mshabal256_context x;
+
+    mshabal256_init(&x);
+    mshabal256(&x, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7], size);
+    mshabal256_close(&x, (uint32_t *)out[0], (uint32_t *)out[1], (uint32_t *)out[2], (uint32_t *)out[3],
+                     (uint32_t *)out[4], (uint32_t *)out[5], (uint32_t *)out[6], (uint32_t *)out[7]);
+}
+
+// }}}
+// {{{ engines           whole nonces into a stagger buffer
+
+void
+noncek(uint32_t first) {
+    nonce(cache, GOLDEN_NONCES, GOLDEN_ADDR, first, first);
+}
+
+void
+mnoncek(uint32_t first) {
+    mnonce(cache, GOLDEN_NONCES, GOLDEN_ADDR, GOLDEN_ADDR, GOLDEN_ADDR, GOLDEN_ADDR,
+           first, first + 1, first + 2, first + 3, first, first + 1, first + 2, first + 3);
+}
+
+void
+m256noncek(uint32_t first) {
+    m256nonce(cache, GOLDEN_NONCES, GOLDEN_ADDR, GOLDEN_ADDR, GOLDEN_ADDR, GOLDEN_ADDR,
+              GOLDEN_ADDR, GOLDEN_ADDR, GOLDEN_ADDR, GOLDEN_ADDR,
+              first, first + 1, first + 2, first + 3, first + 4, first + 5, first + 6, first + 7, first);
+}
+
+void
+epiloguek(uint32_t pos) {
+    noncexor(data[0], out[0]);
+    noncescatter(cache, GOLDEN_NONCES, pos, data[0]);
+}
+
+// Plots the golden nonces with an engine once, reports the time and checks
+// the result
+int
+golden(const char *engine, benchfn fn, uint32_t lanes) {
+    uint32_t n;
+    uint64_t sum, ns;
+
+    memset(cache, 0, (uint64_t)GOLDEN_NONCES * NONCE_SIZE);
+    ns = nowns();
+    for (n = 0; n < GOLDEN_NONCES; n += lanes)
+        fn(n);
+    ns  = nowns() - ns;
+    sum = xxh64(cache, (uint64_t)GOLDEN_NONCES * NONCE_SIZE, 0);
+    report(engine, "golden", GOLDEN_NONCES, NONCE_SIZE, (double)ns);
+    if (sum != GOLDEN_XXH64) {
+        fprintf(stderr, "%s: golden plot mismatch (%016" PRIx64 ")\n", engine, sum);
+        return 1;
+    }
+    return 0;
+}
+
+// The library's batch API, with its best core, in both layouts: the nonce
+// layout transposed back has to give the golden plot as well
+int
+library(void) {
+    struct engraver ctx;
+    char *nonces = malloc((uint64_t)GOLDEN_NONCES * NONCE_SIZE);
+    uint64_t sum, ns;
+    uint32_t n;
+    int failed = 0;
+
+    if (nonces == NULL || engraver_init(&ctx, -1) < 0) {
+        fprintf(stderr, "generate_nonces: no context\n");
+        return 1;
+    }
+    ns = nowns();
+    generate_nonces(&ctx, GOLDEN_ADDR, 0, GOLDEN_NONCES, cache, ENGRAVER_POC2);
+    ns = nowns() - ns;
+    report("generate_nonces", "golden", GOLDEN_NONCES, NONCE_SIZE, (double)ns);
+    sum = xxh64(cache, (uint64_t)GOLDEN_NONCES * NONCE_SIZE, 0);
+
+    generate_nonces(&ctx, GOLDEN_ADDR, 0, GOLDEN_NONCES, nonces, ENGRAVER_NONCES);
+    for (n = 0; n < GOLDEN_NONCES; n++)
+        engraver_scatterlane(cache, GOLDEN_NONCES, n, nonces + (uint64_t)n * NONCE_SIZE, 1, 0);
+    if (sum != GOLDEN_XXH64 || xxh64(cache, (uint64_t)GOLDEN_NONCES * NONCE_SIZE, 0) != GOLDEN_XXH64) {
+        fprintf(stderr, "generate_nonces: golden plot mismatch\n");
+        failed = 1;
+    }
+    engraver_free(&ctx);
+    free(nonces);
+    return failed;
+}
+
+// }}}
+
+int
+main(int argc, char **argv) {
+    const uint32_t sizes[] = { 64, 4096, 16 + NONCE_SIZE };
+    const char *names[]    = { "64", "4096", "nonce" };
+    int sse4 = __builtin_cpu_supports("sse4.1");
+    int avx2 = __builtin_cpu_supports("avx2");
+    int c, k, failed = 0;
+
+    while ((c = getopt(argc, argv, "r:f:")) != -1) {
+        switch (c) {
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'f':
+            json = !strcmp(optarg, "json");
+            break;
+        default:
+            printf("Usage: %s [-r REPEATS] [-f csv|json]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (repeats < 1)
+        repeats = 1;
+
+    cache = malloc((uint64_t)GOLDEN_NONCES * NONCE_SIZE);
+    for (k = 0; k < 8; k++) {
+        data[k] = malloc(16 + NONCE_SIZE);
+        if (data[k] == NULL) {
+            printf("Error allocating memory.\n");
+            return 2;
+        }
+        memset(data[k], k + 1, 16 + NONCE_SIZE);
+    }
+    if (cache == NULL) {
+        printf("Error allocating memory.\n");
+        return 2;
+    }
+
+    if (json)
+        printf("[");
+    else
+        printf("kernel,case,lanes,bytes,median_ns,mb_per_s,per_s\n");
+
+    for (k = 0; k < 3; k++) {
+        report("shabal", names[k], 1, sizes[k], measure(shabalk, sizes[k]));
+        if (sse4)
+            report("sse4_mshabal", names[k], 4, sizes[k], measure(sse4k, sizes[k]));
+        if (avx2)
+            report("mshabal256", names[k], 8, sizes[k], measure(avx2k, sizes[k]));
+    }
+
+    report("nonce", "pipeline", 1, NONCE_SIZE, measure(noncek, 0));
+    if (sse4)
+        report("mnonce", "pipeline", 4, NONCE_SIZE, measure(mnoncek, 0));
+    if (avx2)
+        report("m256nonce", "pipeline", 8, NONCE_SIZE, measure(m256noncek, 0));
+    report("epilogue", "xor+scatter", 1, NONCE_SIZE, measure(epiloguek, 0));
+
+    failed |= golden("nonce", noncek, 1);
+    if (sse4)
+        failed |= golden("mnonce", mnoncek, 4);
+    if (avx2)
+        failed |= golden("m256nonce", m256noncek, 8);
+    failed |= library();
+
+    if (json)
+        printf("\n]\n");
+    return failed;
+}
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "check.h"
+
+#define SCOOP_SIZE      64
+
+// {{{ xxh64             checksum of a scoop block
+
+// XXH64: four independent accumulators per 32 byte stripe, so the core loop
+// keeps the multipliers of a modern CPU busy and runs at memory speed.
+#define PRIME64_1   0x9E3779B185EBCA87ULL
+#define PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3   0x165667B19E3779F9ULL
+#define PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define PRIME64_5   0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t
+read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc  = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t
+xxh64(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p   = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    }
+    else {
+        h = seed + PRIME64_5;
+    }
+
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h  = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h  = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * PRIME64_5;
+        h  = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// }}}
+// {{{ check_plot        validate a plot file against its sidecar
+
+// Reads the plot file scoop by scoop, which is sequential on disk, and
+// compares every scoop block with the checksum recorded when it was written.
+// Returns 0 if everything matches, 1 on mismatches and -1 on errors. If bad
+// is given, it gets the first and last nonce of every corrupted range.
+int
+check_plot(const char *plotfile, uint64_t **bad, uint32_t *numbad) {
+    char sidecar[4096];
+    struct checkheader *ch = MAP_FAILED;
+    struct checkrecord *rec;
+    struct stat st;
+    uint64_t numrecords, covered = 0, maxlen = 0, i, badblocks = 0, badranges = 0;
+    uint32_t *badscoops = NULL;
+    char *buf = NULL;
+    int fd, cfd = -1, ret = -1;
+    uint32_t s;
+
+    snprintf(sidecar, sizeof sidecar, "%s.check", plotfile);
+
+    if ((fd = open(plotfile, O_RDONLY)) < 0) {
+        perror(plotfile);
+        return -1;
+    }
+    if ((cfd = open(sidecar, O_RDONLY)) < 0 || fstat(cfd, &st) < 0) {
+        perror(sidecar);
+        goto done;
+    }
+    if ((uint64_t)st.st_size < sizeof *ch) {
+        printf("%s is too short.\n", sidecar);
+        goto done;
+    }
+    ch = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cfd, 0);
+    if (ch == MAP_FAILED) {
+        perror("mmap");
+        goto done;
+    }
+    if (memcmp(ch->magic, CHECK_MAGIC, sizeof ch->magic) || ch->version != CHECK_VERSION) {
+        printf("%s is not a checksum sidecar.\n", sidecar);
+        goto done;
+    }
+
+    rec        = (struct checkrecord *)(ch + 1);
+    numrecords = (st.st_size - sizeof *ch) / sizeof *rec;
+    for (i = 0; i < numrecords; i++) {
+        if (rec[i].run + rec[i].len > ch->nonces) {
+            printf("%s: record %" PRIu64 " is out of range.\n", sidecar, i);
+            goto done;
+        }
+        covered += rec[i].len;
+        if (rec[i].len > maxlen)
+            maxlen = rec[i].len;
+    }
+
+    printf("Checking %" PRIu64 " of %" PRIu64 " nonces of %s in %" PRIu64 " blocks per scoop...\n",
+           covered, ch->nonces, plotfile, numrecords);
+
+    buf = malloc(maxlen * SCOOP_SIZE);
+    badscoops = calloc(numrecords ? numrecords : 1, sizeof *badscoops);
+    if (buf == NULL || badscoops == NULL) {
+        printf("Error allocating memory.\n");
+        goto done;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (s = 0; s < CHECK_SCOOPS; s++) {
+        for (i = 0; i < numrecords; i++) {
+            uint64_t size = (uint64_t)rec[i].len * SCOOP_SIZE;
+            uint64_t pos  = ((uint64_t)s * ch->nonces + rec[i].run) * SCOOP_SIZE;
+
+            if (pread(fd, buf, size, pos) < (ssize_t)size) {
+                printf("\nError while reading %s at %" PRIu64 ": %d\n", plotfile, pos, errno);
+                goto done;
+            }
+            if (xxh64(buf, size, 0) != rec[i].sum[s]) {
+                badscoops[i]++;
+                badblocks++;
+            }
+        }
+        if (s % 256 == 255) {
+            printf("\33[2K\r%5.2f%% checked, %" PRIu64 " bad blocks", 100.0 * (s + 1) / CHECK_SCOOPS, badblocks);
+            fflush(stdout);
+        }
+    }
+    printf("\n");
+
+    if (bad != NULL) {
+        *bad    = malloc((numrecords ? numrecords : 1) * 2 * sizeof **bad);
+        *numbad = 0;
+    }
+    for (i = 0; i < numrecords; i++) {
+        if (badscoops[i] == 0)
+            continue;
+        printf("Nonces %" PRIu64 " to %" PRIu64 ": %u of %d scoops bad\n",
+               ch->startnonce + rec[i].run, ch->startnonce + rec[i].run + rec[i].len - 1, badscoops[i], CHECK_SCOOPS);
+        if (bad != NULL && *bad != NULL) {
+            (*bad)[*numbad * 2]     = ch->startnonce + rec[i].run;
+            (*bad)[*numbad * 2 + 1] = ch->startnonce + rec[i].run + rec[i].len - 1;
+            (*numbad)++;
+        }
+        badranges++;
+    }
+    if (covered < ch->nonces) {
+        printf("%" PRIu64 " nonces have no checksums (plot not finished?)\n", ch->nonces - covered);
+    }
+    printf("%s: %s\n", plotfile, badranges ? "CORRUPTED" : "OK");
+    ret = badranges ? 1 : 0;
+
+done:
+    free(badscoops);
+    free(buf);
+    if (ch != MAP_FAILED)
+        munmap(ch, st.st_size);
+    if (cfd >= 0)
+        close(cfd);
+    close(fd);
+    return ret;
+}
+
+// }}}
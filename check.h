@@ -0,0 +1,29 @@
+#include <stdint.h>
+#include <stddef.h>
+
+// Checksum sidecar (<plotfile>.check) written next to a plot file: a header
+// followed by one record per written round, holding the checksum of every
+// scoop block of that round.
+#define CHECK_MAGIC     "ENGRVCHK"
+#define CHECK_VERSION   1
+#define CHECK_SCOOPS    4096
+
+struct checkheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t addr;
+    uint64_t startnonce;
+    uint64_t nonces;
+    uint64_t pad[3];
+};
+
+struct checkrecord {
+    uint64_t run;           // first nonce of the round, relative to the plot
+    uint32_t len;           // nonces in the round
+    uint32_t reserved;
+    uint64_t sum[CHECK_SCOOPS];
+};
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+int check_plot(const char *plotfile, uint64_t **bad, uint32_t *numbad);
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "nonce.h"
+#include "engraver.h"
+#include "stream.h"
+#include "perf.h"
+#include "plot.h"
+#include "control.h"
+
+char *controlpath      = NULL;
+int paused             = 0;     // no new rounds are opened
+uint32_t activethreads = 0;     // hashing threads and --serve workers that may hash, 0 for all
+volatile double writecap = 0;   // MB/s per plot file, 0 for no limit
+
+// {{{ control_i         local control socket
+
+// Answers one command line of a --control client
+void
+controlcommand(FILE *c, char *line) {
+    char cmd[32] = "";
+    double value = 0;
+    int args = sscanf(line, "%31s %lf", cmd, &value);
+    uint64_t now = getMS();
+    uint32_t f;
+
+    pthread_mutex_lock(&poolmutex);
+    if (args >= 1 && !strcmp(cmd, "status")) {
+        fprintf(c, "{\"paused\": %s, \"threads\": %u, \"max_threads\": %u, \"bandwidth_mbs\": %.1f, \"files\": [",
+                paused ? "true" : "false", activethreads ? activethreads : threads + networkers, threads + networkers, writecap);
+        for (f = 0; f < numfiles; f++) {
+            struct plotfile *pf = &plotfiles[f];
+            char name[2 * PATH_MAX];
+            double eta, rate = progressrate(pf, now, &eta);
+
+            escapestr(name, sizeof name, progressname(pf));
+            fprintf(c, "%s{\"file\": \"%s\", \"account\": %" PRIu64 ", \"nonces\": %" PRIu64 ", \"hashed\": %" PRIu64 ", \"total\": %u, "
+                    "\"nonces_per_min\": %.0f, \"eta_s\": %.0f, \"buffers_busy\": %u, \"yielding\": %s, \"yields\": %" PRIu64 "}",
+                    f ? ", " : "", name, pf->addr, pf->written, pf->run, pf->nonces, rate, eta, progressbusy(pf),
+                    now < pf->yielduntil ? "true" : "false", pf->yields);
+        }
+        fprintf(c, "]}\n");
+    }
+    else if (args >= 1 && !strcmp(cmd, "pause")) {
+        paused = 1;
+        fprintf(c, "ok pausing after the rounds being hashed\n");
+    }
+    else if (args >= 1 && !strcmp(cmd, "resume")) {
+        paused = 0;
+        fprintf(c, "ok resumed\n");
+    }
+    else if (args == 2 && !strcmp(cmd, "threads") && value >= 1) {
+        // Local threads and connected workers count alike
+        activethreads = (value < threads + networkers) ? (uint32_t)value : 0;
+        fprintf(c, "ok %u of %u threads\n", activethreads ? activethreads : threads + networkers, threads + networkers);
+    }
+    else if (args >= 1 && !strcmp(cmd, "newblock")) {
+        char dir[PATH_MAX] = "";
+
+        sscanf(line, "%*s %4095s", dir);
+        fprintf(c, "ok %u plot files yield for %.1fs\n", yieldstart(dir[0] ? dir : NULL), yieldwindow);
+    }
+    else if (args == 2 && !strcmp(cmd, "bandwidth") && value >= 0) {
+        writecap = value;
+        if (value > 0)
+            fprintf(c, "ok %.1f MB/s per plot file\n", value);
+        else
+            fprintf(c, "ok no bandwidth limit\n");
+    }
+    else {
+        fprintf(c, "error: use status, pause, resume, threads <n>, bandwidth <MB/s> or newblock [<dir>]\n");
+    }
+    // Parked threads and a paused pool look at the new settings
+    pthread_cond_broadcast(&poolcond);
+    pthread_mutex_unlock(&poolmutex);
+    fflush(c);
+}
+
+// Seconds a control client may stay silent before the next one is served
+#define CONTROL_TIMEOUT 5
+
+// One client at a time, one command per line
+void *
+control_i(void *x_void_ptr) {
+    int lfd = *(int *)x_void_ptr;
+    struct timeval tv = { CONTROL_TIMEOUT, 0 };
+    char line[256];
+
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        FILE *c;
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        if ((c = fdopen(fd, "r+")) == NULL) {
+            close(fd);
+            continue;
+        }
+        while (fgets(line, sizeof line, c) != NULL)
+            controlcommand(c, line);
+        fclose(c);
+    }
+    return NULL;
+}
+
+// Listens on path and serves its clients from a detached thread
+void
+controlstart(const char *path) {
+    static int cfd;
+    char source[PATH_MAX + 8];
+    pthread_t controller;
+
+    snprintf(source, sizeof source, "unix:%s", path);
+    if ((cfd = stream_listen(source)) < 0) {
+        printf("Unable to listen on %s\n", path);
+        exit(1);
+    }
+    if (pthread_create(&controller, NULL, control_i, &cfd)) {
+        printf("Error creating thread.\n");
+        exit(-1);
+    }
+    pthread_detach(controller);
+}
+
+// }}}
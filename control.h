@@ -0,0 +1,10 @@
+#include <stdint.h>
+
+// --control: settings changed from a local socket while plotting. The pool
+// reads them with poolmutex held.
+extern char *controlpath;
+extern int paused;
+extern uint32_t activethreads;
+extern volatile double writecap;
+
+void controlstart(const char *path);
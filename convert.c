@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "check.h"
+#include "plot.h"
+#include "convert.h"
+
+char *convertfile    = NULL;
+int convertinplace   = 0;
+
+// {{{ convert           PoC1 plot file to PoC2
+
+// Nonces per conversion window. A window of the output is completed scoop
+// pair by scoop pair and gets one record in the checksum sidecar.
+#define CONVERT_WINDOW  65536
+
+// Scoop pairs per read, scratch log and write
+#define CONVERT_GROUP   8
+
+// State of an in place conversion (<plotfile>.converting), followed by the
+// scratch: the second hashes of the group of converted scoop pairs that is
+// being written. Only they change, so writing them again after a crash
+// finishes the group instead of swapping some of its pairs twice.
+struct convertstate {
+    uint64_t first;         // window
+    uint64_t pair;          // pairs of the window that are done
+    uint64_t logged;        // the scratch holds pairs <pair>..<pair + logged>
+    uint64_t count;         // nonces of the window
+    uint64_t check;         // of the scratch; a mismatch means the group is on disk
+};
+
+struct convertio {
+    uint64_t first;         // first nonce of the window
+    uint32_t count;
+    uint32_t pair, pairs;   // scoop pairs pair..pair+pairs: s and 4095 - s
+    char *buf;              // their scoop blocks: s, 4095 - s, s + 1, 4094 - s...
+    int failed;
+    int full;               // read, and not converted yet
+};
+
+// One reader thread reads the groups of the whole conversion in order,
+// into two buffers, while the groups before are converted and written
+struct convertreader {
+    int fd;
+    uint64_t nonces;
+    uint32_t stagger;       // of the PoC1 file
+    uint64_t first;         // where to start
+    uint32_t pair;
+    struct convertio io[2];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+// Reads nonces first..first+count of one scoop of a staggered PoC1 file:
+// groups of <stagger> nonces, each holding all scoops of its nonces
+int
+readpoc1scoop(struct convertreader *cr, struct convertio *io, uint32_t scoop, char *buf) {
+    uint64_t n = io->first, end = io->first + io->count;
+
+    while (n < end) {
+        uint64_t group = n / cr->stagger, off = n % cr->stagger;
+        uint64_t len   = (cr->stagger - off < end - n) ? cr->stagger - off : end - n;
+        uint64_t pos   = group * cr->stagger * NONCE_SIZE + ((uint64_t)scoop * cr->stagger + off) * SCOOP_SIZE;
+
+        if (pread(cr->fd, buf, len * SCOOP_SIZE, pos) < (ssize_t)(len * SCOOP_SIZE))
+            return -1;
+        buf += len * SCOOP_SIZE;
+        n   += len;
+    }
+    return 0;
+}
+
+void *
+convertread_i(void *x_void_ptr) {
+    struct convertreader *cr = x_void_ptr;
+    uint64_t first = cr->first;
+    uint32_t pair  = cr->pair, i, k;
+
+    if (pair == NUM_SCOOPS / 2) {
+        first += CONVERT_WINDOW;
+        pair   = 0;
+    }
+    for (i = 0; first < cr->nonces; i++) {
+        struct convertio *io = &cr->io[i % 2];
+
+        pthread_mutex_lock(&cr->mutex);
+        while (io->full)
+            pthread_cond_wait(&cr->cond, &cr->mutex);
+        pthread_mutex_unlock(&cr->mutex);
+
+        io->first  = first;
+        io->count  = (cr->nonces - first < CONVERT_WINDOW) ? cr->nonces - first : CONVERT_WINDOW;
+        io->pair   = pair;
+        io->pairs  = (NUM_SCOOPS / 2 - pair < CONVERT_GROUP) ? NUM_SCOOPS / 2 - pair : CONVERT_GROUP;
+        io->failed = 0;
+        for (k = 0; k < io->pairs * 2 && !io->failed; k++) {
+            uint32_t s = (k % 2) ? NUM_SCOOPS - 1 - pair - k / 2 : pair + k / 2;
+
+            io->failed = readpoc1scoop(cr, io, s, io->buf + (uint64_t)k * io->count * SCOOP_SIZE) < 0;
+        }
+        if ((pair += io->pairs) == NUM_SCOOPS / 2) {
+            first += CONVERT_WINDOW;
+            pair   = 0;
+        }
+
+        pthread_mutex_lock(&cr->mutex);
+        io->full = 1;
+        pthread_cond_broadcast(&cr->cond);
+        pthread_mutex_unlock(&cr->mutex);
+    }
+    return NULL;
+}
+
+// Writes the converted scoop pairs st->pair..st->pair+st->logged of window
+// st->first from buf. In place, their second hashes go to the scratch and
+// the state says so before the plot is touched; the state only moves on
+// once the pairs are on disk.
+int
+convertlog(struct plotfile *out, int statefd, struct convertstate *st, char *buf, char *scratch) {
+    uint64_t size = st->count * SCOOP_SIZE;
+    uint64_t logsize = st->logged * 2 * st->count * HASH_SIZE;
+    uint64_t k, n;
+
+    if (statefd >= 0) {
+        for (k = 0; k < st->logged * 2; k++) {
+            for (n = 0; n < st->count; n++)
+                memcpy(&scratch[(k * st->count + n) * HASH_SIZE], &buf[k * size + n * SCOOP_SIZE + HASH_SIZE], HASH_SIZE);
+        }
+        st->check = xxh64(scratch, logsize, 0);
+        if (pwrite(statefd, scratch, logsize, sizeof *st) < (ssize_t)logsize || fdatasync(statefd) < 0
+            || pwrite(statefd, st, sizeof *st, 0) < (ssize_t)sizeof *st || fdatasync(statefd) < 0)
+            return -1;
+    }
+    for (k = 0; k < st->logged * 2; k++) {
+        uint32_t s   = (k % 2) ? NUM_SCOOPS - 1 - st->pair - k / 2 : st->pair + k / 2;
+        uint64_t pos = ((uint64_t)s * out->nonces + st->first) * SCOOP_SIZE;
+
+        if (pwrite(out->ofd, &buf[k * size], size, pos) < (ssize_t)size)
+            return -1;
+    }
+    if (statefd >= 0) {
+        // Not synced: an older state only has the group written again,
+        // or finds the scratch of the next group and skips it
+        st->pair  += st->logged;
+        st->logged = 0;
+        if (fdatasync(out->ofd) < 0 || pwrite(statefd, st, sizeof *st, 0) < (ssize_t)sizeof *st)
+            return -1;
+    }
+    return 0;
+}
+
+// Finishes the group an interrupted in place conversion was writing, by
+// writing the second hashes from the scratch into its scoop blocks
+int
+convertreplay(struct plotfile *out, int statefd, struct convertstate *st, char *block, char *scratch) {
+    uint64_t size = st->count * SCOOP_SIZE;
+    uint64_t logsize = st->logged * 2 * st->count * HASH_SIZE;
+    uint64_t k, n;
+
+    if (pread(statefd, scratch, logsize, sizeof *st) == (ssize_t)logsize && xxh64(scratch, logsize, 0) == st->check) {
+        for (k = 0; k < st->logged * 2; k++) {
+            uint32_t s   = (k % 2) ? NUM_SCOOPS - 1 - st->pair - k / 2 : st->pair + k / 2;
+            uint64_t pos = ((uint64_t)s * out->nonces + st->first) * SCOOP_SIZE;
+
+            if (pread(out->ofd, block, size, pos) < (ssize_t)size)
+                return -1;
+            for (n = 0; n < st->count; n++)
+                memcpy(&block[n * SCOOP_SIZE + HASH_SIZE], &scratch[(k * st->count + n) * HASH_SIZE], HASH_SIZE);
+            if (pwrite(out->ofd, block, size, pos) < (ssize_t)size)
+                return -1;
+        }
+        if (fdatasync(out->ofd) < 0)
+            return -1;
+    }
+    st->pair  += st->logged;
+    st->logged = 0;
+    if (pwrite(statefd, st, sizeof *st, 0) < (ssize_t)sizeof *st || fdatasync(statefd) < 0)
+        return -1;
+    return 0;
+}
+
+// Converts a PoC1 plot file KEY_START_NONCES_STAGGER into an optimized PoC2
+// file in outputdir, or in place if it already is optimized (stagger equals
+// nonces). PoC2 swaps the second hash of scoop s with the one of scoop
+// 4095 - s, just like revPosition does when plotting.
+int
+convert(char *plotfile, char *outputdir, int inplace) {
+    struct plotfile out;
+    struct convertreader cr;
+    pthread_t reader;
+    char *base = strrchr(plotfile, '/');
+    char statename[PATH_MAX + 8];
+    struct convertstate st = { 0, 0, 0, 0, 0 };
+    uint64_t plotaddr, plotstart, first, ms;
+    uint32_t plotnonces, stagger, p, pairs, i, k, b;
+    char *block, *scratch;
+    int infd, statefd = -1;
+
+    memset(&out, 0, sizeof out);
+    memset(&cr, 0, sizeof cr);
+    base = (base == NULL) ? plotfile : base + 1;
+    if (sscanf(base, "%" SCNu64 "_%" SCNu64 "_%u_%u", &plotaddr, &plotstart, &plotnonces, &stagger) != 4 || plotnonces == 0 || stagger == 0) {
+        printf("%s is not a PoC1 plot file named KEY_STARTNONCE_NONCES_STAGGER.\n", plotfile);
+        return 2;
+    }
+    if (plotnonces % stagger) {
+        printf("%u nonces are not a multiple of the stagger size %u.\n", plotnonces, stagger);
+        return 2;
+    }
+    if (inplace && stagger != plotnonces) {
+        printf("Only optimized plot files (stagger size = nonces) can be converted in place.\n");
+        return 2;
+    }
+
+    if ((infd = open(plotfile, inplace ? O_RDWR : O_RDONLY)) < 0) {
+        perror(plotfile);
+        return 2;
+    }
+    if ((uint64_t)LSEEK(infd, 0, SEEK_END) < (uint64_t)plotnonces * NONCE_SIZE) {
+        printf("%s is shorter than %u nonces.\n", plotfile, plotnonces);
+        return 2;
+    }
+
+    out.addr       = plotaddr;
+    out.startnonce = plotstart;
+    out.nonces     = plotnonces;
+    if (inplace) {
+        char *slash = strrchr(plotfile, '/');
+
+        snprintf(out.name, sizeof out.name, "%s", plotfile);
+        snprintf(out.finalname, sizeof out.finalname, "%.*s%" PRIu64 "_%" PRIu64 "_%u",
+                 slash ? (int)(slash - plotfile + 1) : 0, plotfile, plotaddr, plotstart, plotnonces);
+        out.ofd = infd;
+    }
+    else {
+        mkdir(outputdir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+        snprintf(out.name, sizeof out.name, "%s%" PRIu64 "_%" PRIu64 "_%u.converting", outputdir, plotaddr, plotstart, plotnonces);
+        snprintf(out.finalname, sizeof out.finalname, "%s%" PRIu64 "_%" PRIu64 "_%u", outputdir, plotaddr, plotstart, plotnonces);
+        out.ofd = open(out.name, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (out.ofd < 0) {
+            perror(out.name);
+            return 2;
+        }
+        if (posix_fallocate(out.ofd, 0, (uint64_t)plotnonces * NONCE_SIZE) != 0) {
+            printf("File pre-allocation failed.\n");
+            return 2;
+        }
+    }
+
+    cr.fd      = infd;
+    cr.nonces  = plotnonces;
+    cr.stagger = stagger;
+    pthread_mutex_init(&cr.mutex, NULL);
+    pthread_cond_init(&cr.cond, NULL);
+    for (k = 0; k < 2; k++) {
+        cr.io[k].buf = malloc((uint64_t)CONVERT_GROUP * 2 * CONVERT_WINDOW * SCOOP_SIZE);
+        if (cr.io[k].buf == NULL) {
+            printf("Error allocating memory.\n");
+            return 2;
+        }
+    }
+    block   = malloc((uint64_t)CONVERT_WINDOW * SCOOP_SIZE);
+    scratch = malloc((uint64_t)CONVERT_GROUP * 2 * CONVERT_WINDOW * HASH_SIZE);
+    if (block == NULL || scratch == NULL) {
+        printf("Error allocating memory.\n");
+        return 2;
+    }
+
+    // In place, a scoop pair must not be swapped twice: the position after
+    // the last durable pair is kept in a state file
+    first = 0;
+    p     = 0;
+    if (inplace) {
+        snprintf(statename, sizeof statename, "%s.converting", plotfile);
+        statefd = open(statename, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (statefd < 0) {
+            perror(statename);
+            return 2;
+        }
+        if (pread(statefd, &st, sizeof st, 0) == sizeof st && st.first < plotnonces && st.count <= CONVERT_WINDOW
+            && st.logged <= CONVERT_GROUP && st.pair + st.logged <= NUM_SCOOPS / 2) {
+            if (st.logged > 0 && convertreplay(&out, statefd, &st, block, scratch) < 0) {
+                printf("Unable to replay the scratch of %s\n", statename);
+                return 2;
+            }
+            first = st.first;
+            p     = st.pair;
+            printf("Resuming conversion at nonce %" PRIu64 ", scoop pair %u\n", plotstart + first, p);
+        }
+    }
+    if (checkopen(&out, first) < 0)
+        exit(1);
+
+    posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    printf("Converting %u nonces (%" PRIu64 " to %" PRIu64 ") with stagger size %u to %s\n",
+           plotnonces, plotstart, plotstart + plotnonces, stagger, out.finalname);
+
+    cr.first = first;
+    cr.pair  = p;
+    if (pthread_create(&reader, NULL, convertread_i, &cr)) {
+        printf("Error creating thread.\n");
+        exit(-1);
+    }
+
+    ms = getMS();
+    for (i = 0; first < plotnonces; first += CONVERT_WINDOW, p = 0) {
+        uint32_t count = (plotnonces - first < CONVERT_WINDOW) ? plotnonces - first : CONVERT_WINDOW;
+
+        // Pairs converted before an interruption only need their checksums
+        for (k = 0; k < p; k++) {
+            for (b = 0; b < 2; b++) {
+                uint32_t s   = b ? NUM_SCOOPS - 1 - k : k;
+                uint64_t pos = ((uint64_t)s * plotnonces + first) * SCOOP_SIZE;
+
+                if (pread(out.ofd, block, (uint64_t)count * SCOOP_SIZE, pos) < (ssize_t)(count * SCOOP_SIZE)) {
+                    printf("\nError while reading from file: %d\n", errno);
+                    return 2;
+                }
+                out.checkrec->sum[s] = xxh64(block, (uint64_t)count * SCOOP_SIZE, 0);
+            }
+        }
+
+        // Group i + 1 is read while group i is shuffled and written
+        for (; p < NUM_SCOOPS / 2; p += pairs, i++) {
+            struct convertio *cur = &cr.io[i % 2];
+            uint64_t size = (uint64_t)count * SCOOP_SIZE;
+            uint32_t n;
+
+            pthread_mutex_lock(&cr.mutex);
+            while (!cur->full)
+                pthread_cond_wait(&cr.cond, &cr.mutex);
+            pthread_mutex_unlock(&cr.mutex);
+            if (cur->failed) {
+                printf("\nError while reading from file: %d\n", errno);
+                return 2;
+            }
+
+            for (k = 0; k < cur->pairs; k++) {
+                char *lo = &cur->buf[2 * k * size], *hi = &cur->buf[(2 * k + 1) * size];
+
+                for (n = 0; n < count; n++) {
+                    char tmp[HASH_SIZE];
+                    char *a = &lo[(uint64_t)n * SCOOP_SIZE + HASH_SIZE];
+                    char *z = &hi[(uint64_t)n * SCOOP_SIZE + HASH_SIZE];
+
+                    memcpy(tmp, a, HASH_SIZE);
+                    memcpy(a, z, HASH_SIZE);
+                    memcpy(z, tmp, HASH_SIZE);
+                }
+                out.checkrec->sum[p + k] = xxh64(lo, size, 0);
+                out.checkrec->sum[NUM_SCOOPS - 1 - p - k] = xxh64(hi, size, 0);
+            }
+
+            pairs     = cur->pairs;
+            st.first  = first;
+            st.pair   = p;
+            st.logged = pairs;
+            st.count  = count;
+            if (convertlog(&out, statefd, &st, cur->buf, scratch) < 0) {
+                perror("convert");
+                printf("\nError while writing to file: %d\n", errno);
+                return 2;
+            }
+
+            pthread_mutex_lock(&cr.mutex);
+            cur->full = 0;
+            pthread_cond_broadcast(&cr.cond);
+            pthread_mutex_unlock(&cr.mutex);
+        }
+
+        if (fdatasync(out.ofd) < 0 || checkappend(&out, first, count) < 0) {
+            perror("convert");
+            return 2;
+        }
+        if (statefd >= 0) {
+            st.first  = first + count;
+            st.pair   = 0;
+            st.logged = 0;
+            if (pwrite(statefd, &st, sizeof st, 0) < (ssize_t)sizeof st || fdatasync(statefd) < 0) {
+                perror(statename);
+                return 2;
+            }
+        }
+        printf("\33[2K\r%5.2f%% converted", 100.0 * (first + count) / plotnonces);
+        fflush(stdout);
+    }
+    ms = getMS() - ms;
+    pthread_join(reader, NULL);
+    for (k = 0; k < 2; k++)
+        free(cr.io[k].buf);
+    free(block);
+    free(scratch);
+
+    close(out.ofd);
+    if (rename(out.name, out.finalname) < 0) {
+        printf("Error while renaming file: %d\n", errno);
+        return 2;
+    }
+    if (out.cfd >= 0) {
+        char from[PATH_MAX + 8], to[PATH_MAX + 8];
+
+        close(out.cfd);
+        snprintf(from, sizeof from, "%s.check", out.name);
+        snprintf(to, sizeof to, "%s.check", out.finalname);
+        rename(from, to);
+    }
+    if (statefd >= 0) {
+        close(statefd);
+        unlink(statename);
+    }
+    else {
+        close(infd);
+    }
+
+    printf("\nConverted %u nonces in %.1fs into %s\n", plotnonces, (double)ms / 1000000, out.finalname);
+    return 0;
+}
+
+// }}}
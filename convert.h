@@ -0,0 +1,7 @@
+#include <stdint.h>
+
+// --convert: PoC1 plot file to PoC2, into a new file or in place
+extern char *convertfile;
+extern int convertinplace;
+
+int convert(char *plotfile, char *outputdir, int inplace);
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "plot.h"
+#include "daemon.h"
+
+char *daemonspool    = NULL;
+
+// {{{ plotdaemon        plot jobs from a spool directory
+
+#define DAEMON_POLL_US  1000000
+#define DAEMON_JOBS     64
+
+// A job is a file <name>.job in the spool directory with the options of one
+// plot file: -k KEY [-d DIRECTORY] [-s STARTNONCE] [-n NONCES]. A job taken
+// is renamed to <name>.running and rewritten with the start nonce and the
+// nonces it got, so that a restarted daemon resumes it; then to <name>.done
+// or <name>.failed.
+struct daemonjob {
+    char name[PATH_MAX];        // spool path without the suffix
+    char dir[PATH_MAX];
+    uint64_t addr, startnonce;
+    uint32_t nonces;
+    int startgiven;
+    int resume;
+    int file;                   // plot file of the batch, -1 if it failed
+};
+
+int
+daemonparse(const char *path, struct daemonjob *job) {
+    char buf[2 * PATH_MAX], *tok, *save = NULL;
+    FILE *f = fopen(path, "r");
+    size_t len;
+
+    if (f == NULL)
+        return -1;
+    len = fread(buf, 1, sizeof buf - 1, f);
+    fclose(f);
+    buf[len] = 0;
+
+    for (tok = strtok_r(buf, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        char *value = strtok_r(NULL, " \t\r\n", &save);
+
+        if (value == NULL)
+            return -1;
+        if (!strcmp(tok, "-k"))
+            job->addr = strtoull(value, 0, 10);
+        else if (!strcmp(tok, "-d"))
+            snprintf(job->dir, sizeof job->dir, "%s", value);
+        else if (!strcmp(tok, "-s")) {
+            job->startnonce = strtoull(value, 0, 10);
+            job->startgiven = 1;
+        }
+        else if (!strcmp(tok, "-n"))
+            job->nonces = strtoul(value, 0, 10);
+        else
+            return -1;
+    }
+    return (job->addr == 0) ? -1 : 0;
+}
+
+// Moves a job on to its next state
+void
+daemonstate(struct daemonjob *job, const char *from, const char *to) {
+    char src[PATH_MAX + 16], dst[PATH_MAX + 16];
+
+    snprintf(src, sizeof src, "%s%s", job->name, from);
+    snprintf(dst, sizeof dst, "%s%s", job->name, to);
+    rename(src, dst);
+}
+
+int
+cmpjobname(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// The next batch: jobs left running by a previous daemon first, then new
+// ones by name, at most one per directory so that jobs on different disks
+// are plotted interleaved and jobs on one disk back to back
+uint32_t
+daemonscan(struct daemonjob *jobs, const char *defaultdir) {
+    char *names[2 * DAEMON_JOBS];
+    uint32_t numnames = 0, numjobs = 0, k, j, pass;
+    struct dirent *de;
+    DIR *d = opendir(daemonspool);
+
+    if (d == NULL)
+        return 0;
+    while ((de = readdir(d)) != NULL && numnames < 2 * DAEMON_JOBS) {
+        size_t len = strlen(de->d_name);
+
+        if ((len > 4 && !strcmp(de->d_name + len - 4, ".job")) || (len > 8 && !strcmp(de->d_name + len - 8, ".running")))
+            names[numnames++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(names, numnames, sizeof *names, cmpjobname);
+
+    for (pass = 0; pass < 2; pass++) {
+        for (k = 0; k < numnames && numjobs < DAEMON_JOBS; k++) {
+            size_t len   = strlen(names[k]);
+            int running  = (len > 8 && !strcmp(names[k] + len - 8, ".running"));
+            struct daemonjob *job = &jobs[numjobs];
+            char path[PATH_MAX + NAME_MAX + 2];
+
+            if (running != (pass == 0))
+                continue;
+            memset(job, 0, sizeof *job);
+            snprintf(path, sizeof path, "%s/%s", daemonspool, names[k]);
+            snprintf(job->name, sizeof job->name, "%s/%.*s", daemonspool, (int)(len - (running ? 8 : 4)), names[k]);
+            job->resume = running;
+            if (daemonparse(path, job) < 0) {
+                printf("Job %s: use -k KEY [-d DIRECTORY] [-s STARTNONCE] [-n NONCES]\n", path);
+                daemonstate(job, running ? ".running" : ".job", ".failed");
+                continue;
+            }
+            if (job->dir[0] == 0)
+                snprintf(job->dir, sizeof job->dir, "%s", defaultdir);
+            if (job->dir[strlen(job->dir) - 1] != '/' && strlen(job->dir) < sizeof job->dir - 1)
+                strcat(job->dir, "/");
+            for (j = 0; j < numjobs && strcmp(jobs[j].dir, job->dir); j++)
+                ;
+            if (j < numjobs)
+                continue;
+            if (!running)
+                daemonstate(job, ".job", ".running");
+            numjobs++;
+        }
+    }
+    for (k = 0; k < numnames; k++)
+        free(names[k]);
+    return numjobs;
+}
+
+// Plots batch after batch until stopped. The hashing threads stay up and
+// the stagger buffers stay mapped between batches; every batch gets the
+// memory split among its plot files and a writer thread per file.
+int
+plotdaemon(uint64_t usememory, int rawinit) {
+    struct daemonjob *jobs = calloc(DAEMON_JOBS, sizeof *jobs);
+    char defaultdir[PATH_MAX];
+    uint32_t numjobs, done, j, f, k;
+    uint64_t batchstart;
+
+    if (jobs == NULL) {
+        printf("Error allocating memory.\n");
+        exit(-1);
+    }
+    snprintf(defaultdir, sizeof defaultdir, "%s", plotfiles[0].outputdir);
+    mkdir(daemonspool, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    srand(time(NULL));
+
+    pthread_mutex_lock(&poolmutex);
+    numfiles = 0;
+    pthread_mutex_unlock(&poolmutex);
+    printf("Waiting for jobs in %s\n", daemonspool);
+    fflush(stdout);
+
+    while (!stopping) {
+        if ((numjobs = daemonscan(jobs, defaultdir)) == 0) {
+            usleep(DAEMON_POLL_US);
+            continue;
+        }
+
+        // The idle hashing threads only look at the plot files with
+        // poolmutex held
+        pthread_mutex_lock(&poolmutex);
+        schedcursor = 0;
+        for (j = 0; j < numjobs; j++) {
+            struct daemonjob *job = &jobs[j];
+            uint32_t first = numfiles;
+            char path[PATH_MAX + 16];
+            FILE *jf;
+
+            printf("%s job %s: account %" PRIu64 " into %s\n", job->resume ? "Resuming" : "Starting", job->name, job->addr, job->dir);
+            adddirs(job->dir, 0);
+            plotfiles[first].addr = job->addr;
+            nonces     = job->nonces;
+            startnonce = job->startgiven ? job->startnonce : (uint64_t)rand() * (1 << 30) + rand();
+            if (setupplots(first, usememory / numjobs, job->resume, rawinit) != 0) {
+                printf("\nJob %s failed.\n", job->name);
+                dropplot(&plotfiles[first], 1);
+                numfiles  = first;
+                job->file = -1;
+                daemonstate(job, ".running", ".failed");
+                continue;
+            }
+            job->file = first;
+
+            snprintf(path, sizeof path, "%s.running", job->name);
+            if ((jf = fopen(path, "w")) != NULL) {
+                fprintf(jf, "-k %" PRIu64 " -d %s -s %" PRIu64 " -n %u\n", job->addr, job->dir,
+                        plotfiles[first].startnonce, plotfiles[first].nonces);
+                fclose(jf);
+            }
+        }
+        roundtrim(0);
+        pthread_mutex_unlock(&poolmutex);
+
+        batchstart      = getMS();
+        totalcreatetime = 0;
+        for (f = 0; f < numfiles; f++) {
+            if (pthread_create(&plotfiles[f].writeworker, NULL, writeworker_i, &plotfiles[f])) {
+                printf("Error creating thread. Out of memory? Try lower stagger size / fewer threads%s\n", (asyncmode == 1) ? " / remove async mode" : "");
+                exit(-1);
+            }
+        }
+        pthread_mutex_lock(&poolmutex);
+        pthread_cond_broadcast(&poolcond);
+        pthread_mutex_unlock(&poolmutex);
+        for (f = 0; f < numfiles; f++)
+            pthread_join(plotfiles[f].writeworker, NULL);
+
+        if (finishplots(0) < 0)
+            stopping = 1;
+        for (j = 0, done = 0; j < numjobs; j++) {
+            if (jobs[j].file < 0)
+                continue;
+            if (plotfiles[jobs[j].file].failed) {
+                printf("Job %s failed.\n", jobs[j].name);
+                daemonstate(&jobs[j], ".running", ".failed");
+                continue;
+            }
+            if (plotfiles[jobs[j].file].written < plotfiles[jobs[j].file].nonces) {
+                printf("Job %s stopped, to be resumed by the next daemon.\n", jobs[j].name);
+                continue;
+            }
+            daemonstate(&jobs[j], ".running", ".done");
+            printf("Job %s done.\n", jobs[j].name);
+            done++;
+        }
+        printf("%u of %u job(s) of the batch done in %.1fs.\n", done, numjobs, (double)(getMS() - batchstart) / 1000000);
+        fflush(stdout);
+
+        pthread_mutex_lock(&poolmutex);
+        for (f = 0; f < numfiles; f++) {
+            struct plotfile *pf = &plotfiles[f];
+
+            for (k = 0; k < pf->numrounds; k++)
+                pf->rounds[k].state = ROUND_FREE;
+            dropplot(pf, pf->failed);
+        }
+        numfiles = 0;
+        roundtrim(1);
+        pthread_mutex_unlock(&poolmutex);
+    }
+
+    // Let the hashing threads end
+    pthread_mutex_lock(&poolmutex);
+    daemonrunning = 0;
+    pthread_cond_broadcast(&poolcond);
+    pthread_mutex_unlock(&poolmutex);
+    free(jobs);
+    return 0;
+}
+
+// }}}
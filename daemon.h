@@ -0,0 +1,6 @@
+#include <stdint.h>
+
+// --daemon: plot jobs from a spool directory with warm buffers and threads
+extern char *daemonspool;
+
+int plotdaemon(uint64_t usememory, int rawinit);
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helper.h"
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "plot.h"
+#include "mine.h"
+#include "deadlines.h"
+
+char *deadlinesource = NULL;
+uint32_t noncecachesize = 256;
+
+// {{{ deadlines         batch deadline verification for pools
+
+// Submissions verified per batch at most
+#define DEADLINE_BATCH  4096
+
+struct submission {
+    uint64_t addr;
+    uint64_t nonce;
+    uint32_t scoop;
+    char gensig[HASH_SIZE];
+    uint64_t basetarget;
+    uint64_t deadline;      // result
+    int32_t next;           // next submission of the same nonce in the batch
+};
+
+// Regenerated nonces in PoC2 order (scoop s at s * 64), evicted least
+// recently used first, so a resubmitted nonce costs no hashing
+struct noncecacheentry {
+    uint64_t addr;
+    uint64_t nonce;
+    int32_t prev, next;     // LRU list, most recent first
+    int32_t hnext;          // hash chain
+    char *data;
+};
+
+struct noncecache {
+    struct noncecacheentry *entries;
+    uint32_t size, used;
+    int32_t *buckets;
+    uint32_t mask;
+    int32_t head, tail;
+    uint64_t hits, misses;
+};
+
+struct deadlinejob {
+    struct submission *subs;
+    int32_t *misses;        // first submission of every distinct nonce to hash
+    uint32_t nummisses;
+    uint32_t next;          // next miss to hash
+};
+
+struct noncecache noncecache;
+pthread_mutex_t deadlinemutex = PTHREAD_MUTEX_INITIALIZER;
+
+int
+noncecacheinit(struct noncecache *nc, uint32_t size) {
+    uint32_t b = 1;
+
+    while (b < size * 2)
+        b <<= 1;
+    memset(nc, 0, sizeof *nc);
+    nc->size    = size;
+    nc->mask    = b - 1;
+    nc->head    = nc->tail = -1;
+    nc->entries = calloc(size, sizeof *nc->entries);
+    nc->buckets = malloc(b * sizeof *nc->buckets);
+    if (nc->entries == NULL || nc->buckets == NULL)
+        return -1;
+    memset(nc->buckets, 0xff, b * sizeof *nc->buckets);
+    return 0;
+}
+
+static uint32_t
+noncecachebucket(struct noncecache *nc, uint64_t addr, uint64_t nonce) {
+    uint64_t h = (addr ^ (nonce * 0x9E3779B97F4A7C15ULL)) * 0xC2B2AE3D27D4EB4FULL;
+
+    return (uint32_t)(h >> 32) & nc->mask;
+}
+
+static void
+noncecacheunlink(struct noncecache *nc, int32_t i) {
+    struct noncecacheentry *e = &nc->entries[i];
+
+    if (e->prev >= 0)
+        nc->entries[e->prev].next = e->next;
+    else
+        nc->head = e->next;
+    if (e->next >= 0)
+        nc->entries[e->next].prev = e->prev;
+    else
+        nc->tail = e->prev;
+}
+
+static void
+noncecachefront(struct noncecache *nc, int32_t i) {
+    struct noncecacheentry *e = &nc->entries[i];
+
+    e->prev = -1;
+    e->next = nc->head;
+    if (nc->head >= 0)
+        nc->entries[nc->head].prev = i;
+    nc->head = i;
+    if (nc->tail < 0)
+        nc->tail = i;
+}
+
+// Returns the cached nonce, or NULL. A hit becomes the most recent entry.
+char *
+noncecachefind(struct noncecache *nc, uint64_t addr, uint64_t nonce) {
+    int32_t i;
+
+    for (i = nc->buckets[noncecachebucket(nc, addr, nonce)]; i >= 0; i = nc->entries[i].hnext) {
+        if (nc->entries[i].addr == addr && nc->entries[i].nonce == nonce) {
+            noncecacheunlink(nc, i);
+            noncecachefront(nc, i);
+            return nc->entries[i].data;
+        }
+    }
+    return NULL;
+}
+
+// Copies lane of a regenerated stagger into the cache, evicting the least
+// recently used nonce when it is full
+void
+noncecacheput(struct noncecache *nc, uint64_t addr, uint64_t nonce, char *cache, uint32_t stagger, uint32_t lane) {
+    struct noncecacheentry *e;
+    int32_t i, *p;
+
+    if (nc->size == 0 || noncecachefind(nc, addr, nonce) != NULL)
+        return;
+
+    if (nc->used < nc->size) {
+        i = nc->used++;
+        nc->entries[i].data = malloc(NONCE_SIZE);
+        if (nc->entries[i].data == NULL) {
+            printf("Error allocating memory.\n");
+            exit(-1);
+        }
+    }
+    else {
+        i = nc->tail;
+        e = &nc->entries[i];
+        for (p = &nc->buckets[noncecachebucket(nc, e->addr, e->nonce)]; *p != i; p = &nc->entries[*p].hnext)
+            ;
+        *p = e->hnext;
+        noncecacheunlink(nc, i);
+    }
+
+    e        = &nc->entries[i];
+    e->addr  = addr;
+    e->nonce = nonce;
+    p        = &nc->buckets[noncecachebucket(nc, addr, nonce)];
+    e->hnext = *p;
+    *p       = i;
+    noncecachefront(nc, i);
+    engraver_scatterlane(e->data, 1, 0, cache, stagger, lane);
+}
+
+// Deadline of one submission from its scoop
+static void
+deadlineof(struct submission *sub, char *scoop) {
+    uint64_t target;
+
+    minehash(sub->gensig, scoop, 1, &target);
+    sub->deadline = target / sub->basetarget;
+}
+
+// Hashes the missed nonces noncearguments at a time. Every SIMD lane gets
+// the account of its own submission, leftover lanes repeat the first one.
+void *
+deadline_i(void *x_void_ptr) {
+    struct deadlinejob *job = x_void_ptr;
+    char *cache = alloc(NONCE_SIZE, noncearguments);
+    uint64_t a[8], n[8];
+    uint32_t k, l, count;
+
+    if (cache == NULL) {
+        printf("Error allocating memory.\n");
+        exit(-1);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&deadlinemutex);
+        k = job->next;
+        job->next += noncearguments;
+        pthread_mutex_unlock(&deadlinemutex);
+        if (k >= job->nummisses)
+            break;
+
+        count = (job->nummisses - k < noncearguments) ? job->nummisses - k : noncearguments;
+        for (l = 0; l < count; l++) {
+            struct submission *sub = &job->subs[job->misses[k + l]];
+
+            a[l] = sub->addr;
+            n[l] = sub->nonce;
+        }
+        engraver_batch(&engine, cache, a, n, count);
+
+        for (l = 0; l < count; l++) {
+            int32_t i;
+
+            for (i = job->misses[k + l]; i >= 0; i = job->subs[i].next)
+                deadlineof(&job->subs[i], &cache[((uint64_t)job->subs[i].scoop * noncearguments + l) * SCOOP_SIZE]);
+        }
+
+        pthread_mutex_lock(&deadlinemutex);
+        for (l = 0; l < count; l++)
+            noncecacheput(&noncecache, a[l], n[l], cache, noncearguments, l);
+        pthread_mutex_unlock(&deadlinemutex);
+    }
+
+    free(cache);
+    return NULL;
+}
+
+struct submission *cmpsubs;
+
+int
+cmpsubmission(const void *a, const void *b) {
+    struct submission *x = &cmpsubs[*(const int32_t *)a], *y = &cmpsubs[*(const int32_t *)b];
+
+    if (x->addr != y->addr)
+        return (x->addr > y->addr) - (x->addr < y->addr);
+    return (x->nonce > y->nonce) - (x->nonce < y->nonce);
+}
+
+// Fills in the deadline of count submissions. Cached nonces are answered
+// right away; the other nonces are regenerated once each, with all threads
+// and mixed accounts per SIMD batch, and go into the nonce cache.
+int
+verifydeadlines(struct submission *subs, uint32_t count) {
+    struct deadlinejob job;
+    pthread_attr_t stackSizeAttribute;
+    pthread_t hasher[threads];
+    int32_t *order = malloc((count ? count : 1) * sizeof *order);
+    uint32_t i, j, numhashers;
+    char *data;
+
+    memset(&job, 0, sizeof job);
+    job.subs   = subs;
+    job.misses = malloc((count ? count : 1) * sizeof *job.misses);
+    if (order == NULL || job.misses == NULL) {
+        printf("Error allocating memory.\n");
+        return -1;
+    }
+
+    for (i = j = 0; i < count; i++) {
+        subs[i].next = -1;
+        if ((data = noncecachefind(&noncecache, subs[i].addr, subs[i].nonce)) != NULL) {
+            deadlineof(&subs[i], &data[subs[i].scoop * SCOOP_SIZE]);
+            noncecache.hits++;
+        }
+        else {
+            order[j++] = i;
+        }
+    }
+
+    // Submissions of the same nonce are chained behind one miss
+    cmpsubs = subs;
+    qsort(order, j, sizeof *order, cmpsubmission);
+    for (i = 0; i < j; i++) {
+        if (i > 0 && cmpsubmission(&order[i - 1], &order[i]) == 0) {
+            subs[order[i]].next = subs[order[i - 1]].next;
+            subs[order[i - 1]].next = order[i];
+            order[i] = order[i - 1];
+            noncecache.hits++;
+            continue;
+        }
+        job.misses[job.nummisses++] = order[i];
+        noncecache.misses++;
+    }
+
+    if (job.nummisses > 0) {
+        numhashers = (job.nummisses + noncearguments - 1) / noncearguments;
+        if (numhashers > threads)
+            numhashers = threads;
+        if (initstackattr(&stackSizeAttribute))
+            return -1;
+        for (i = 0; i < numhashers; i++) {
+            if (pthread_create(&hasher[i], &stackSizeAttribute, deadline_i, &job)) {
+                printf("Error creating thread. Out of memory? Try less threads\n");
+                exit(-1);
+            }
+        }
+        for (i = 0; i < numhashers; i++) {
+            pthread_join(hasher[i], NULL);
+        }
+    }
+
+    free(job.misses);
+    free(order);
+    return 0;
+}
+
+// Reads submissions from source (a file, or - for stdin), one per line:
+// ACCOUNT NONCE SCOOP GENERATIONSIGNATURE BASETARGET. An empty line or a
+// full batch verifies what was read so far and prints one line per
+// submission: ACCOUNT NONCE SCOOP DEADLINE.
+int
+deadlines(char *source) {
+    struct submission *subs = malloc(DEADLINE_BATCH * sizeof *subs);
+    char line[1024], hex[129], gensig[HASH_SIZE + 1];
+    uint32_t count = 0, i;
+    uint64_t total = 0, ms = 0, t;
+    int eof = 0;
+    FILE *in = strcmp(source, "-") ? fopen(source, "r") : stdin;
+
+    if (in == NULL) {
+        perror(source);
+        return 2;
+    }
+    if (subs == NULL || noncecacheinit(&noncecache, noncecachesize) < 0) {
+        printf("Error allocating memory.\n");
+        return 2;
+    }
+
+    while (!eof) {
+        eof = (fgets(line, sizeof line, in) == NULL);
+
+        if (!eof && line[0] != '\n') {
+            struct submission *sub = &subs[count];
+
+            if (line[0] == '#')
+                continue;
+            if (sscanf(line, "%" SCNu64 " %" SCNu64 " %u %128s %" SCNu64, &sub->addr, &sub->nonce, &sub->scoop, hex, &sub->basetarget) != 5
+                || strlen(hex) != 2 * HASH_SIZE || xstr2strr(gensig, sizeof gensig, hex) < 0
+                || sub->scoop >= NUM_SCOOPS || sub->basetarget == 0) {
+                printf("Cannot parse submission: %s", line);
+                continue;
+            }
+            memcpy(sub->gensig, gensig, HASH_SIZE);
+            if (++count < DEADLINE_BATCH)
+                continue;
+        }
+        if (count == 0)
+            continue;
+
+        t = getMS();
+        if (verifydeadlines(subs, count) < 0)
+            return 2;
+        ms += getMS() - t;
+        for (i = 0; i < count; i++) {
+            printf("%" PRIu64 " %" PRIu64 " %u %" PRIu64 "\n", subs[i].addr, subs[i].nonce, subs[i].scoop, subs[i].deadline);
+        }
+        fflush(stdout);
+        total += count;
+        count  = 0;
+    }
+
+    printf("# %" PRIu64 " submissions verified in %.2fs, %" PRIu64 " nonces regenerated, %" PRIu64 " from the nonce cache\n",
+           total, (double)ms / 1000000, noncecache.misses, noncecache.hits);
+    if (in != stdin)
+        fclose(in);
+    free(subs);
+    return 0;
+}
+
+// }}}
@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+// --deadlines: verify a batch of pool submissions by regenerating their
+// nonces, with an LRU cache of recently regenerated nonces
+extern char *deadlinesource;
+extern uint32_t noncecachesize;
+
+int deadlines(char *source);
@@ -0,0 +1,134 @@
+// engrave64: a minimal plotter on top of libengraver. All of its state is
+// in main's locals and in the library's context and writer, so it is what
+// an embedding program does to plot a file.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "engraver.h"
+
+// One thread's share of a round
+struct slice {
+    const struct engraver *ctx;
+    char *cache;
+    uint32_t stagger;
+    uint64_t addr;
+    uint64_t first;
+    uint32_t pos, count;
+};
+
+void *
+hashslice(void *arg) {
+    struct slice *s = arg;
+
+    engraver_hash(s->ctx, s->cache, s->stagger, s->pos, s->addr, s->first, s->count);
+    return NULL;
+}
+
+void
+usage(char **argv) {
+    printf("Usage: %s -k KEY -n NONCES [-s STARTNONCE] [-d DIRECTORY] [-m STAGGERSIZE] [-x CORE] [-t THREADS]\n", argv[0]);
+    exit(1);
+}
+
+int
+main(int argc, char **argv) {
+    struct engraver ctx;
+    struct engraver_writer w;
+    struct slice *slices;
+    pthread_t *workers;
+    uint64_t addr = 0, startnonce = 0, nonces = 0, run;
+    uint32_t stagger = 8192, threads = 1, len, share, t;
+    int core = -1, c;
+    char *dir = ".", *cache;
+
+    while ((c = getopt(argc, argv, "k:s:n:d:m:x:t:")) != -1) {
+        switch (c) {
+        case 'k':
+            addr = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            startnonce = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            nonces = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'm':
+            stagger = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            core = atoi(optarg);
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv);
+        }
+    }
+    if (addr == 0 || nonces == 0 || stagger == 0 || threads == 0)
+        usage(argv);
+    if (stagger > nonces)
+        stagger = nonces;
+
+    if (engraver_init(&ctx, core) < 0) {
+        printf("Core %d: %s\n", core, strerror(errno));
+        exit(1);
+    }
+    cache   = malloc((uint64_t)stagger * NONCE_SIZE);
+    slices  = calloc(threads, sizeof *slices);
+    workers = calloc(threads, sizeof *workers);
+    if (cache == NULL || slices == NULL || workers == NULL) {
+        printf("Error allocating memory\n");
+        exit(1);
+    }
+    if (engraver_open(&w, dir, addr, startnonce, nonces) < 0) {
+        printf("Error opening %s/%" PRIu64 "_%" PRIu64 "_%" PRIu64 ": %s\n", dir, addr, startnonce, nonces, strerror(errno));
+        exit(1);
+    }
+
+    // The threads share the context and hash slices of one stagger buffer
+    for (run = 0; run < nonces; run += len) {
+        len   = (nonces - run < stagger) ? nonces - run : stagger;
+        share = (len + threads - 1) / threads;
+        for (t = 0; t < threads; t++) {
+            uint32_t pos = t * share;
+
+            slices[t] = (struct slice){ &ctx, cache, stagger, addr, startnonce + run + pos, pos,
+                                        (pos >= len) ? 0 : (len - pos < share) ? len - pos : share };
+            if (pthread_create(&workers[t], NULL, hashslice, &slices[t])) {
+                printf("Error creating thread\n");
+                exit(1);
+            }
+        }
+        for (t = 0; t < threads; t++)
+            pthread_join(workers[t], NULL);
+
+        if (engraver_write(&w, cache, stagger, run, len) < 0) {
+            printf("Error writing %s: %s\n", w.path, strerror(errno));
+            exit(1);
+        }
+        printf("%" PRIu64 " of %" PRIu64 " nonces written\n", run + len, nonces);
+    }
+
+    if (engraver_close(&w) < 0) {
+        printf("Error finishing %s: %s\n", w.path, strerror(errno));
+        exit(1);
+    }
+    printf("Finished plotting %s\n", w.path);
+    engraver_free(&ctx);
+    free(cache);
+    free(slices);
+    free(workers);
+    return 0;
+}
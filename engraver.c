@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "engraver.h"
+
+// {{{ engraver_init      pick a core
+
+int
+engraver_bestcore(void) {
+    if (__builtin_cpu_supports("avx2"))
+        return ENGRAVER_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return ENGRAVER_SSE4;
+    return ENGRAVER_ORIG;
+}
+
+// core -1 is the best the CPU supports
+int
+engraver_init(struct engraver *ctx, int core) {
+    memset(ctx, 0, sizeof *ctx);
+    if (core < 0)
+        core = engraver_bestcore();
+    if (core > ENGRAVER_AVX2) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((core == ENGRAVER_SSE4 && !__builtin_cpu_supports("sse4.1"))
+        || (core == ENGRAVER_AVX2 && !__builtin_cpu_supports("avx2"))) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    ctx->core  = core;
+    ctx->lanes = (core == ENGRAVER_AVX2) ? 8 : (core == ENGRAVER_SSE4) ? 4 : 1;
+    if ((ctx->scratch = malloc((size_t)ctx->lanes * NONCE_SIZE)) == NULL)
+        return -1;
+    return 0;
+}
+
+void
+engraver_free(struct engraver *ctx) {
+    free(ctx->scratch);
+    ctx->scratch = NULL;
+}
+
+// }}}
+// {{{ engraver_hash      nonces into stagger buffers
+
+// Hashes count consecutive nonces starting at first into positions pos.. of
+// a stagger buffer, lanes at a time and the leftovers with the default core
+void
+engraver_hash(const struct engraver *ctx, char *cache, uint32_t stagger, uint64_t pos,
+              uint64_t addr, uint64_t first, uint32_t count) {
+    uint32_t n = 0;
+    uint64_t i;
+
+    for (; n + ctx->lanes <= count && ctx->core > ENGRAVER_ORIG; n += ctx->lanes) {
+        i = first + n;
+
+        if (ctx->core == ENGRAVER_SSE4) {
+            mnonce(cache, stagger, addr, addr, addr, addr,
+                   i, i + 1, i + 2, i + 3,
+                   pos + n, pos + n + 1, pos + n + 2, pos + n + 3);
+        }
+        else {
+            m256nonce(cache, stagger, addr, addr, addr, addr, addr, addr, addr, addr,
+                      i, i + 1, i + 2, i + 3, i + 4, i + 5, i + 6, i + 7, pos + n);
+        }
+    }
+
+    for (; n < count; n++)
+        nonce(cache, stagger, addr, first + n, pos + n);
+}
+
+// Hashes up to lanes nonces, every one with an account of its own, into a
+// buffer with stagger size lanes. Unused lanes repeat the first nonce.
+void
+engraver_batch(const struct engraver *ctx, char *lanes, const uint64_t *addrs, const uint64_t *nonces, uint32_t count) {
+    uint64_t a[8], n[8];
+    uint32_t l;
+
+    if (ctx->core == ENGRAVER_ORIG) {
+        for (l = 0; l < count; l++)
+            nonce(lanes, ctx->lanes, addrs[l], nonces[l], l);
+        return;
+    }
+    for (l = 0; l < ctx->lanes; l++) {
+        a[l] = (l < count) ? addrs[l] : addrs[0];
+        n[l] = (l < count) ? nonces[l] : nonces[0];
+    }
+    if (ctx->core == ENGRAVER_SSE4)
+        mnonce(lanes, ctx->lanes, a[0], a[1], a[2], a[3], n[0], n[1], n[2], n[3], 0, 1, 2, 3);
+    else
+        m256nonce(lanes, ctx->lanes, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+                  n[0], n[1], n[2], n[3], n[4], n[5], n[6], n[7], 0);
+}
+
+// Copies the nonce in lane of a buffer with stagger size srcstagger to
+// position dstpos of a buffer with stagger size dststagger
+void
+engraver_scatterlane(char *dst, uint32_t dststagger, uint64_t dstpos, const char *src, uint32_t srcstagger, uint32_t lane) {
+    uint32_t s;
+
+    for (s = 0; s < NUM_SCOOPS; s++) {
+        memcpy(&dst[((uint64_t)s * dststagger + dstpos) * SCOOP_SIZE],
+               &src[((uint64_t)s * srcstagger + lane) * SCOOP_SIZE], SCOOP_SIZE);
+    }
+}
+
+// count nonces of addr from start into dst (count * NONCE_SIZE bytes)
+int
+generate_nonces(struct engraver *ctx, uint64_t addr, uint64_t start, uint32_t count, char *dst, int layout) {
+    uint32_t n, l, batch;
+
+    if (layout == ENGRAVER_POC2) {
+        engraver_hash(ctx, dst, count, 0, addr, start, count);
+        return 0;
+    }
+    if (layout != ENGRAVER_NONCES) {
+        errno = EINVAL;
+        return -1;
+    }
+    // A nonce on its own is a stagger buffer of one
+    for (n = 0; n < count; n += batch) {
+        batch = (count - n < ctx->lanes) ? count - n : ctx->lanes;
+        engraver_hash(ctx, ctx->scratch, ctx->lanes, 0, addr, start + n, batch);
+        for (l = 0; l < batch; l++)
+            engraver_scatterlane(dst + (uint64_t)(n + l) * NONCE_SIZE, 1, 0, ctx->scratch, ctx->lanes, l);
+    }
+    return 0;
+}
+
+// }}}
+// {{{ engraver_open      write plot files
+
+int
+engraver_open(struct engraver_writer *w, const char *dir, uint64_t addr, uint64_t startnonce, uint64_t nonces) {
+    int err;
+
+    memset(w, 0, sizeof *w);
+    w->addr       = addr;
+    w->startnonce = startnonce;
+    w->nonces     = nonces;
+    if (snprintf(w->path, sizeof w->path, "%s/%" PRIu64 "_%" PRIu64 "_%" PRIu64 ".plotting",
+                 dir, addr, startnonce, nonces) >= (int)sizeof w->path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((w->fd = open(w->path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+        return -1;
+#ifdef __linux__
+    err = posix_fallocate(w->fd, 0, nonces * NONCE_SIZE);
+#else
+    err = ftruncate(w->fd, nonces * NONCE_SIZE) ? errno : 0;
+#endif
+    if (err) {
+        close(w->fd);
+        unlink(w->path);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Writes nonces run..run+len of the plot from the first len positions of a
+// stagger buffer with stagger size stagger. Runs go in order, each one
+// starting where the last one ended, so written counts no nonce twice.
+int
+engraver_write(struct engraver_writer *w, const char *cache, uint32_t stagger, uint64_t run, uint32_t len) {
+    uint64_t size = (uint64_t)len * SCOOP_SIZE;
+    uint32_t s;
+
+    if (run != w->written || run + len > w->nonces || len > stagger) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (s = 0; s < NUM_SCOOPS; s++) {
+        const char *src = &cache[(uint64_t)s * stagger * SCOOP_SIZE];
+        uint64_t off    = engraver_offset(w->nonces, s, run);
+        uint64_t done   = 0;
+
+        while (done < size) {
+            ssize_t k = pwrite(w->fd, src + done, size - done, off + done);
+
+            if (k < 0 && errno == EINTR)
+                continue;
+            if (k <= 0)
+                return -1;
+            done += k;
+        }
+    }
+    w->written += len;
+    return 0;
+}
+
+// Syncs and closes the file and drops .plotting from its name once all of
+// its nonces are written; w->path is the final name then
+int
+engraver_close(struct engraver_writer *w) {
+    char final[PATH_MAX];
+    int ret = fsync(w->fd);
+
+    if (close(w->fd) && ret == 0)
+        ret = -1;
+    w->fd = -1;
+    if (ret == 0 && w->written >= w->nonces) {
+        snprintf(final, sizeof final, "%.*s", (int)(strlen(w->path) - strlen(".plotting")), w->path);
+        if (rename(w->path, final))
+            return -1;
+        strcpy(w->path, final);
+    }
+    return ret;
+}
+
+// }}}
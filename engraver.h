@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <limits.h>
+
+#include "nonce.h"
+
+// libengraver (make libengraver.a, libengraver.so): PoC2 nonce generation and plot file
+// writing with all state in the caller's structures, so that plots can be
+// embedded in other programs and several of them run in one process.
+// plot64 hashes through it as well. Functions return -1 and set errno on
+// failure.
+
+// Cores
+#define ENGRAVER_ORIG   0
+#define ENGRAVER_SSE4   1
+#define ENGRAVER_AVX2   2
+
+// Layouts of generate_nonces
+#define ENGRAVER_POC2   0       // stagger buffer: scoop 0 of every nonce, then scoop 1...
+#define ENGRAVER_NONCES 1       // one nonce after the other, scoops in order
+
+// engraver_hash and engraver_batch only read the context, so threads may
+// share one; generate_nonces with ENGRAVER_NONCES uses the scratch buffer
+// and needs a context per thread.
+struct engraver {
+    uint32_t core;
+    uint32_t lanes;             // nonces per engine call: 1, 4 or 8
+    char *scratch;              // lanes nonces
+};
+
+// A plot file being written, <dir>/<addr>_<startnonce>_<nonces>.plotting
+// until all of its nonces are in. engraver_open starts it over.
+struct engraver_writer {
+    int fd;
+    uint64_t addr, startnonce, nonces;
+    uint64_t written;           // nonces, all of them before the next run
+    char path[PATH_MAX];
+};
+
+int engraver_bestcore(void);
+int engraver_init(struct engraver *ctx, int core);
+void engraver_free(struct engraver *ctx);
+
+void engraver_hash(const struct engraver *ctx, char *cache, uint32_t stagger, uint64_t pos,
+                   uint64_t addr, uint64_t first, uint32_t count);
+void engraver_batch(const struct engraver *ctx, char *lanes, const uint64_t *addrs, const uint64_t *nonces, uint32_t count);
+void engraver_scatterlane(char *dst, uint32_t dststagger, uint64_t dstpos, const char *src, uint32_t srcstagger, uint32_t lane);
+int generate_nonces(struct engraver *ctx, uint64_t addr, uint64_t start, uint32_t count, char *dst, int layout);
+
+int engraver_open(struct engraver_writer *w, const char *dir, uint64_t addr, uint64_t startnonce, uint64_t nonces);
+int engraver_write(struct engraver_writer *w, const char *cache, uint32_t stagger, uint64_t run, uint32_t len);
+int engraver_close(struct engraver_writer *w);
+
+// File offset of scoop of nonce run in a plot file of nonces nonces
+static inline uint64_t
+engraver_offset(uint64_t nonces, uint32_t scoop, uint64_t run) {
+    return ((uint64_t)scoop * nonces + run) * SCOOP_SIZE;
+}
@@ -71,6 +71,29 @@ int getNumberOfCores() {
 #endif
 }
 
+// Physical cores: every core counted once, however many hardware threads
+// (SMT siblings) it has. Falls back to the logical count.
+int getNumberOfPhysicalCores() {
+#if defined(_WIN32) || defined(MACOS)
+    return getNumberOfCores();
+#else
+    int cpus = getNumberOfCores(), cpu, first, physical = 0;
+    char path[128];
+    FILE *f;
+
+    for (cpu = 0; cpu < cpus; cpu++) {
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if ((f = fopen(path, "r")) == NULL)
+            return cpus;
+        // The first sibling of a core stands in for all of them
+        if (fscanf(f, "%d", &first) == 1 && first == cpu)
+            physical++;
+        fclose(f);
+    }
+    return (physical > 0) ? physical : cpus;
+#endif
+}
+
 // From http://www.binarytides.com/hostname-to-ip-address-c-sockets-linux/
 int hostname_to_ip(char * hostname , char* ip) {
     struct hostent *he;
@@ -1,5 +1,6 @@
 int xstr2strr(char *buf, unsigned bufsize, const char *in);
 int getNumberOfCores();
+int getNumberOfPhysicalCores();
 int hostname_to_ip(char * hostname , char* ip);
 unsigned long long freespace(char *path);
 unsigned long long freemem();
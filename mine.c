@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shabal.h"
+#include "mshabal256.h"
+#include "mshabal.h"
+#include "helper.h"
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "plot.h"
+#include "mine.h"
+
+char *minesource      = NULL;
+
+// {{{ mine              deadlines for a mining round
+
+// Computes the targets (first 8 bytes of Shabal256(gensig, scoop)) of count
+// scoops, 8 (AVX2) or 4 (SSE4) at a time with the selected core
+void
+minehash(char *gensig, char *scoops, uint32_t count, uint64_t *targets) {
+    char data[8][HASH_SIZE + SCOOP_SIZE];
+    uint32_t out[8][HASH_SIZE / 4];
+    uint32_t n = 0, l;
+
+    for (l = 0; l < 8; l++)
+        memcpy(data[l], gensig, HASH_SIZE);
+
+    for (; selecttype == 2 && n + 8 <= count; n += 8) {
+        mshabal256_context x;
+
+        for (l = 0; l < 8; l++)
+            memcpy(&data[l][HASH_SIZE], &scoops[(uint64_t)(n + l) * SCOOP_SIZE], SCOOP_SIZE);
+        mshabal256_init(&x);
+        mshabal256(&x, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7], HASH_SIZE + SCOOP_SIZE);
+        mshabal256_close(&x, out[0], out[1], out[2], out[3], out[4], out[5], out[6], out[7]);
+        for (l = 0; l < 8; l++)
+            memcpy(&targets[n + l], out[l], sizeof *targets);
+    }
+
+    for (; selecttype >= 1 && n + 4 <= count; n += 4) {
+        mshabal_context x;
+
+        for (l = 0; l < 4; l++)
+            memcpy(&data[l][HASH_SIZE], &scoops[(uint64_t)(n + l) * SCOOP_SIZE], SCOOP_SIZE);
+        sse4_mshabal_init(&x, 256);
+        sse4_mshabal(&x, data[0], data[1], data[2], data[3], HASH_SIZE + SCOOP_SIZE);
+        sse4_mshabal_close(&x, 0, 0, 0, 0, 0, out[0], out[1], out[2], out[3]);
+        for (l = 0; l < 4; l++)
+            memcpy(&targets[n + l], out[l], sizeof *targets);
+    }
+
+    for (; n < count; n++) {
+        shabal_context x;
+
+        memcpy(&data[0][HASH_SIZE], &scoops[(uint64_t)n * SCOOP_SIZE], SCOOP_SIZE);
+        shabal_init(&x, 256);
+        shabal(&x, data[0], HASH_SIZE + SCOOP_SIZE);
+        shabal_close(&x, 0, 0, out[0]);
+        memcpy(&targets[n], out[0], sizeof *targets);
+    }
+}
+
+// One reader per plot directory (disk): reads the scoop row of every plot
+// file in large chunks and keeps the best deadline per file
+void *
+minedisk_i(void *x_void_ptr) {
+    struct minedisk *d = x_void_ptr;
+    char *buf = malloc((uint64_t)MINE_CHUNK * SCOOP_SIZE);
+    uint64_t *targets = malloc(MINE_CHUNK * sizeof *targets);
+    uint32_t f, n;
+
+    d->nonces = 0;
+    d->failed = (buf == NULL || targets == NULL);
+    for (f = 0; f < d->numfiles && !d->failed; f++) {
+        struct minefile *mf = &d->files[f];
+        struct minebest *b  = &d->best[f];
+        uint64_t first;
+        int fd = open(mf->name, O_RDONLY);
+
+        b->deadline = UINT64_MAX;
+        b->file     = mf;
+        b->addr     = mf->addr;
+        if (fd < 0) {
+            perror(mf->name);
+            continue;
+        }
+        for (first = 0; first < mf->nonces; first += MINE_CHUNK) {
+            uint32_t count = (mf->nonces - first < MINE_CHUNK) ? mf->nonces - first : MINE_CHUNK;
+            uint64_t pos   = ((uint64_t)d->scoop * mf->nonces + first) * SCOOP_SIZE;
+
+            if (pread(fd, buf, (uint64_t)count * SCOOP_SIZE, pos) < (ssize_t)(count * SCOOP_SIZE)) {
+                printf("Error while reading %s: %d\n", mf->name, errno);
+                break;
+            }
+            minehash(d->gensig, buf, count, targets);
+            for (n = 0; n < count; n++) {
+                uint64_t deadline = targets[n] / d->basetarget;
+
+                if (deadline < b->deadline) {
+                    b->deadline = deadline;
+                    b->nonce    = mf->startnonce + first + n;
+                }
+            }
+            d->nonces += count;
+        }
+        close(fd);
+    }
+
+    free(targets);
+    free(buf);
+    return NULL;
+}
+
+// Collects the optimized plot files (KEY_STARTNONCE_NONCES) of a directory
+void
+minescan(struct minedisk *d) {
+    DIR *dir = opendir(d->dir);
+    struct dirent *de;
+    struct stat st;
+
+    if (dir == NULL) {
+        perror(d->dir);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        struct minefile mf;
+        int len = 0;
+
+        if (sscanf(de->d_name, "%" SCNu64 "_%" SCNu64 "_%u%n", &mf.addr, &mf.startnonce, &mf.nonces, &len) != 3
+            || de->d_name[len] != 0 || mf.nonces == 0)
+            continue;
+        snprintf(mf.name, sizeof mf.name, "%s%s", d->dir, de->d_name);
+        if (stat(mf.name, &st) < 0 || (uint64_t)st.st_size < (uint64_t)mf.nonces * NONCE_SIZE)
+            continue;
+
+        d->files = realloc(d->files, (d->numfiles + 1) * sizeof *d->files);
+        d->best  = realloc(d->best, (d->numfiles + 1) * sizeof *d->best);
+        if (d->files == NULL || d->best == NULL) {
+            printf("Error allocating memory.\n");
+            exit(-1);
+        }
+        d->files[d->numfiles++] = mf;
+    }
+    closedir(dir);
+}
+
+// Reads mining rounds from source (a file, or - for stdin), one per line:
+// GENERATIONSIGNATURE SCOOP BASETARGET. This stands in for the node API.
+int
+mine(char *source) {
+    struct minedisk disks[numfiles];
+    pthread_t reader[numfiles];
+    char line[1024], hex[129], gensig[HASH_SIZE + 1];
+    uint64_t basetarget, total, ms;
+    uint32_t scoop, f, k, rounds = 0, numplots = 0;
+    FILE *in = strcmp(source, "-") ? fopen(source, "r") : stdin;
+
+    if (in == NULL) {
+        perror(source);
+        return 2;
+    }
+
+    memset(disks, 0, sizeof disks);
+    for (f = 0; f < numfiles; f++) {
+        disks[f].dir = plotfiles[f].outputdir;
+        minescan(&disks[f]);
+        numplots += disks[f].numfiles;
+    }
+    printf("Mining with %u plot files in %u directories\n", numplots, numfiles);
+
+    while (fgets(line, sizeof line, in) != NULL) {
+        struct minebest best = { 0, 0, UINT64_MAX, NULL };
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%128s %u %" SCNu64, hex, &scoop, &basetarget) != 3
+            || strlen(hex) != 2 * HASH_SIZE || xstr2strr(gensig, sizeof gensig, hex) < 0
+            || scoop >= NUM_SCOOPS || basetarget == 0) {
+            printf("Cannot parse round: %s", line);
+            continue;
+        }
+
+        ms = getMS();
+        for (f = 0; f < numfiles; f++) {
+            disks[f].gensig     = gensig;
+            disks[f].scoop      = scoop;
+            disks[f].basetarget = basetarget;
+            if (pthread_create(&reader[f], NULL, minedisk_i, &disks[f])) {
+                printf("Error creating thread.\n");
+                exit(-1);
+            }
+        }
+        for (f = 0; f < numfiles; f++) {
+            pthread_join(reader[f], NULL);
+        }
+        ms = getMS() - ms;
+
+        printf("Round %u: scoop %u, base target %" PRIu64 "\n", ++rounds, scoop, basetarget);
+        for (total = 0, f = 0; f < numfiles; f++) {
+            for (k = 0; k < disks[f].numfiles; k++) {
+                struct minebest *b = &disks[f].best[k];
+
+                if (b->deadline == UINT64_MAX)
+                    continue;
+                printf("  %s: best deadline %" PRIu64 " (nonce %" PRIu64 ")\n", b->file->name, b->deadline, b->nonce);
+                if (b->deadline < best.deadline)
+                    best = *b;
+            }
+            total += disks[f].nonces;
+        }
+        if (best.file != NULL) {
+            printf("Best deadline %" PRIu64 " for account %" PRIu64 ", nonce %" PRIu64 ". %" PRIu64 " nonces in %.2fs\n",
+                   best.deadline, best.addr, best.nonce, total, (double)ms / 1000000);
+        }
+        else {
+            printf("No plots to mine with.\n");
+        }
+        fflush(stdout);
+    }
+
+    if (in != stdin)
+        fclose(in);
+    return 0;
+}
+
+// }}}
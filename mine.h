@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <limits.h>
+
+// --mine: best deadlines of all plot files for a mining round, read scoop
+// row by scoop row with one reader per plot directory
+
+// Nonces read per chunk of a scoop row
+#define MINE_CHUNK      65536
+
+struct minefile {
+    char name[PATH_MAX];
+    uint64_t addr;
+    uint64_t startnonce;
+    uint32_t nonces;
+};
+
+struct minebest {
+    uint64_t addr;
+    uint64_t nonce;
+    uint64_t deadline;
+    struct minefile *file;
+};
+
+struct minedisk {
+    char *dir;
+    struct minefile *files;
+    uint32_t numfiles;
+    // current round
+    char *gensig;
+    uint32_t scoop;
+    uint64_t basetarget;
+    uint64_t nonces;
+    struct minebest *best; // per file
+    int failed;
+};
+
+extern char *minesource;
+
+void minehash(char *gensig, char *scoops, uint32_t count, uint64_t *targets);
+void minescan(struct minedisk *d);
+int mine(char *source);
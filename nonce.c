@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "shabal.h"
+#include "mshabal256.h"
+#include "mshabal.h"
+#include "nonce.h"
+#include "phase.h"
+
+#define SET_NONCE(gendata, nonce, offset)      \
+    xv = (char*)&nonce;                        \
+    gendata[NONCE_SIZE + offset]     = xv[7];  \
+    gendata[NONCE_SIZE + offset + 1] = xv[6];  \
+    gendata[NONCE_SIZE + offset + 2] = xv[5];  \
+    gendata[NONCE_SIZE + offset + 3] = xv[4];  \
+    gendata[NONCE_SIZE + offset + 4] = xv[3];  \
+    gendata[NONCE_SIZE + offset + 5] = xv[2];  \
+    gendata[NONCE_SIZE + offset + 6] = xv[1];  \
+    gendata[NONCE_SIZE + offset + 7] = xv[0]
+
+// {{{ noncexor          epilogue
+
+void
+noncexor(char *gendata, const char *final) {
+    uint64_t fint[4];
+    uint64_t *start = (uint64_t*)gendata;
+
+    memcpy(fint, final, sizeof fint);
+    for (uint32_t i = 0; i < NONCE_SIZE; i += 32) {
+        *start ^= fint[0]; start++;
+        *start ^= fint[1]; start++;
+        *start ^= fint[2]; start++;
+        *start ^= fint[3]; start++;
+    }
+}
+
+// PoC2: scoop s keeps its first hash and takes the second one of scoop 4095 - s
+void
+noncescatter(char *cache, uint32_t staggersize, uint64_t cachepos, const char *gendata) {
+    uint64_t revPosition = NONCE_SIZE-SCOOP_SIZE;
+
+    for (uint32_t i = 0; i < NONCE_SIZE; i += SCOOP_SIZE){
+        memcpy(&cache[cachepos * SCOOP_SIZE + (uint64_t)i * staggersize], &gendata[i], 32);
+        memcpy(&cache[cachepos * SCOOP_SIZE + 32 + revPosition * staggersize], &gendata[i+32], 32);
+        revPosition -= SCOOP_SIZE;
+    }
+}
+
+// }}}
+// {{{ nonce             original algorithm
+
+void nonce(char *cache, uint32_t staggersize, uint64_t addr, uint64_t nonce, uint64_t cachepos) {
+    char final[32];
+    char gendata[16 + NONCE_SIZE];
+    char *xv;
+    uint64_t t = phase_start();
+
+    SET_NONCE(gendata, addr,  0);
+    SET_NONCE(gendata, nonce, 8);
+
+    shabal_context init_x, x;
+    uint32_t len;
+
+    shabal_init(&init_x, 256);
+    for (uint32_t i = NONCE_SIZE; i > 0; i -= HASH_SIZE) {
+        memcpy(&x, &init_x, sizeof(init_x));
+
+        len = NONCE_SIZE + 16 - i;
+        if (len > HASH_CAP)
+            len = HASH_CAP;
+
+        shabal(&x, &gendata[i], len);
+        shabal_close(&x, 0, 0, &gendata[i - HASH_SIZE]);
+    }
+
+    shabal_init(&x, 256);
+    shabal(&x, gendata, 16 + NONCE_SIZE);
+    shabal_close(&x, 0, 0, final);
+    t = phase_end(PHASE_SHABAL, t);
+
+    noncexor(gendata, final);
+    t = phase_end(PHASE_XOR, t);
+    noncescatter(cache, staggersize, cachepos, gendata);
+    phase_end(PHASE_SCATTER, t);
+}
+
+// }}}
+// {{{ mnonce            SSE4 version
+
+int
+mnonce(char *cache, uint32_t staggersize,
+       uint64_t addr1, uint64_t addr2, uint64_t addr3, uint64_t addr4,
+       uint64_t nonce1, uint64_t nonce2, uint64_t nonce3, uint64_t nonce4,
+       uint64_t cachepos1, uint64_t cachepos2, uint64_t cachepos3, uint64_t cachepos4) {
+    char final1[32], final2[32], final3[32], final4[32];
+    char gendata1[16 + NONCE_SIZE], gendata2[16 + NONCE_SIZE], gendata3[16 + NONCE_SIZE], gendata4[16 + NONCE_SIZE];
+
+    char *xv;
+    uint64_t t = phase_start();
+
+    // Every lane has its own account, so one batch can mix plot jobs
+    SET_NONCE(gendata1, addr1, 0);
+    SET_NONCE(gendata2, addr2, 0);
+    SET_NONCE(gendata3, addr3, 0);
+    SET_NONCE(gendata4, addr4, 0);
+
+    SET_NONCE(gendata1, nonce1, 8);
+    SET_NONCE(gendata2, nonce2, 8);
+    SET_NONCE(gendata3, nonce3, 8);
+    SET_NONCE(gendata4, nonce4, 8);
+
+    mshabal_context x;
+    int len;
+
+    for (int i = NONCE_SIZE; i > 0; i -= HASH_SIZE) {
+      sse4_mshabal_init(&x, 256);
+
+      len = NONCE_SIZE + 16 - i;
+      if (len > HASH_CAP)
+          len = HASH_CAP;
+
+      sse4_mshabal(&x, &gendata1[i], &gendata2[i], &gendata3[i], &gendata4[i], len);
+      sse4_mshabal_close(&x, 0, 0, 0, 0, 0, &gendata1[i - HASH_SIZE], &gendata2[i - HASH_SIZE], &gendata3[i - HASH_SIZE], &gendata4[i - HASH_SIZE]);
+    }
+
+    sse4_mshabal_init(&x, 256);
+    sse4_mshabal(&x, gendata1, gendata2, gendata3, gendata4, 16 + NONCE_SIZE);
+    sse4_mshabal_close(&x, 0, 0, 0, 0, 0, final1, final2, final3, final4);
+    t = phase_end(PHASE_SHABAL, t);
+
+    noncexor(gendata1, final1);
+    noncexor(gendata2, final2);
+    noncexor(gendata3, final3);
+    noncexor(gendata4, final4);
+    t = phase_end(PHASE_XOR, t);
+
+    noncescatter(cache, staggersize, cachepos1, gendata1);
+    noncescatter(cache, staggersize, cachepos2, gendata2);
+    noncescatter(cache, staggersize, cachepos3, gendata3);
+    noncescatter(cache, staggersize, cachepos4, gendata4);
+    phase_end(PHASE_SCATTER, t);
+
+    return 0;
+}
+
+// }}}
+// {{{ m256nonce         AVX2 version
+
+int
+m256nonce(char *cache, uint32_t staggersize,
+          uint64_t addr1, uint64_t addr2, uint64_t addr3, uint64_t addr4,
+          uint64_t addr5, uint64_t addr6, uint64_t addr7, uint64_t addr8,
+          uint64_t nonce1, uint64_t nonce2, uint64_t nonce3, uint64_t nonce4,
+          uint64_t nonce5, uint64_t nonce6, uint64_t nonce7, uint64_t nonce8,
+          uint64_t cachepos) {
+    char final1[32], final2[32], final3[32], final4[32];
+    char final5[32], final6[32], final7[32], final8[32];
+    char gendata1[16 + NONCE_SIZE], gendata2[16 + NONCE_SIZE], gendata3[16 + NONCE_SIZE], gendata4[16 + NONCE_SIZE];
+    char gendata5[16 + NONCE_SIZE], gendata6[16 + NONCE_SIZE], gendata7[16 + NONCE_SIZE], gendata8[16 + NONCE_SIZE];
+
+    char *xv;
+    uint64_t t = phase_start();
+
+    SET_NONCE(gendata1, addr1, 0);
+    SET_NONCE(gendata2, addr2, 0);
+    SET_NONCE(gendata3, addr3, 0);
+    SET_NONCE(gendata4, addr4, 0);
+    SET_NONCE(gendata5, addr5, 0);
+    SET_NONCE(gendata6, addr6, 0);
+    SET_NONCE(gendata7, addr7, 0);
+    SET_NONCE(gendata8, addr8, 0);
+
+    SET_NONCE(gendata1, nonce1, 8);
+    SET_NONCE(gendata2, nonce2, 8);
+    SET_NONCE(gendata3, nonce3, 8);
+    SET_NONCE(gendata4, nonce4, 8);
+    SET_NONCE(gendata5, nonce5, 8);
+    SET_NONCE(gendata6, nonce6, 8);
+    SET_NONCE(gendata7, nonce7, 8);
+    SET_NONCE(gendata8, nonce8, 8);
+
+    mshabal256_context x;
+    int len;
+
+    for (int i = NONCE_SIZE; i;) {
+      mshabal256_init(&x);
+
+      len = NONCE_SIZE + 16 - i;
+      if (len > HASH_CAP)
+        len = HASH_CAP;
+
+      mshabal256(&x, &gendata1[i], &gendata2[i], &gendata3[i], &gendata4[i], &gendata5[i], &gendata6[i], &gendata7[i], &gendata8[i], len);
+
+      i -= HASH_SIZE;
+      mshabal256_close(&x,
+                       (uint32_t *)&gendata1[i], (uint32_t *)&gendata2[i], (uint32_t *)&gendata3[i], (uint32_t *)&gendata4[i],
+                       (uint32_t *)&gendata5[i], (uint32_t *)&gendata6[i], (uint32_t *)&gendata7[i], (uint32_t *)&gendata8[i]);
+
+    }
+
+    mshabal256_init(&x);
+    mshabal256(&x, gendata1, gendata2, gendata3, gendata4, gendata5, gendata6, gendata7, gendata8, 16 + NONCE_SIZE);
+    mshabal256_close(&x,
+                     (uint32_t *)final1, (uint32_t *)final2, (uint32_t *)final3, (uint32_t *)final4,
+                     (uint32_t *)final5, (uint32_t *)final6, (uint32_t *)final7, (uint32_t *)final8);
+    t = phase_end(PHASE_SHABAL, t);
+
+    noncexor(gendata1, final1);
+    noncexor(gendata2, final2);
+    noncexor(gendata3, final3);
+    noncexor(gendata4, final4);
+    noncexor(gendata5, final5);
+    noncexor(gendata6, final6);
+    noncexor(gendata7, final7);
+    noncexor(gendata8, final8);
+    t = phase_end(PHASE_XOR, t);
+
+    noncescatter(cache, staggersize, cachepos,     gendata1);
+    noncescatter(cache, staggersize, cachepos + 1, gendata2);
+    noncescatter(cache, staggersize, cachepos + 2, gendata3);
+    noncescatter(cache, staggersize, cachepos + 3, gendata4);
+    noncescatter(cache, staggersize, cachepos + 4, gendata5);
+    noncescatter(cache, staggersize, cachepos + 5, gendata6);
+    noncescatter(cache, staggersize, cachepos + 6, gendata7);
+    noncescatter(cache, staggersize, cachepos + 7, gendata8);
+    phase_end(PHASE_SCATTER, t);
+
+    return 0;
+}
+// }}}
@@ -0,0 +1,30 @@
+#include <stdint.h>
+
+// Plot geometry, fixed by the PoC2 format
+#define SCOOP_SIZE      64
+#define NUM_SCOOPS      4096
+#define NONCE_SIZE      (NUM_SCOOPS * SCOOP_SIZE)
+
+#define HASH_SIZE       32
+#define HASH_CAP        4096
+
+// The nonce engines hash whole nonces (default core: one, SSE4: four, AVX2:
+// eight at a time) and put their scoops at cache position cachepos of a
+// stagger buffer of staggersize nonces, in PoC2 order. Every lane has an
+// account of its own.
+void nonce(char *cache, uint32_t staggersize, uint64_t addr, uint64_t nonce, uint64_t cachepos);
+int mnonce(char *cache, uint32_t staggersize,
+           uint64_t addr1, uint64_t addr2, uint64_t addr3, uint64_t addr4,
+           uint64_t nonce1, uint64_t nonce2, uint64_t nonce3, uint64_t nonce4,
+           uint64_t cachepos1, uint64_t cachepos2, uint64_t cachepos3, uint64_t cachepos4);
+int m256nonce(char *cache, uint32_t staggersize,
+              uint64_t addr1, uint64_t addr2, uint64_t addr3, uint64_t addr4,
+              uint64_t addr5, uint64_t addr6, uint64_t addr7, uint64_t addr8,
+              uint64_t nonce1, uint64_t nonce2, uint64_t nonce3, uint64_t nonce4,
+              uint64_t nonce5, uint64_t nonce6, uint64_t nonce7, uint64_t nonce8,
+              uint64_t cachepos);
+
+// Epilogue shared by the engines: XOR the hash chain of a nonce with its
+// final hash, then scatter the scoops into the stagger buffer
+void noncexor(char *gendata, const char *final);
+void noncescatter(char *cache, uint32_t staggersize, uint64_t cachepos, const char *gendata);
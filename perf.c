@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "perf.h"
+
+const char *perf_names[PERF_COUNTERS] = {
+    "cycles", "instructions", "LLC misses", "dTLB misses", "task clock", "page faults"
+};
+
+#if defined(__linux__) && defined(__NR_perf_event_open)
+
+// {{{ perf_open         counters of the calling thread
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+uint32_t
+perf_open(struct perfthread *pt) {
+    struct perf_event_attr pa;
+    uint32_t mask = 0;
+    int k, err = 0;
+
+    for (k = 0; k < PERF_COUNTERS; k++) {
+        memset(&pa, 0, sizeof pa);
+        pa.size           = sizeof pa;
+        pa.type           = perf_events[k].type;
+        pa.config         = perf_events[k].config;
+        pa.exclude_kernel = 1;
+        pa.exclude_hv     = 1;
+        // Scaled up if the PMU multiplexes more counters than it has
+        pa.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        pt->fd[k] = syscall(__NR_perf_event_open, &pa, 0, -1, -1, 0);
+        if (pt->fd[k] >= 0)
+            mask |= 1 << k;
+        else if (err == 0)
+            err = errno;
+    }
+    errno = err;
+    return mask;
+}
+
+void
+perf_read(struct perfthread *pt, struct perfcount *pc) {
+    uint64_t buf[3];
+    int k;
+
+    for (k = 0; k < PERF_COUNTERS; k++) {
+        pc->v[k] = 0;
+        if (pt->fd[k] < 0 || read(pt->fd[k], buf, sizeof buf) != sizeof buf)
+            continue;
+        pc->v[k] = (buf[2] > 0 && buf[2] < buf[1]) ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+    }
+}
+
+void
+perf_close(struct perfthread *pt) {
+    int k;
+
+    for (k = 0; k < PERF_COUNTERS; k++) {
+        if (pt->fd[k] >= 0)
+            close(pt->fd[k]);
+        pt->fd[k] = -1;
+    }
+}
+
+// }}}
+
+#else
+
+uint32_t perf_open(struct perfthread *pt) { int k; for (k = 0; k < PERF_COUNTERS; k++) pt->fd[k] = -1; errno = ENOSYS; return 0; }
+void perf_read(struct perfthread *pt, struct perfcount *pc) { memset(pc, 0, sizeof *pc); }
+void perf_close(struct perfthread *pt) { (void)pt; }
+
+#endif
+
+void
+perf_delta(struct perfcount *dst, const struct perfcount *from, const struct perfcount *to) {
+    int k;
+
+    for (k = 0; k < PERF_COUNTERS; k++)
+        dst->v[k] += to->v[k] - from->v[k];
+}
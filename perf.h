@@ -0,0 +1,30 @@
+#include <stdint.h>
+
+// Per-thread counters of perf_event_open (Linux). Hardware counters are
+// often unavailable (virtual machines, perf_event_paranoid); every counter
+// that cannot be opened is left out, the software ones nearly always work.
+#define PERF_CYCLES         0
+#define PERF_INSTRUCTIONS   1
+#define PERF_LLCMISSES      2
+#define PERF_DTLBMISSES     3
+#define PERF_TASKCLOCK      4       // ns on the CPU
+#define PERF_PAGEFAULTS     5
+#define PERF_COUNTERS       6
+
+struct perfcount {
+    uint64_t v[PERF_COUNTERS];
+};
+
+struct perfthread {
+    int fd[PERF_COUNTERS];
+};
+
+extern const char *perf_names[PERF_COUNTERS];
+
+// Opens the counters of the calling thread; returns a mask of the ones
+// that are counting (0 if none, errno of the first failure kept)
+uint32_t perf_open(struct perfthread *pt);
+void perf_read(struct perfthread *pt, struct perfcount *pc);
+void perf_close(struct perfthread *pt);
+// dst += to - from
+void perf_delta(struct perfcount *dst, const struct perfcount *from, const struct perfcount *to);
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "phase.h"
+
+__thread struct phaselog *phaselog = NULL;
+
+static struct phaselog *logs = NULL;
+static uint32_t numlogs      = 0;
+static int tracing           = 0;
+static uint64_t epoch        = 0;
+static pthread_mutex_t logmutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phasenames[PHASES] = {
+    "shabal", "xor", "scatter", "wait", "threads", "idle", "seek", "write", "sync"
+};
+
+// {{{ phase_record      per thread counters
+
+uint64_t
+phase_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Trace events are only kept with trace set
+void
+phase_init(int trace) {
+    tracing = trace;
+    epoch   = phase_clock();
+}
+
+// Starts recording in the calling thread
+void
+phase_register(const char *name) {
+    struct phaselog *pl = calloc(1, sizeof *pl);
+
+    if (pl == NULL)
+        return;
+    snprintf(pl->name, sizeof pl->name, "%s", name);
+    pthread_mutex_lock(&logmutex);
+    pl->tid  = ++numlogs;
+    pl->next = logs;
+    logs     = pl;
+    pthread_mutex_unlock(&logmutex);
+    phaselog = pl;
+}
+
+void
+phase_record(int phase, uint64_t ns) {
+    struct phaselog *pl = phaselog;
+    int b = 0;
+
+    while (b < PHASE_BUCKETS - 1 && (ns >> (b + 1)) > 0)
+        b++;
+    pl->count[phase]++;
+    pl->total[phase] += ns;
+    if (ns > pl->max[phase])
+        pl->max[phase] = ns;
+    pl->hist[phase][b]++;
+}
+
+// A span of the timeline. Back to back spans of the same round (the chunks
+// a hashing thread takes one after the other) become one event.
+void
+phase_event(const char *name, uint64_t arg, uint64_t start, uint64_t end) {
+    struct phaselog *pl = phaselog;
+    struct phaseevent *ev;
+
+    if (pl == NULL || !tracing)
+        return;
+    if (pl->numevents > 0) {
+        ev = &pl->events[pl->numevents - 1];
+        if (ev->name == name && ev->arg == arg) {
+            ev->end = end;
+            ev->count++;
+            return;
+        }
+    }
+    if (pl->numevents == pl->maxevents) {
+        uint32_t max = pl->maxevents ? pl->maxevents * 2 : 256;
+
+        if ((ev = realloc(pl->events, max * sizeof *ev)) == NULL)
+            return;
+        pl->events    = ev;
+        pl->maxevents = max;
+    }
+    ev = &pl->events[pl->numevents++];
+    ev->name  = name;
+    ev->arg   = arg;
+    ev->start = start;
+    ev->end   = end;
+    ev->count = 1;
+}
+
+// }}}
+// {{{ phase_report      end of run histograms
+
+static void
+phase_format(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000)
+        snprintf(buf, size, "%" PRIu64 "ns", ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+// Upper bound of the bucket that holds the given fraction of the samples,
+// at most the longest sample
+static uint64_t
+phase_percentile(const uint32_t *hist, uint64_t count, uint64_t max, double fraction) {
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < PHASE_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= fraction * count)
+            break;
+    }
+    return (b < 63 && (2ULL << b) < max) ? (2ULL << b) : max;
+}
+
+// All threads summed up per phase. Busy is the share of the wall clock
+// time of the threads that went through that phase at all.
+void
+phase_report(uint64_t wall) {
+    uint64_t count, total, max, peak;
+    uint32_t hist[PHASE_BUCKETS], users;
+    char t[5][16];
+    struct phaselog *pl;
+    int p, b;
+
+    printf("\nPhase times (%u threads, %.1fs):\n", numlogs, wall / 1e9);
+    printf("  %-8s %10s %10s %7s %9s %9s %9s %9s\n", "phase", "count", "total", "busy", "mean", "p50 <=", "p99 <=", "max");
+    for (p = 0; p < PHASES; p++) {
+        count = total = max = 0;
+        users = 0;
+        memset(hist, 0, sizeof hist);
+        for (pl = logs; pl != NULL; pl = pl->next) {
+            if (pl->count[p] == 0)
+                continue;
+            users++;
+            count += pl->count[p];
+            total += pl->total[p];
+            if (pl->max[p] > max)
+                max = pl->max[p];
+            for (b = 0; b < PHASE_BUCKETS; b++)
+                hist[b] += pl->hist[p][b];
+        }
+        if (count == 0)
+            continue;
+        phase_format(t[0], sizeof t[0], total);
+        phase_format(t[1], sizeof t[1], total / count);
+        phase_format(t[2], sizeof t[2], phase_percentile(hist, count, max, 0.5));
+        phase_format(t[3], sizeof t[3], phase_percentile(hist, count, max, 0.99));
+        phase_format(t[4], sizeof t[4], max);
+        printf("  %-8s %10" PRIu64 " %10s %6.1f%% %9s %9s %9s %9s\n", phasenames[p], count, t[0],
+               wall ? 100.0 * total / wall / users : 0, t[1], t[2], t[3], t[4]);
+
+        for (b = 0, peak = 0; b < PHASE_BUCKETS; b++)
+            if (hist[b] > peak)
+                peak = hist[b];
+        for (b = 0; b < PHASE_BUCKETS; b++) {
+            char bar[41];
+            int len;
+
+            if (hist[b] == 0)
+                continue;
+            len = (int)((hist[b] * 40 + peak - 1) / peak);
+            memset(bar, '#', len);
+            bar[len] = 0;
+            phase_format(t[0], sizeof t[0], 2ULL << b);
+            printf("    <=%-8s %-40s %u\n", t[0], bar, hist[b]);
+        }
+    }
+}
+
+// }}}
+// {{{ phase_writetrace  Chrome trace event timeline
+
+// The JSON trace event format of chrome://tracing and Perfetto: one
+// complete event per span, times in microseconds since phase_init
+int
+phase_writetrace(const char *path) {
+    FILE *f = fopen(path, "w");
+    struct phaselog *pl;
+    uint32_t k;
+    int first = 1;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (pl = logs; pl != NULL; pl = pl->next) {
+        fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",", pl->tid, pl->name);
+        first = 0;
+        for (k = 0; k < pl->numevents; k++) {
+            struct phaseevent *ev = &pl->events[k];
+
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"round\": %" PRIu64 ", \"spans\": %u}}",
+                    ev->name, pl->tid, (ev->start - epoch) / 1e3, (ev->end - ev->start) / 1e3, ev->arg, ev->count);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// }}}
@@ -0,0 +1,65 @@
+#include <stdint.h>
+
+// Per-thread timing of the plotting phases (--phases, --trace). A thread
+// that takes part registers a log of its own; threads without one (and all
+// of them unless enabled) pay one test of a thread local pointer per phase.
+enum {
+    PHASE_SHABAL,           // hash chain and final hash of a nonce (batch)
+    PHASE_XOR,              // XOR of the chain with the final hash
+    PHASE_SCATTER,          // PoC2 scoops into the stagger buffer
+    PHASE_WAIT,             // hashing thread waiting for a free stagger buffer
+    PHASE_THREADS,          // hashing thread start and join latency
+    PHASE_IDLE,             // writer waiting for a hashed round
+    PHASE_SEEK,
+    PHASE_WRITE,
+    PHASE_SYNC,             // fdatasync of a written round
+    PHASES
+};
+
+// log2 buckets of nanoseconds
+#define PHASE_BUCKETS   40
+
+struct phaseevent {
+    const char *name;
+    uint64_t arg;           // round
+    uint64_t start, end;    // ns
+    uint32_t count;         // merged spans
+};
+
+struct phaselog {
+    char name[64];
+    uint32_t tid;
+    uint64_t count[PHASES], total[PHASES], max[PHASES];
+    uint32_t hist[PHASES][PHASE_BUCKETS];
+    struct phaseevent *events;
+    uint32_t numevents, maxevents;
+    struct phaselog *next;
+};
+
+extern __thread struct phaselog *phaselog;
+
+uint64_t phase_clock(void);
+void phase_init(int trace);
+void phase_register(const char *name);
+void phase_record(int phase, uint64_t ns);
+void phase_event(const char *name, uint64_t arg, uint64_t start, uint64_t end);
+void phase_report(uint64_t wall);
+int phase_writetrace(const char *path);
+
+static inline uint64_t
+phase_start(void) {
+    return phaselog ? phase_clock() : 0;
+}
+
+// Adds the time since start to a phase; returns the end, which can start
+// the next phase
+static inline uint64_t
+phase_end(int phase, uint64_t start) {
+    uint64_t now;
+
+    if (phaselog == NULL)
+        return 0;
+    now = phase_clock();
+    phase_record(phase, now - start);
+    return now;
+}
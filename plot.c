@@ -12,28 +12,49 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 #include "shabal.h"
 #include "mshabal256.h"
 #include "mshabal.h"
 #include "helper.h"
+#include "nonce.h"
+#include "engraver.h"
+#include "stream.h"
+#include "check.h"
+#include "uring.h"
+#include "phase.h"
+#include "perf.h"
+#include "plot.h"
+#include "verify.h"
+#include "repair.h"
+#include "convert.h"
+#include "relayout.h"
+#include "mine.h"
+#include "deadlines.h"
+#include "readbench.h"
+#include "autotune.h"
+#include "control.h"
+#include "daemon.h"
 
 #define DEFAULTDIR      "plots/"
 
-// Not to be changed below this
-#define SCOOP_SIZE      64
-#define NUM_SCOOPS      4096
-#define NONCE_SIZE      (NUM_SCOOPS * SCOOP_SIZE)
-
-#define HASH_SIZE       32
-#define HASH_CAP        4096
-
 // This is used to set the pthread stack size to 8MB.
 // Otherwise we overflow the stack on macOS, which has a default
 // pthread stack size of 512KB.  Linux's default is 8MB
@@ -45,34 +66,112 @@ uint64_t startnonce  = 0;
 uint32_t nonces      = 0;
 uint32_t staggersize = 0;
 uint32_t threads     = 0;
-uint32_t noncesperthread, noncearguments;
+uint32_t noncearguments;
 uint32_t selecttype  = 0;
+struct engraver engine;         // the selected core, shared by the hashing threads
 uint32_t asyncmode   = 0;
 uint32_t verbose     = 0;
 uint32_t resumeid    = 0xaffeaffe;
-double createtime    = 0.0;
+double totalcreatetime = 0.0;
 uint64_t maxmemory   = 0;
 uint64_t leavespace  = 0;
 uint64_t plotfilesize;
-uint64_t starttime;
-uint64_t run, lastrun, thisrun;
 int userleavespace;
-int lastspeed, lasthours, lastminutes, lastseconds;
-int ofd;
-
-char *cache, *wcache, *acache[2];
-char *outputdir = DEFAULTDIR;
-
-#define SET_NONCE(gendata, nonce, offset)      \
-    xv = (char*)&nonce;                        \
-    gendata[NONCE_SIZE + offset]     = xv[7];  \
-    gendata[NONCE_SIZE + offset + 1] = xv[6];  \
-    gendata[NONCE_SIZE + offset + 2] = xv[5];  \
-    gendata[NONCE_SIZE + offset + 3] = xv[4];  \
-    gendata[NONCE_SIZE + offset + 4] = xv[3];  \
-    gendata[NONCE_SIZE + offset + 5] = xv[2];  \
-    gendata[NONCE_SIZE + offset + 6] = xv[1];  \
-    gendata[NONCE_SIZE + offset + 7] = xv[0]
+
+// On-device layout for raw block device targets (-B): the first 4096 byte
+// block holds a table of plot regions, each region starts on a RAW_ALIGN
+// boundary and is an ordinary optimized PoC2 plot of <nonces> nonces.
+#define RAW_MAGIC       "ENGRAVER"
+#define RAW_VERSION     1
+#define RAW_ALIGN       (1024 * 1024)
+#define RAW_MAX_REGIONS 63
+#define RAW_PLOTTING    1
+#define RAW_DONE        2
+
+struct rawregion {
+    uint64_t addr;
+    uint64_t startnonce;
+    uint64_t nonces;
+    uint64_t offset;        // byte offset of the region on the device
+    uint64_t written;       // nonces on disk, used for resume
+    uint32_t state;
+    uint32_t reserved[5];
+};
+
+struct rawheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t reserved[6];
+    struct rawregion region[RAW_MAX_REGIONS];
+};
+
+// Checkpoint journal of plot files (<name>.journal). Records are only
+// appended after the data they describe has been fdatasync()ed, and a
+// record is only valid with a matching check, so a torn record at the end
+// is ignored.
+#define JOURNAL_MAGIC   0x4c4e524a
+#define JOURNAL_HEADER  1
+#define JOURNAL_ROUND   3       // a round is on disk
+
+struct journalrec {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t run;           // JOURNAL_HEADER: start nonce
+    uint64_t count;         // JOURNAL_HEADER: nonces
+    uint64_t scoops;        // JOURNAL_HEADER: account
+    uint64_t check;
+};
+
+// Set on SIGINT/SIGTERM: no new work is handed out, hashed nonces are
+// still written
+volatile int stopping = 0;
+
+// --sink: plot into nothing (null) or into an emulated disk (throttle)
+int sinkmode         = SINK_FILE;
+double sinkrate      = 0;       // MB/s
+uint64_t sinklatency = 0;       // us per write request
+uint64_t hashbusy    = 0;       // time hashing threads spent hashing
+uint64_t hashwait    = 0;       // and waiting for a free stagger buffer
+
+// --phases, --trace: per thread phase timing
+int phasing          = 0;
+char *tracefile      = NULL;
+
+// --progress, --metrics-file: machine readable progress
+int progressmode     = PROGRESS_TEXT;
+char *metricsfile    = NULL;
+uint64_t plotstarted = 0;
+
+// --yield, --yield-on: let a miner read the plot disks after a new block
+double yieldwindow   = 8;       // seconds
+double yieldrate     = 0;       // MB/s while yielding, 0 holds the writes
+char *yieldfile      = NULL;
+
+// --perf-counters: counters of the hashing and writer threads per round
+int perfcounters     = 0;
+uint32_t perfmask    = 0;       // counters at least one thread could open
+struct perfcount perfhash, perfwrite;
+
+int daemonrunning    = 0;       // --daemon: idle hashing threads wait for the next batch
+int hugepages        = 0;       // --hugepages: stagger buffers on huge pages
+
+struct plotfile *plotfiles;
+uint32_t numfiles    = 0;
+char *servesource    = NULL;
+char *workertarget   = NULL;
+uint64_t netrangeid  = 0;
+uint32_t networkers  = 0;
+uint32_t hashactive  = 0;       // hashing threads and --serve workers that are not parked
+char *streamtarget   = NULL;
+char *receivesource  = NULL;
+char *checkfile      = NULL;
+int streamfd         = -1;
+uint32_t schedcursor = 0;
+uint64_t roundseq    = 0;
+
+pthread_mutex_t poolmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  poolcond  = PTHREAD_COND_INITIALIZER;
 
 #if __APPLE__
 
@@ -104,19 +203,12 @@ int posix_fallocate(int fd, off_t offset, off_t len) {
     return res;
 }
 
-// Also, on MacOS, there is no lseek64. off_t is already 64 bit
-#define LSEEK lseek
-
-#else    // On Linux, use lseek64
-
-#define LSEEK lseek64
-
 #endif
 
 
 int use_direct_io = 0;
 
-static void *alloc(size_t nmemb, size_t size) {
+void *alloc(size_t nmemb, size_t size) {
     if (! use_direct_io) {
         return calloc( nmemb, size );
     }
@@ -139,356 +231,2484 @@ static void *alloc(size_t nmemb, size_t size) {
 
 /* }}} */
 
-/* {{{ nonce             original algorithm */
+/* {{{ getMS             get miliseconds    */
+
+uint64_t
+getMS() {
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    return ((uint64_t)time.tv_sec * 1000000) + time.tv_usec;
+}
+
+/* }}} */
+/* {{{ usage             print usage info   */
+
+void usage(char **argv) {
+    printf("Usage: %s -k KEY[,KEY...] [ -x CORE ] [-v VERBOSE] [-d DIRECTORY[,DIRECTORY...]] [-s STARTNONCE] [-n NONCES] [-m STAGGERSIZE] [-t THREADS] [-b MAXMEMORY] [-p PLOTFILESIZE] [-a] [-R] [-D] [-B DEVICE [-I]] [--stream=TARGET] [--serve=SOURCE] [--sink=null|throttle:MBS,LATENCY] [--autotune[=force]] [--phases] [--trace=FILE] [--progress=text|json] [--metrics-file=FILE] [--control=SOCKET] [--yield=SECONDS[,MBS]] [--yield-on=FILE] [--perf-counters] [--hugepages]\n", argv[0]);
+    printf("       %s --autotune[=force] [-d DIRECTORY]\n", argv[0]);
+    printf("       %s --daemon=SPOOLDIR [-d DIRECTORY] [ -x CORE ] [-m STAGGERSIZE] [-t THREADS] [-b MAXMEMORY] [-a] [--hugepages] [--control=SOCKET]\n", argv[0]);
+    printf("       %s --worker=TARGET [ -x CORE ] [-t THREADS]\n", argv[0]);
+    printf("       %s --receive=SOURCE [-d DIRECTORY]\n", argv[0]);
+    printf("       %s --check=PLOTFILE\n", argv[0]);
+    printf("       %s --verify=PLOTFILE [--sample=PERCENT] [ -x CORE ] [-t THREADS]\n", argv[0]);
+    printf("       %s --repair=PLOTFILE [--ranges=RANGES|FILE] [ -x CORE ] [-t THREADS]\n", argv[0]);
+    printf("       %s --convert=POC1FILE [-d DIRECTORY | --inplace]\n", argv[0]);
+    printf("       %s --merge=PLOTFILE,PLOTFILE[,...] [-d DIRECTORY] [-D]\n", argv[0]);
+    printf("       %s --split=PLOTFILE --at=NONCE[,NONCE...] [-d DIRECTORY] [-D]\n", argv[0]);
+    printf("       %s --mine=ROUNDS [-d DIRECTORY[,DIRECTORY...]] [ -x CORE ]\n", argv[0]);
+    printf("       %s --deadlines=SUBMISSIONS [--nonce-cache=NONCES] [ -x CORE ] [ -t THREADS ]\n", argv[0]);
+    printf("       %s --readbench=ROUNDS [--io=buffered,direct,uring] [-d DIRECTORY[,DIRECTORY...]]\n\n", argv[0]);
+    printf("   see README.md\n");
+    exit(-1);
+}
+
+/* }}} */
+
+/* {{{ readtail          legacy resume status */
+
+// Plot files of older versions keep a resume id and the resume position in
+// their last 12 bytes. Reads them through a whole aligned block, so this
+// works with O_DIRECT as well. Returns -1 on errors.
+int
+readtail(struct plotfile *pf, void *data, size_t len) {
+    uint64_t end = pf->baseoffset + (uint64_t)pf->nonces * NONCE_SIZE;
+    char *block;
+
+    if (posix_memalign((void **)&block, 4096, 4096)) {
+        printf("\n\nError while allocating memory with posix_memalign: %d\n\n", errno);
+        return -1;
+    }
+    if ( pread(pf->ofd, block, 4096, end - 4096) < 4096 ) {
+        printf("\n\nError while reading from file: %d\n\n", errno);
+        free(block);
+        return -1;
+    }
+    memcpy(data, block + 4096 - len, len);
+    free(block);
+    return 0;
+}
+
+/* }}} */
+/* {{{ journal           checkpoint journal */
 
-void nonce(uint64_t addr, uint64_t nonce, uint64_t cachepos) {
-    char final[32];
-    char gendata[16 + NONCE_SIZE];
-    char *xv;
+uint64_t
+journalcheck(struct journalrec *jr) {
+    // FNV-1a over everything but the check itself
+    unsigned char *p = (unsigned char *)jr;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < offsetof(struct journalrec, check); i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
 
-    SET_NONCE(gendata, addr,  0);
-    SET_NONCE(gendata, nonce, 8);
+int
+journalappend(struct plotfile *pf, uint32_t type, uint64_t run, uint64_t count, uint64_t scoops) {
+    struct journalrec jr = { JOURNAL_MAGIC, type, run, count, scoops, 0 };
 
-    shabal_context init_x, x;
-    uint32_t len;
+    if (pf->jfd < 0)
+        return 0;
 
-    shabal_init(&init_x, 256);
-    for (uint32_t i = NONCE_SIZE; i > 0; i -= HASH_SIZE) {
-        memcpy(&x, &init_x, sizeof(init_x));
+    jr.check = journalcheck(&jr);
+    if ( write(pf->jfd, &jr, sizeof jr) < (ssize_t)sizeof jr || fdatasync(pf->jfd) < 0 ) {
+        perror("journal");
+        printf("\n\nError while writing journal of %s: %d\n\n", pf->name, errno);
+        return -1;
+    }
+    return 0;
+}
 
-        len = NONCE_SIZE + 16 - i;
-        if (len > HASH_CAP)
-            len = HASH_CAP;
+// Opens the journal of a plot file. When resuming, returns the number of
+// nonces known to be on disk, or -1 if there is no usable journal. Returns
+// -2 if the journal cannot be written.
+int64_t
+journalopen(struct plotfile *pf, int resume) {
+    char jname[PATH_MAX + 8];
+    struct journalrec jr;
+    int64_t durable = -1;
+    int fd;
+
+    snprintf(jname, sizeof jname, "%s.journal", pf->name);
+
+    if (resume && (fd = open(jname, O_RDONLY)) >= 0) {
+        while (read(fd, &jr, sizeof jr) == sizeof jr && jr.magic == JOURNAL_MAGIC && jr.check == journalcheck(&jr)) {
+            if (jr.type == JOURNAL_HEADER) {
+                if (jr.scoops != pf->addr || jr.run != pf->startnonce || jr.count != pf->nonces) {
+                    printf("Journal %s belongs to a different plot, ignoring it.\n", jname);
+                    durable = -1;
+                    break;
+                }
+                durable = 0;
+            }
+            else if (durable >= 0 && jr.type == JOURNAL_ROUND && jr.run == (uint64_t)durable) {
+                durable += jr.count;
+            }
+        }
+        close(fd);
+    }
 
-        shabal(&x, &gendata[i], len);
-        shabal_close(&x, 0, 0, &gendata[i - HASH_SIZE]);
+    pf->jfd = open(jname, O_CREAT | O_WRONLY | O_APPEND | (durable < 0 ? O_TRUNC : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (pf->jfd < 0) {
+        perror(jname);
+        printf("Error opening journal %s\n", jname);
+        return -2;
     }
+    if (durable < 0 && journalappend(pf, JOURNAL_HEADER, pf->startnonce, pf->nonces, pf->addr) < 0)
+        return -2;
 
-    shabal_init(&x, 256);
-    shabal(&x, gendata, 16 + NONCE_SIZE);
-    shabal_close(&x, 0, 0, final);
+    return durable;
+}
 
-    // XOR with final
-    uint64_t *start = (uint64_t*)gendata;
-    uint64_t *fint  = (uint64_t*)&final;
+// Opens the checksum sidecar of a plot file, keeping the records of rounds
+// in front of the resume position. Returns -1 on errors.
+int
+checkopen(struct plotfile *pf, uint64_t resumeat) {
+    char cname[PATH_MAX + 8];
+    struct checkheader ch = { CHECK_MAGIC, CHECK_VERSION, 0, pf->addr, pf->startnonce, pf->nonces };
+    struct checkheader old;
+    uint64_t keep = 0;
+
+    snprintf(cname, sizeof cname, "%s.check", pf->name);
+
+    pf->checkrec = calloc(1, sizeof *pf->checkrec);
+    pf->cfd      = open(cname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (pf->checkrec == NULL || pf->cfd < 0) {
+        perror(cname);
+        printf("Error opening checksum sidecar %s\n", cname);
+        return -1;
+    }
 
-    for (uint32_t i = 0; i < NONCE_SIZE; i += 32) {
-        *start ^= fint[0]; start++;
-        *start ^= fint[1]; start++;
-        *start ^= fint[2]; start++;
-        *start ^= fint[3]; start++;
+    if (resumeat > 0 && pread(pf->cfd, &old, sizeof old, 0) == sizeof old && !memcmp(&old, &ch, sizeof ch)) {
+        while (pread(pf->cfd, pf->checkrec, sizeof *pf->checkrec, sizeof ch + keep * sizeof *pf->checkrec) == sizeof *pf->checkrec
+               && pf->checkrec->run + pf->checkrec->len <= resumeat)
+            keep++;
     }
+    if ( ftruncate(pf->cfd, sizeof ch + keep * sizeof *pf->checkrec) < 0
+         || pwrite(pf->cfd, &ch, sizeof ch, 0) < (ssize_t)sizeof ch
+         || LSEEK(pf->cfd, 0, SEEK_END) < 0 ) {
+        perror(cname);
+        return -1;
+    }
+    return 0;
+}
 
-    // Sort them (PoC2):
-    uint64_t revPosition = NONCE_SIZE-SCOOP_SIZE;
-    for (uint32_t i = 0; i < NONCE_SIZE; i += SCOOP_SIZE){
-        memmove(&cache[cachepos * SCOOP_SIZE + (uint64_t)i * staggersize], &gendata[i], 32);
-        memmove(&cache[cachepos * SCOOP_SIZE + 32 + revPosition * staggersize], &gendata[i+32], 32);
-        revPosition -= SCOOP_SIZE;
+// Appends the checksums collected in pf->checkrec for nonces run..run+len
+int
+checkappend(struct plotfile *pf, uint64_t run, uint32_t len) {
+    if (pf->cfd < 0)
+        return 0;
+
+    pf->checkrec->run = run;
+    pf->checkrec->len = len;
+    if ( write(pf->cfd, pf->checkrec, sizeof *pf->checkrec) < (ssize_t)sizeof *pf->checkrec || fdatasync(pf->cfd) < 0 ) {
+        perror("checksums");
+        printf("\n\nError while writing checksums of %s: %d\n\n", pf->name, errno);
+        return -1;
     }
+    return 0;
+}
+
+// Removes the journal of a finished plot file
+void
+journalremove(struct plotfile *pf) {
+    char jname[PATH_MAX + 8];
+
+    if (pf->jfd < 0)
+        return;
+    close(pf->jfd);
+    pf->jfd = -1;
+    snprintf(jname, sizeof jname, "%s.journal", pf->name);
+    unlink(jname);
 }
 
 /* }}} */
-/* {{{ mnonce            SSE4 version       */
 
+/* {{{ sink              emulated disk for --sink */
+
+// Delays a write request of len bytes like a disk writing rate MB/s that
+// needs latency us per request. The requests queue up behind each other;
+// clock is when the disk is idle again.
+void
+throttlewrite(uint64_t *clock, double rate, uint64_t latency, uint64_t len) {
+    uint64_t now = getMS();
+
+    if (*clock < now)
+        *clock = now;
+    *clock += latency + (uint64_t)((double)len / (rate * 1048576) * 1000000);
+    if (*clock > now)
+        usleep(*clock - now);
+}
+
+// A disk writing sinkrate MB/s that needs sinklatency us per request
+void
+sinkthrottle(struct plotfile *pf, uint64_t len) {
+    throttlewrite(&pf->sinkclock, sinkrate, sinklatency, len);
+}
+
+// Parses null or throttle:<MB/s>,<latency in ms>
 int
-mnonce(uint64_t addr,
-       uint64_t nonce1, uint64_t nonce2, uint64_t nonce3, uint64_t nonce4,
-       uint64_t cachepos1, uint64_t cachepos2, uint64_t cachepos3, uint64_t cachepos4) {
-    char final1[32], final2[32], final3[32], final4[32];
-    char gendata1[16 + NONCE_SIZE], gendata2[16 + NONCE_SIZE], gendata3[16 + NONCE_SIZE], gendata4[16 + NONCE_SIZE];
+sinkparse(char *spec) {
+    double latency = 0;
+
+    if (!strcmp(spec, "null")) {
+        sinkmode = SINK_NULL;
+        return 0;
+    }
+    if (sscanf(spec, "throttle:%lf,%lf", &sinkrate, &latency) >= 1 && sinkrate > 0 && latency >= 0) {
+        sinkmode    = SINK_THROTTLE;
+        sinklatency = (uint64_t)(latency * 1000);
+        return 0;
+    }
+    printf("Unknown sink %s: use null or throttle:<MB/s>,<latency in ms>\n", spec);
+    return -1;
+}
+
+// Throughput once the pipeline is full (from the first round on disk to
+// the last one), and how busy each stage was
+void
+sinkreport(uint64_t wall) {
+    uint64_t written = 0, steady = 0, span = 0;
+    uint32_t f;
+
+    for (f = 0; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[f];
+
+        written += pf->written;
+        if (pf->written > pf->firstlen && pf->lastwritten > pf->firstwritten) {
+            steady += pf->written - pf->firstlen;
+            if (pf->lastwritten - pf->firstwritten > span)
+                span = pf->lastwritten - pf->firstwritten;
+        }
+    }
+    if (span == 0) {
+        steady = written;
+        span   = wall;
+    }
+
+    printf("\nSink report (%s):\n", sinkmode == SINK_NULL ? "null" : "throttle");
+    printf("  %" PRIu64 " nonces in %.1fs, %.0f nonces per minute overall, %.0f in steady state\n",
+           written, (double)wall / 1000000, wall ? written * 60000000.0 / wall : 0, span ? steady * 60000000.0 / span : 0);
+    printf("  hashing: %u threads, %.1f%% busy, %.1f%% waiting for a free stagger buffer\n",
+           threads, wall ? 100.0 * hashbusy / wall / threads : 0, wall ? 100.0 * hashwait / wall / threads : 0);
+    for (f = 0; f < numfiles; f++) {
+        printf("  writing %s: %.1f%% busy\n", plotfiles[f].outputdir, wall ? 100.0 * plotfiles[f].writebusy / wall : 0);
+    }
+}
 
-    char *xv;
+/* }}} */
 
-    SET_NONCE(gendata1, addr,  0);
+/* {{{ progress          JSON lines and Prometheus metrics */
 
-    for (int i = NONCE_SIZE; i <= NONCE_SIZE + 7; ++i) {
-        gendata2[i] = gendata1[i];
-        gendata3[i] = gendata1[i];
-        gendata4[i] = gendata1[i];
+// Copies src with \, " and newlines escaped, for JSON strings and
+// Prometheus label values alike
+void
+escapestr(char *dst, size_t size, const char *src) {
+    size_t n = 0;
+
+    for (; *src && n + 3 < size; src++) {
+        if (*src == '"' || *src == '\\')
+            dst[n++] = '\\';
+        if (*src == '\n') {
+            dst[n++] = '\\';
+            dst[n++] = 'n';
+            continue;
+        }
+        dst[n++] = *src;
     }
+    dst[n] = 0;
+}
+
+// Nonces per minute since the plot started, and the seconds left at that rate
+double
+progressrate(struct plotfile *pf, uint64_t now, double *eta) {
+    double rate = (now > plotstarted) ? pf->sessionwritten * 60000000.0 / (now - plotstarted) : 0;
+
+    *eta = (rate > 0) ? (pf->nonces - pf->written) * 60 / rate : -1;
+    return rate;
+}
+
+// Rounds of the plot file that are being hashed or wait for the writer
+uint32_t
+progressbusy(struct plotfile *pf) {
+    uint32_t k, busy = 0;
+
+    for (k = 0; k < pf->numrounds; k++)
+        busy += (pf->rounds[k].state != ROUND_FREE);
+    return busy;
+}
 
-    SET_NONCE(gendata1, nonce1, 8);
-    SET_NONCE(gendata2, nonce2, 8);
-    SET_NONCE(gendata3, nonce3, 8);
-    SET_NONCE(gendata4, nonce4, 8);
+// The plot file as it will be called once finished
+const char *
+progressname(struct plotfile *pf) {
+    if (pf->ofd < 0)
+        return streamtarget;
+    return pf->finalname[0] ? pf->finalname : pf->name;
+}
+
+// One line per round written. Must be called with poolmutex held.
+void
+progressjson(struct plotfile *pf, struct round *r, uint64_t now, uint64_t writetime) {
+    char name[2 * PATH_MAX];
+    double eta, rate = progressrate(pf, now, &eta);
+
+    escapestr(name, sizeof name, progressname(pf));
+    printf("{\"file\": \"%s\", \"account\": %" PRIu64 ", \"round\": %" PRIu64 ", \"nonces\": %" PRIu64 ", \"total\": %u, "
+           "\"percent\": %.2f, \"round_nonces_per_min\": %.0f, \"nonces_per_min\": %.0f, \"eta_s\": %.0f, "
+           "\"bytes_written\": %" PRIu64 ", \"round_write_s\": %.3f, \"write_latency_us\": {\"avg\": %.0f, \"max\": %" PRIu64 "}, "
+           "\"buffers_busy\": %u, \"buffers\": %u, \"done\": %s}\n",
+           name, pf->addr, r->seq, pf->written, pf->nonces,
+           100.0 * pf->written / pf->nonces, (now > r->starttime) ? r->len * 60000000.0 / (now - r->starttime) : 0, rate, eta,
+           pf->byteswritten, writetime / 1e6, pf->roundreqs ? (double)pf->roundreqtime / pf->roundreqs : 0, pf->roundreqmax,
+           progressbusy(pf), pf->numrounds, pf->written == pf->nonces ? "true" : "false");
+    fflush(stdout);
+}
+
+// Prometheus metric families of every plot file
+const char *metricfamilies[][3] = {
+    { "engraver_nonces_written",             "gauge",   "Nonces of the plot file on disk." },
+    { "engraver_nonces_total",               "gauge",   "Nonces of the plot file." },
+    { "engraver_nonces_per_minute",          "gauge",   "Plotting rate since the start." },
+    { "engraver_eta_seconds",                "gauge",   "Time left at that rate, -1 if unknown." },
+    { "engraver_bytes_written_total",        "counter", "Bytes written in this run." },
+    { "engraver_write_request_seconds",      "summary", "Time of the write requests, up to one per scoop of a round." },
+    { "engraver_write_request_max_seconds",  "gauge",   "Slowest write request of the last round." },
+    { "engraver_buffers_busy",               "gauge",   "Stagger buffers being hashed or waiting for the writer." },
+    { "engraver_buffers",                    "gauge",   "Stagger buffers of the plot file." },
+    { "engraver_yields_total",               "counter", "Yield windows for the miner." },
+    { "engraver_yield_seconds_total",        "counter", "Time writes were held or slowed for the miner." },
+};
+
+// Rewrites the textfile collector file of node_exporter with the state of
+// all plot files. The new file is renamed over the old one, so it is never
+// seen half written. Must be called with poolmutex held.
+void
+progressmetrics(int done) {
+    char tmp[PATH_MAX + 8], name[2 * PATH_MAX], labels[2 * PATH_MAX + 64];
+    uint64_t now = getMS();
+    uint32_t f, k;
+    double eta, rate;
+    FILE *m;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", metricsfile);
+    if ((m = fopen(tmp, "w")) == NULL) {
+        printf("Cannot write metrics to %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    for (k = 0; k < sizeof metricfamilies / sizeof *metricfamilies; k++) {
+        const char *family = metricfamilies[k][0];
+
+        fprintf(m, "# HELP %s %s\n# TYPE %s %s\n", family, metricfamilies[k][2], family, metricfamilies[k][1]);
+        for (f = 0; f < numfiles; f++) {
+            struct plotfile *pf = &plotfiles[f];
+
+            escapestr(name, sizeof name, progressname(pf));
+            snprintf(labels, sizeof labels, "{file=\"%s\",account=\"%" PRIu64 "\"}", name, pf->addr);
+            rate = progressrate(pf, now, &eta);
+            switch (k) {
+            case 0: fprintf(m, "%s%s %" PRIu64 "\n", family, labels, pf->written); break;
+            case 1: fprintf(m, "%s%s %u\n", family, labels, pf->nonces); break;
+            case 2: fprintf(m, "%s%s %.0f\n", family, labels, rate); break;
+            case 3: fprintf(m, "%s%s %.0f\n", family, labels, eta); break;
+            case 4: fprintf(m, "%s%s %" PRIu64 "\n", family, labels, pf->byteswritten); break;
+            case 5:
+                fprintf(m, "%s_sum%s %.6f\n", family, labels, pf->reqtime / 1e6);
+                fprintf(m, "%s_count%s %" PRIu64 "\n", family, labels, pf->reqs);
+                break;
+            case 6: fprintf(m, "%s%s %.6f\n", family, labels, pf->roundreqmax / 1e6); break;
+            case 7: fprintf(m, "%s%s %u\n", family, labels, progressbusy(pf)); break;
+            case 8: fprintf(m, "%s%s %u\n", family, labels, pf->numrounds); break;
+            case 9: fprintf(m, "%s%s %" PRIu64 "\n", family, labels, pf->yields); break;
+            case 10: fprintf(m, "%s%s %.3f\n", family, labels, pf->yieldtime / 1e6); break;
+            }
+        }
+    }
+    fprintf(m, "# HELP engraver_hash_threads Hashing threads.\n# TYPE engraver_hash_threads gauge\nengraver_hash_threads %u\n", threads);
+    fprintf(m, "# HELP engraver_hash_busy_ratio Share of the time the hashing threads were hashing.\n# TYPE engraver_hash_busy_ratio gauge\n");
+    fprintf(m, "engraver_hash_busy_ratio %.4f\n", (now > plotstarted && threads) ? (double)hashbusy / (now - plotstarted) / threads : 0);
+    fprintf(m, "# HELP engraver_done 1 once the plotter has finished.\n# TYPE engraver_done gauge\nengraver_done %d\n", done);
+    fprintf(m, "# HELP engraver_last_update_seconds When this file was written.\n# TYPE engraver_last_update_seconds gauge\n");
+    fprintf(m, "engraver_last_update_seconds %ld\n", (long)time(NULL));
+    if (fclose(m) != 0 || rename(tmp, metricsfile) < 0) {
+        printf("Cannot write metrics to %s: %s\n", metricsfile, strerror(errno));
+        unlink(tmp);
+    }
+}
 
-    mshabal_context x;
-    int len;
+/* }}} */
+/* {{{ governor          yield the disks to the miner */
 
-    for (int i = NONCE_SIZE; i > 0; i -= HASH_SIZE) {
-      sse4_mshabal_init(&x, 256);
+#if __APPLE__
+#define st_mtim st_mtimespec
+#endif
 
-      len = NONCE_SIZE + 16 - i;
-      if (len > HASH_CAP)
-          len = HASH_CAP;
+// Holds (or slows down to yieldrate) the writes of a plot file until its
+// yield window is over. Hashing goes on into the free stagger buffers.
+void
+yieldwrite(struct plotfile *pf, uint64_t len) {
+    uint64_t start = getMS(), now = start;
 
-      sse4_mshabal(&x, &gendata1[i], &gendata2[i], &gendata3[i], &gendata4[i], len);
-      sse4_mshabal_close(&x, 0, 0, 0, 0, 0, &gendata1[i - HASH_SIZE], &gendata2[i - HASH_SIZE], &gendata3[i - HASH_SIZE], &gendata4[i - HASH_SIZE]);
+    while (now < pf->yielduntil) {
+        if (yieldrate > 0) {
+            throttlewrite(&pf->yieldclock, yieldrate, 0, len);
+            break;
+        }
+        usleep((pf->yielduntil - now < 50000) ? pf->yielduntil - now : 50000);
+        now = getMS();
     }
+    pf->yieldtime += getMS() - start;
+}
 
-    sse4_mshabal_init(&x, 256);
-    sse4_mshabal(&x, gendata1, gendata2, gendata3, gendata4, 16 + NONCE_SIZE);
-    sse4_mshabal_close(&x, 0, 0, 0, 0, 0, final1, final2, final3, final4);
+// Opens a yield window on the plot files in dir, or on all of them if dir
+// is NULL. Returns the number of plot files. Must be called with poolmutex
+// held.
+uint32_t
+yieldstart(const char *dir) {
+    uint64_t until = getMS() + (uint64_t)(yieldwindow * 1000000);
+    size_t len = dir ? strlen(dir) : 0;
+    uint32_t f, n = 0;
+
+    while (len > 1 && dir[len - 1] == '/')
+        len--;
+    for (f = 0; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[f];
+
+        // Directories match with or without the final slash
+        if (dir != NULL && (strncmp(pf->outputdir, dir, len) || (pf->outputdir[len] && strcmp(&pf->outputdir[len], "/"))))
+            continue;
+        if (pf->yielduntil < until)
+            pf->yielduntil = until;
+        pf->yields++;
+        n++;
+    }
+    return n;
+}
 
-    // XOR with final
-    for (int i = 0; i < NONCE_SIZE; i++) {
-        gendata1[i] ^= (final1[i % 32]);
-        gendata2[i] ^= (final2[i % 32]);
-        gendata3[i] ^= (final3[i % 32]);
-        gendata4[i] ^= (final4[i % 32]);
+// Watches the --yield-on file: every change of its modification time (a
+// touch by the miner's new block hook) opens a window on all plot files
+void *
+governor_i(void *x_void_ptr) {
+    struct stat st;
+    struct timespec seen = { 0, 0 };
+
+    if (stat(yieldfile, &st) == 0)
+        seen = st.st_mtim;
+    for (;;) {
+        usleep(100000);
+        if (stat(yieldfile, &st) < 0 || (st.st_mtim.tv_sec == seen.tv_sec && st.st_mtim.tv_nsec == seen.tv_nsec))
+            continue;
+        seen = st.st_mtim;
+        pthread_mutex_lock(&poolmutex);
+        yieldstart(NULL);
+        pthread_mutex_unlock(&poolmutex);
+        if (verbose) {
+            printf("\nNew block: writes yield to the miner for %.1fs\n", yieldwindow);
+            fflush(stdout);
+        }
     }
+    return NULL;
+}
+
+/* }}} */
+/* {{{ perfreport        --perf-counters per round and in total */
+
+// Per nonce values of the counters that were available, and the IPC
+void
+perfformat(char *buf, size_t size, const struct perfcount *pc, uint64_t nonces) {
+    size_t n = 0;
+    int k;
+
+    buf[0] = 0;
+    if ((perfmask & (1 << PERF_CYCLES)) && (perfmask & (1 << PERF_INSTRUCTIONS)) && pc->v[PERF_CYCLES] > 0)
+        n += snprintf(buf + n, size - n, "IPC %.2f, ", (double)pc->v[PERF_INSTRUCTIONS] / pc->v[PERF_CYCLES]);
+    for (k = 0; k < PERF_COUNTERS && n < size; k++) {
+        double v = nonces ? (double)pc->v[k] / nonces : 0;
 
-    // Sort them (PoC2):
-    uint64_t revPosition = NONCE_SIZE-SCOOP_SIZE;
-    for (int i = 0; i < NONCE_SIZE; i += 64) {
-        memmove(&cache[cachepos1 * 64 + (uint64_t)i * staggersize], &gendata1[i], 32);
-        memmove(&cache[cachepos2 * 64 + (uint64_t)i * staggersize], &gendata2[i], 32);
-        memmove(&cache[cachepos3 * 64 + (uint64_t)i * staggersize], &gendata3[i], 32);
-        memmove(&cache[cachepos4 * 64 + (uint64_t)i * staggersize], &gendata4[i], 32);
-        memmove(&cache[cachepos1 * 64 + 32 + revPosition * staggersize], &gendata1[i+32], 32);
-        memmove(&cache[cachepos2 * 64 + 32 + revPosition * staggersize], &gendata2[i+32], 32);
-        memmove(&cache[cachepos3 * 64 + 32 + revPosition * staggersize], &gendata3[i+32], 32);
-        memmove(&cache[cachepos4 * 64 + 32 + revPosition * staggersize], &gendata4[i+32], 32);
-        revPosition -= SCOOP_SIZE;
+        if (!(perfmask & (1 << k)))
+            continue;
+        if (k == PERF_TASKCLOCK)
+            n += snprintf(buf + n, size - n, "%s %.2fms/nonce, ", perf_names[k], v / 1e6);
+        else if (v >= 1e6)
+            n += snprintf(buf + n, size - n, "%s %.1fM/nonce, ", perf_names[k], v / 1e6);
+        else if (v >= 1e3)
+            n += snprintf(buf + n, size - n, "%s %.1fk/nonce, ", perf_names[k], v / 1e3);
+        else
+            n += snprintf(buf + n, size - n, "%s %.1f/nonce, ", perf_names[k], v);
     }
+    if (n >= 2 && n < size)
+        buf[n - 2] = 0;
+}
 
-    return 0;
+// A line per round written. Must be called with poolmutex held.
+void
+perfround(struct round *r, uint64_t now) {
+    char hash[512], write[512];
+
+    perfformat(hash, sizeof hash, &r->hashperf, r->len);
+    perfformat(write, sizeof write, &r->writeperf, r->len);
+    printf("\nRound %" PRIu64 " (%u nonces, %.0f nonces per minute): hashing %s; writing %s\n", r->seq, r->len,
+           (now > r->starttime) ? r->len * 60000000.0 / (now - r->starttime) : 0, hash, write);
+    fflush(stdout);
 }
 
-// }}}
-// {{{ m256nonce         AVX2 version
+// Totals of the run for the core that was used. LLC misses are cache line
+// fills, so with the CPU time they give a rough memory bandwidth.
+void
+perfreport(uint64_t nonces) {
+    const char *cores[] = { "ORIG", "SSE4", "AVX2" };
+    char buf[512];
+
+    if (perfmask == 0)
+        return;
+    printf("\nPerformance counters (%s core, %u threads, %" PRIu64 " nonces):\n", cores[selecttype], threads, nonces);
+    perfformat(buf, sizeof buf, &perfhash, nonces);
+    printf("  hashing: %s\n", buf);
+    perfformat(buf, sizeof buf, &perfwrite, nonces);
+    printf("  writing: %s\n", buf);
+    if ((perfmask & (1 << PERF_LLCMISSES)) && (perfmask & (1 << PERF_TASKCLOCK)) && perfhash.v[PERF_TASKCLOCK] > 0) {
+        printf("  LLC miss traffic: hashing %.0f MB/s, writing %.0f MB/s per busy thread\n",
+               perfhash.v[PERF_LLCMISSES] * 64.0 / 1048576 / (perfhash.v[PERF_TASKCLOCK] / 1e9),
+               perfwrite.v[PERF_TASKCLOCK] ? perfwrite.v[PERF_LLCMISSES] * 64.0 / 1048576 / (perfwrite.v[PERF_TASKCLOCK] / 1e9) : 0);
+    }
+}
+
+/* }}} */
+/* {{{ extentmap         physical layout of a plot file */
+
+// Reads where the plot file lies on disk (FIEMAP). The map stays empty if
+// the file system cannot tell, or a part of the file has no place yet.
+void
+extentmap(struct plotfile *pf) {
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+    struct fiemap *fm = calloc(1, sizeof *fm);
+    uint32_t k, n;
+
+    if (fm == NULL)
+        return;
+    fm->fm_length = (uint64_t)pf->nonces * NONCE_SIZE;
+    fm->fm_flags  = FIEMAP_FLAG_SYNC;
+    if (ioctl(pf->ofd, FS_IOC_FIEMAP, fm) < 0 || (n = fm->fm_mapped_extents) == 0) {
+        free(fm);
+        return;
+    }
+    free(fm);
+
+    fm = calloc(1, sizeof *fm + n * sizeof(struct fiemap_extent));
+    pf->extents = calloc(n, sizeof *pf->extents);
+    if (fm == NULL || pf->extents == NULL)
+        goto none;
+    fm->fm_length       = (uint64_t)pf->nonces * NONCE_SIZE;
+    fm->fm_flags        = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = n;
+    if (ioctl(pf->ofd, FS_IOC_FIEMAP, fm) < 0)
+        goto none;
+    // Written and still unwritten (preallocated) parts of one run on disk
+    // are separate extents to the file system, but not to the disk
+    for (k = 0, n = 0; k < fm->fm_mapped_extents; k++) {
+        struct fiemap_extent *fe = &fm->fm_extents[k];
+        struct extent *last = n ? &pf->extents[n - 1] : NULL;
+
+        if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED))
+            goto none;
+        if (last != NULL && last->logical + last->length == fe->fe_logical && last->physical + last->length == fe->fe_physical) {
+            last->length += fe->fe_length;
+            continue;
+        }
+        pf->extents[n].logical  = fe->fe_logical;
+        pf->extents[n].physical = fe->fe_physical;
+        pf->extents[n].length   = fe->fe_length;
+        n++;
+    }
+    pf->numextents = n;
+    free(fm);
+    return;
+
+none:
+    free(fm);
+    free(pf->extents);
+    pf->extents    = NULL;
+    pf->numextents = 0;
+#endif
+}
+
+// Disk position of a file offset, -1 if it is in no extent
+int64_t
+extentphysical(struct plotfile *pf, uint64_t offset) {
+    uint32_t lo = 0, hi = pf->numextents;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (pf->extents[mid].logical + pf->extents[mid].length <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == pf->numextents || offset < pf->extents[lo].logical)
+        return -1;
+    return pf->extents[lo].physical + (offset - pf->extents[lo].logical);
+}
+
+struct scoopplace {
+    int64_t physical;
+    uint32_t scoop;
+};
 
 int
-m256nonce(uint64_t addr,
-          uint64_t nonce1, uint64_t nonce2, uint64_t nonce3, uint64_t nonce4,
-          uint64_t nonce5, uint64_t nonce6, uint64_t nonce7, uint64_t nonce8,
-          uint64_t cachepos) {
-    char final1[32], final2[32], final3[32], final4[32];
-    char final5[32], final6[32], final7[32], final8[32];
-    char gendata1[16 + NONCE_SIZE], gendata2[16 + NONCE_SIZE], gendata3[16 + NONCE_SIZE], gendata4[16 + NONCE_SIZE];
-    char gendata5[16 + NONCE_SIZE], gendata6[16 + NONCE_SIZE], gendata7[16 + NONCE_SIZE], gendata8[16 + NONCE_SIZE];
-
-    char *xv;
-
-    SET_NONCE(gendata1, addr,  0);
-
-    for (int i = NONCE_SIZE; i <= NONCE_SIZE + 7; ++i) {
-      gendata2[i] = gendata1[i];
-      gendata3[i] = gendata1[i];
-      gendata4[i] = gendata1[i];
-      gendata5[i] = gendata1[i];
-      gendata6[i] = gendata1[i];
-      gendata7[i] = gendata1[i];
-      gendata8[i] = gendata1[i];
-    }
-
-    SET_NONCE(gendata1, nonce1, 8);
-    SET_NONCE(gendata2, nonce2, 8);
-    SET_NONCE(gendata3, nonce3, 8);
-    SET_NONCE(gendata4, nonce4, 8);
-    SET_NONCE(gendata5, nonce5, 8);
-    SET_NONCE(gendata6, nonce6, 8);
-    SET_NONCE(gendata7, nonce7, 8);
-    SET_NONCE(gendata8, nonce8, 8);
-
-    mshabal256_context x;
-    int len;
-
-    for (int i = NONCE_SIZE; i;) {
-      mshabal256_init(&x);
-
-      len = NONCE_SIZE + 16 - i;
-      if (len > HASH_CAP)
-        len = HASH_CAP;
-
-      mshabal256(&x, &gendata1[i], &gendata2[i], &gendata3[i], &gendata4[i], &gendata5[i], &gendata6[i], &gendata7[i], &gendata8[i], len);
-
-      i -= HASH_SIZE;
-      mshabal256_close(&x,
-                       (uint32_t *)&gendata1[i], (uint32_t *)&gendata2[i], (uint32_t *)&gendata3[i], (uint32_t *)&gendata4[i],
-                       (uint32_t *)&gendata5[i], (uint32_t *)&gendata6[i], (uint32_t *)&gendata7[i], (uint32_t *)&gendata8[i]);
-
-    }
-
-    mshabal256_init(&x);
-    mshabal256(&x, gendata1, gendata2, gendata3, gendata4, gendata5, gendata6, gendata7, gendata8, 16 + NONCE_SIZE);
-    mshabal256_close(&x,
-                     (uint32_t *)final1, (uint32_t *)final2, (uint32_t *)final3, (uint32_t *)final4,
-                     (uint32_t *)final5, (uint32_t *)final6, (uint32_t *)final7, (uint32_t *)final8);
-
-    // XOR with final
-    for (int i = 0; i < NONCE_SIZE; i++) {
-      gendata1[i] ^= final1[i % 32];
-      gendata2[i] ^= final2[i % 32];
-      gendata3[i] ^= final3[i % 32];
-      gendata4[i] ^= final4[i % 32];
-      gendata5[i] ^= final5[i % 32];
-      gendata6[i] ^= final6[i % 32];
-      gendata7[i] ^= final7[i % 32];
-      gendata8[i] ^= final8[i % 32];
-    }
-
-    // Sort them (PoC2):
-    uint64_t revPosition = NONCE_SIZE-SCOOP_SIZE;
-    for (int i = 0; i < NONCE_SIZE; i += 64) {
-        memmove(&cache[cachepos * 64 +       (uint64_t)i * staggersize], &gendata1[i], 32);
-        memmove(&cache[cachepos * 64 +  64 + (uint64_t)i * staggersize], &gendata2[i], 32);
-        memmove(&cache[cachepos * 64 + 128 + (uint64_t)i * staggersize], &gendata3[i], 32);
-        memmove(&cache[cachepos * 64 + 192 + (uint64_t)i * staggersize], &gendata4[i], 32);
-        memmove(&cache[cachepos * 64 + 256 + (uint64_t)i * staggersize], &gendata5[i], 32);
-        memmove(&cache[cachepos * 64 + 320 + (uint64_t)i * staggersize], &gendata6[i], 32);
-        memmove(&cache[cachepos * 64 + 384 + (uint64_t)i * staggersize], &gendata7[i], 32);
-        memmove(&cache[cachepos * 64 + 448 + (uint64_t)i * staggersize], &gendata8[i], 32);
-        memmove(&cache[cachepos * 64 +     + 32 + revPosition * staggersize], &gendata1[i+32], 32);
-        memmove(&cache[cachepos * 64 +  64 + 32 + revPosition * staggersize], &gendata2[i+32], 32);
-        memmove(&cache[cachepos * 64 + 128 + 32 + revPosition * staggersize], &gendata3[i+32], 32);
-        memmove(&cache[cachepos * 64 + 192 + 32 + revPosition * staggersize], &gendata4[i+32], 32);
-        memmove(&cache[cachepos * 64 + 256 + 32 + revPosition * staggersize], &gendata5[i+32], 32);
-        memmove(&cache[cachepos * 64 + 320 + 32 + revPosition * staggersize], &gendata6[i+32], 32);
-        memmove(&cache[cachepos * 64 + 384 + 32 + revPosition * staggersize], &gendata7[i+32], 32);
-        memmove(&cache[cachepos * 64 + 448 + 32 + revPosition * staggersize], &gendata8[i+32], 32);
-        revPosition -= SCOOP_SIZE;
-    }
-  
-    return 0;
+cmpscoopplace(const void *a, const void *b) {
+    const struct scoopplace *x = a, *y = b;
+
+    return (x->physical > y->physical) - (x->physical < y->physical);
 }
-// }}}
-// {{{ work_i
 
-void *
-work_i(void *x_void_ptr) {
-	uint64_t i = *(uint64_t *)x_void_ptr;
-    uint32_t n;
+// The scoop blocks of round r in the order they lie on disk, so that a
+// fragmented plot file is written in one sweep. Returns 1 if that is file
+// order anyway.
+int
+extentorder(struct plotfile *pf, struct round *r, uint32_t *order) {
+    struct scoopplace place[NUM_SCOOPS];
+    uint32_t s;
+
+    for (s = 0; s < NUM_SCOOPS; s++)
+        order[s] = s;
+    if (pf->numextents < 2)
+        return 1;
+
+    for (s = 0; s < NUM_SCOOPS; s++) {
+        place[s].physical = extentphysical(pf, engraver_offset(pf->nonces, s, r->run));
+        place[s].scoop    = s;
+        if (place[s].physical < 0)
+            return 1;
+    }
+    qsort(place, NUM_SCOOPS, sizeof *place, cmpscoopplace);
+    for (s = 0; s < NUM_SCOOPS; s++)
+        order[s] = place[s].scoop;
+    for (s = 0; s < NUM_SCOOPS && order[s] == s; s++)
+        ;
+    return s == NUM_SCOOPS;
+}
+
+/* }}} */
+/* {{{ writecache  */
+
+// Returns -1 if a scoop block could not be written
+int
+writecache(struct plotfile *pf, struct round *r) {
+    uint64_t cacheblocksize = (uint64_t)pf->staggersize * SCOOP_SIZE;
+    uint64_t writesize      = (uint64_t)r->len * SCOOP_SIZE;
+    uint64_t thisnonce;
+    uint32_t order[NUM_SCOOPS], k, b, blocks;
+    float percent;
+    char prefix[PATH_MAX + 2] = "";
+
+    if (numfiles > 1) {
+        snprintf(prefix, sizeof prefix, "%s ", pf->outputdir);
+    }
+
+    percent = ((double)100 * (r->run + r->len) / pf->nonces);
+    pf->roundreqtime = 0;
+    pf->roundreqmax  = 0;
+
+    // With --progress=json, the writer thread prints a line per round instead
+    if (progressmode == PROGRESS_TEXT && pf->lastseconds) {
+        printf("\r\n\33[2K\r%s%5.2f%% done. %i nonces per minute, %02i:%02i:%02i left [writing%s]",
+               prefix, percent, (pf->lastspeed * 60), pf->lasthours, pf->lastminutes, pf->lastseconds, (asyncmode) ? " asynchronously" : "");
+    }
+    else if (progressmode == PROGRESS_TEXT) {
+        printf("\33[2K\r%s%5.2f%% done. [writing%s]",
+               prefix, percent, (asyncmode) ? " asynchronously" : "");
+    }
+    fflush(stdout);
+
+    if (!extentorder(pf, r, order))
+        pf->reordered++;
+    pf->roundreqs = 0;
+
+    for (k = 0; k < NUM_SCOOPS; k += blocks) {
+        thisnonce = order[k];
+
+        // Scoop blocks next to each other both in the file and in the buffer
+        // (a round that covers the whole plot) go out in one request
+        for (blocks = 1; k + blocks < NUM_SCOOPS && order[k + blocks] == thisnonce + blocks && r->len == pf->nonces
+             && r->len == pf->staggersize; blocks++)
+            ;
 
-    for (n = 0; n < noncesperthread; n += noncearguments) {
-        if (selecttype == 1) { // SSE4
-            mnonce(addr,
-                   (i + n), (i + n + 1), (i + n + 2), (i + n + 3),
-                   (uint64_t)(i - startnonce + n),
-                   (uint64_t)(i - startnonce + n + 1),
-                   (uint64_t)(i - startnonce + n + 2),
-                   (uint64_t)(i - startnonce + n + 3));
+        uint64_t cacheposition = thisnonce * cacheblocksize;
+        uint64_t fileposition  = pf->baseoffset + engraver_offset(pf->nonces, thisnonce, r->run);
+        uint64_t size          = writesize * blocks;
+        if (pf->checkrec != NULL) {
+            for (b = 0; b < blocks; b++)
+                pf->checkrec->sum[thisnonce + b] = xxh64(&r->cache[cacheposition + b * cacheblocksize], writesize, 0);
         }
-        else if (selecttype == 2) { // AVX2
-            m256nonce(addr,
-                      (i + n + 0), (i + n + 1), (i + n + 2), (i + n + 3),
-                      (i + n + 4), (i + n + 5), (i + n + 6), (i + n + 7),
-                      (i - startnonce + n));
+        uint64_t t = phase_start();
+        if ( LSEEK(pf->ofd, fileposition, SEEK_SET) < 0 ) {
+            printf("\n\nError while lseek()ing in %s: %d\n\n", pf->name, errno);
+            return -1;
         }
-        else { // STANDARD
-            nonce(addr, (i + n), (uint64_t)(i - startnonce + n));
+        t = phase_end(PHASE_SEEK, t);
+        if (sinkmode == SINK_THROTTLE)
+            sinkthrottle(pf, size);
+        if (writecap > 0)
+            throttlewrite(&pf->capclock, writecap, 0, size);
+        if (pf->yielduntil > 0)
+            yieldwrite(pf, size);
+        uint64_t reqstart = getMS();
+        ssize_t n = write(pf->ofd, &r->cache[cacheposition], size);
+        if ( n < (ssize_t)size ) {
+            // A short write is a full disk
+            if (n >= 0)
+                errno = ENOSPC;
+            perror("writecache");
+            printf("\n\nError while writing to %s: %d\n\n", pf->name, errno);
+            return -1;
         }
+        phase_end(PHASE_WRITE, t);
+        reqstart = getMS() - reqstart;
+        pf->roundreqtime += reqstart;
+        pf->roundreqs++;
+        if (reqstart > pf->roundreqmax)
+            pf->roundreqmax = reqstart;
+    }
 
-        // If verbose mode is set print out actual nonce plot state
-        if (verbose == 1) {
-            static unsigned int oldn = 1;
+    uint64_t ms = getMS() - r->starttime;
 
-            if (oldn != n) {
-                oldn = n;
-                printf("Nonces %lu from %u nonces %2.2f %% done...\r\n",
-                       ((uint64_t)(n * threads)) + run, nonces,
-                       ((float) ((n * threads) + run) / (float) nonces) * 100);
-                fflush(stdout);
-            }
-        }
+    double runsecs = (double)ms / 1000000;
+    pf->lastspeed  = (int)(r->len / runsecs);
+
+    int seconds      = pf->lastspeed ? (int)(pf->nonces - r->run - r->len) / pf->lastspeed : 0;
+    int remainder    = seconds % 3600;
+    pf->lasthours    = (int)seconds / 3600;
+    pf->lastminutes  = remainder / 60;
+    pf->lastseconds  = remainder % 60;
+
+    if (progressmode == PROGRESS_JSON)
+        return 0;
+    printf("\r\n\33[2K\r%s%5.2f%% done. %i nonces per minute, %02i:%02i:%02i left",
+           prefix, percent, (pf->lastspeed * 60), pf->lasthours, pf->lastminutes, pf->lastseconds);
+    fflush(stdout);
+    return 0;
+}
+
+/* }}} */
+/* {{{ streamcache     send plot from memory */
+
+// A fully buffered plot already is in file order: send the buffer as is
+int
+streamcache(struct plotfile *pf, struct round *r) {
+    uint64_t ms = getMS();
+
+    printf("\r\n\33[2K\rStreaming %u nonces (%0.2f GB) from memory...", pf->nonces, (double)pf->nonces * NONCE_SIZE / 1024 / 1024 / 1024);
+    fflush(stdout);
+
+    if (stream_sendbuf(streamfd, r->cache, (uint64_t)pf->nonces * NONCE_SIZE) < 0) {
+        perror("stream");
+        printf("\n\nError while streaming plot to %s\n\n", streamtarget);
+        return -1;
     }
 
-    return NULL;
+    ms = getMS() - ms;
+    printf(" done, %0.2f MB/s", (double)pf->nonces * NONCE_SIZE / 1024 / 1024 / ((double)ms / 1000000));
+    fflush(stdout);
+    return 0;
 }
 
 /* }}} */
-/* {{{ getMS             get miliseconds    */
+/* {{{ streamfile      send plot from scratch file */
+
+void
+streamfile(struct plotfile *pf) {
+    uint64_t ms = getMS();
+    int fd = open(pf->name, O_RDONLY);
+
+    printf("\nStreaming %u nonces (%0.2f GB) from scratch file %s...", pf->nonces, (double)pf->nonces * NONCE_SIZE / 1024 / 1024 / 1024, pf->name);
+    fflush(stdout);
+
+    if (fd < 0 || stream_sendfile(streamfd, fd, 0, (uint64_t)pf->nonces * NONCE_SIZE) < 0) {
+        perror("stream");
+        printf("\n\nError while streaming plot to %s, keeping %s\n\n", streamtarget, pf->name);
+        exit(1);
+    }
+    close(fd);
+    unlink(pf->name);
+
+    ms = getMS() - ms;
+    printf(" done, %0.2f MB/s\n", (double)pf->nonces * NONCE_SIZE / 1024 / 1024 / ((double)ms / 1000000));
+}
+
+/* }}} */
+/* {{{ receive         write a streamed plot to disk */
+
+int
+receive(char *source, char *outputdir) {
+    struct streamheader sh;
+    char name[PATH_MAX], finalname[PATH_MAX];
+    uint64_t ms, filesize;
+    int fd, ofd;
+
+    printf("Waiting for plot stream on %s...\n", source);
+    if ((fd = stream_accept(source)) < 0)
+        return 1;
+
+    if (stream_readfull(fd, &sh, sizeof sh) < 0 || memcmp(sh.magic, STREAM_MAGIC, sizeof sh.magic) || sh.version != STREAM_VERSION) {
+        printf("Not a plot stream.\n");
+        return 1;
+    }
+
+    ms = getMS();
+    filesize = sh.nonces * NONCE_SIZE;
+
+    mkdir(outputdir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+    snprintf(name, sizeof name, "%s%"PRIu64"_%"PRIu64"_%"PRIu64".plotting", outputdir, sh.addr, sh.startnonce, sh.nonces);
+    snprintf(finalname, sizeof finalname, "%s%"PRIu64"_%"PRIu64"_%"PRIu64, outputdir, sh.addr, sh.startnonce, sh.nonces);
+    printf("Receiving %"PRIu64" nonces (%0.2f GB) into %s\n", sh.nonces, (double)filesize / 1024 / 1024 / 1024, name);
+
+    unlink(name);
+    ofd = open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (ofd < 0) {
+        perror(name);
+        printf("Error opening file %s\n", name);
+        return 1;
+    }
+    if ( posix_fallocate(ofd, 0, filesize) != 0 ) {
+        printf("File pre-allocation failed.\n");
+        return 1;
+    }
+
+    if (stream_recvfile(fd, ofd, 0, filesize) < 0) {
+        perror("receive");
+        printf("Error while receiving plot, keeping %s\n", name);
+        return 1;
+    }
+    fdatasync(ofd);
+    close(ofd);
+    close(fd);
+
+    ms = getMS() - ms;
+    printf("Received %0.2f GB in %.1fs (%0.2f MB/s); renaming file...\n",
+           (double)filesize / 1024 / 1024 / 1024, (double)ms / 1000000, (double)filesize / 1024 / 1024 / ((double)ms / 1000000));
+
+    unlink(finalname);
+    if ( rename(name, finalname) < 0 ) {
+        printf("Error while renaming file: %d\n", errno);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* }}} */
+/* {{{ rawdevice         region table       */
+
+int
+rawwriteheader(struct plotfile *pf) {
+    if ( pwrite(pf->ofd, pf->rawheader, sizeof *pf->rawheader, 0) < (ssize_t)sizeof *pf->rawheader ) {
+        perror("rawwriteheader");
+        printf("\n\nError while writing region table to %s: %d\n\n", pf->name, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// Opens the device and loads its region table. Sets space to the number of
+// bytes available for a new region; returns -1 on errors.
+int
+rawopen(struct plotfile *pf, int init, uint64_t *space) {
+    struct stat st;
+    uint64_t size = 0, next = RAW_ALIGN;
+    uint32_t k;
+
+    snprintf(pf->name, sizeof pf->name, "%s", pf->outputdir);
+#if __APPLE__
+    pf->ofd = open(pf->name, O_RDWR);
+    if (pf->ofd >= 0)
+        fcntl(pf->ofd, F_NOCACHE, 1);
+#else
+    pf->ofd = open(pf->name, O_LARGEFILE | O_RDWR | O_DIRECT);
+#endif
+    if (pf->ofd < 0 || fstat(pf->ofd, &st) < 0) {
+        perror(pf->name);
+        printf("Error opening device %s\n", pf->name);
+        return -1;
+    }
+    if (S_ISBLK(st.st_mode)) {
+#ifdef BLKGETSIZE64
+        if (ioctl(pf->ofd, BLKGETSIZE64, &size) < 0) {
+            perror(pf->name);
+            return -1;
+        }
+#else
+        size = LSEEK(pf->ofd, 0, SEEK_END);
+#endif
+    }
+    else {
+        size = st.st_size;
+    }
+
+    if (posix_memalign((void **)&pf->rawheader, 4096, sizeof *pf->rawheader)) {
+        printf("\n\nError while allocating memory with posix_memalign: %d\n\n", errno);
+        pf->rawheader = NULL;
+        return -1;
+    }
+    if ( pread(pf->ofd, pf->rawheader, sizeof *pf->rawheader, 0) < (ssize_t)sizeof *pf->rawheader ) {
+        printf("\n\nError while reading region table from %s: %d\n\n", pf->name, errno);
+        return -1;
+    }
+
+    if (memcmp(pf->rawheader->magic, RAW_MAGIC, sizeof pf->rawheader->magic)) {
+        if (!init) {
+            printf("%s has no plot region table. Use -I to initialize it (this discards its contents).\n", pf->name);
+            return -1;
+        }
+        printf("Initializing plot region table on %s (%0.2f GB).\n", pf->name, (double)size / 1024 / 1024 / 1024);
+        memset(pf->rawheader, 0, sizeof *pf->rawheader);
+        memcpy(pf->rawheader->magic, RAW_MAGIC, sizeof pf->rawheader->magic);
+        pf->rawheader->version = RAW_VERSION;
+        if (rawwriteheader(pf) < 0)
+            return -1;
+    }
+    else if (pf->rawheader->version != RAW_VERSION || pf->rawheader->count > RAW_MAX_REGIONS) {
+        printf("Unsupported plot region table on %s.\n", pf->name);
+        return -1;
+    }
+
+    for (k = 0; k < pf->rawheader->count; k++) {
+        struct rawregion *rr = &pf->rawheader->region[k];
+        uint64_t end = rr->offset + rr->nonces * NONCE_SIZE;
+
+        if (verbose) {
+            printf("%s region %u: %"PRIu64"_%"PRIu64"_%"PRIu64" at offset %"PRIu64" (%s, %"PRIu64" nonces written)\n",
+                   pf->name, k, rr->addr, rr->startnonce, rr->nonces, rr->offset,
+                   (rr->state == RAW_DONE) ? "done" : "plotting", rr->written);
+        }
+        end = (end + RAW_ALIGN - 1) / RAW_ALIGN * RAW_ALIGN;
+        if (end > next)
+            next = end;
+    }
+
+    pf->baseoffset = next;
+    *space = (size > next) ? size - next : 0;
+    return 0;
+}
+
+// Find the region to resume, or append a new one at pf->baseoffset.
+// Returns -1 on errors.
+int
+rawassign(struct plotfile *pf, int resume) {
+    struct rawheader *rh = pf->rawheader;
+    uint32_t k;
+
+    for (k = 0; resume && k < rh->count; k++) {
+        struct rawregion *rr = &rh->region[k];
+
+        if (rr->state == RAW_PLOTTING && rr->addr == pf->addr && rr->startnonce == pf->startnonce && rr->nonces == pf->nonces) {
+            pf->rawregion  = rr;
+            pf->baseoffset = rr->offset;
+            pf->run = pf->written = rr->written;
+            printf("Resuming region %u of %s at nonce %" PRIu64 " with staggersize %d...\n", k, pf->name, pf->startnonce + rr->written, pf->staggersize);
+            return 0;
+        }
+    }
+
+    if (rh->count == RAW_MAX_REGIONS) {
+        printf("The region table of %s is full.\n", pf->name);
+        return -1;
+    }
+    pf->rawregion = &rh->region[rh->count++];
+    pf->rawregion->addr       = pf->addr;
+    pf->rawregion->startnonce = pf->startnonce;
+    pf->rawregion->nonces     = pf->nonces;
+    pf->rawregion->offset     = pf->baseoffset;
+    pf->rawregion->written    = 0;
+    pf->rawregion->state      = RAW_PLOTTING;
+    if (rawwriteheader(pf) < 0)
+        return -1;
+    printf("Plotting into region %u of %s at offset %" PRIu64 "\n", rh->count - 1, pf->name, pf->baseoffset);
+    return 0;
+}
+
+/* }}} */
+/* {{{ writestatus */
+
+// Records a round that has been written as durable. Returns -1 if the
+// region table, checksums or journal could not be updated.
+int
+writestatus(struct plotfile *pf, struct round *r) {
+    // Data must be on disk before the table or journal says so
+    uint64_t t = phase_start();
+    int synced = fdatasync(pf->ofd);
+    phase_end(PHASE_SYNC, t);
+    // The /dev/null of --sink cannot be synced
+    if (synced < 0 && sinkmode == SINK_FILE) {
+        perror("fdatasync");
+        printf("\n\nError while syncing %s: %d\n\n", pf->name, errno);
+        return -1;
+    }
+
+    if (pf->rawdevice) {
+        pf->rawregion->written = r->run + r->len;
+        if (r->run + r->len == pf->nonces)
+            pf->rawregion->state = RAW_DONE;
+        return rawwriteheader(pf);
+    }
+    if (checkappend(pf, r->run, r->len) < 0)
+        return -1;
+    return journalappend(pf, JOURNAL_ROUND, r->run, r->len, NUM_SCOOPS);
+}
+
+/* }}} */
+
+/* {{{ claimround        pick work for the hashing pool */
+
+// Must be called with poolmutex held. Prefers finishing the oldest round
+// that still has unclaimed nonces; otherwise opens a new round on the
+// plot file with the smallest backlog (rounds hashing or waiting to be
+// written), round-robin among equals.
+struct round *
+claimround(struct plotfile **pfp) {
+    struct round *best = NULL;
+    uint32_t f, k;
+
+    if (stopping)
+        return NULL;
+
+    for (f = 0; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[f];
+
+        for (k = 0; k < pf->numrounds && !pf->failed; k++) {
+            struct round *r = &pf->rounds[k];
+
+            if (r->state == ROUND_HASHING && (r->next < r->len || r->numlost > 0) && (best == NULL || r->seq < best->seq)) {
+                best = r;
+                *pfp = pf;
+            }
+        }
+    }
+    if (best != NULL)
+        return best;
+    // Paused: let the rounds being hashed finish, open no new ones
+    if (paused)
+        return NULL;
+
+    struct plotfile *bestpf = NULL;
+    uint32_t bestbacklog = 0;
+
+    for (f = 0; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[(schedcursor + f) % numfiles];
+        struct round *freeround = NULL;
+        uint32_t backlog = 0;
+
+        if (pf->run >= pf->nonces || pf->failed)
+            continue;
+
+        for (k = 0; k < pf->numrounds; k++) {
+            if (pf->rounds[k].state == ROUND_FREE)
+                freeround = &pf->rounds[k];
+            else
+                backlog++;
+        }
+        if (freeround != NULL && (bestpf == NULL || backlog < bestbacklog)) {
+            bestpf      = pf;
+            best        = freeround;
+            bestbacklog = backlog;
+        }
+    }
+    if (best == NULL)
+        return NULL;
+
+    schedcursor = (bestpf - plotfiles + 1) % numfiles;
+
+    best->run       = bestpf->run;
+    best->len       = (bestpf->nonces - bestpf->run < bestpf->staggersize) ? bestpf->nonces - bestpf->run : bestpf->staggersize;
+    best->next      = 0;
+    best->done      = 0;
+    best->numlost   = 0;
+    best->inflight  = 0;
+    best->seq       = roundseq++;
+    best->starttime = getMS();
+    best->state     = ROUND_HASHING;
+    memset(&best->hashperf, 0, sizeof best->hashperf);
+    memset(&best->writeperf, 0, sizeof best->writeperf);
+    bestpf->run    += best->len;
+
+    *pfp = bestpf;
+    return best;
+}
+
+/* }}} */
+/* {{{ claimchunk        nonces out of a round */
+
+// Hands out up to max nonces of round r, lost chunks first. Must be called
+// with poolmutex held.
+uint32_t
+claimchunk(struct round *r, uint32_t max, uint32_t *pos) {
+    uint32_t count;
+
+    if (r->numlost > 0) {
+        struct chunk *c = &r->lost[r->numlost - 1];
+
+        count = (c->count < max) ? c->count : max;
+        *pos  = c->pos;
+        c->pos   += count;
+        c->count -= count;
+        if (c->count == 0)
+            r->numlost--;
+        r->inflight += count;
+        return count;
+    }
+
+    count = (r->len - r->next < max) ? r->len - r->next : max;
+    *pos  = r->next;
+    r->next     += count;
+    r->inflight += count;
+    return count;
+}
+
+// Hands round r to the writer once it is complete. When stopping, a round
+// that was cut short is complete as soon as nothing is in flight anymore.
+void
+roundcheck(struct round *r) {
+    if (r->state != ROUND_HASHING || (stopping ? r->inflight > 0 : r->done < r->len))
+        return;
+    totalcreatetime += ((double)getMS() - (double)r->starttime) / 1000000.0;
+    r->state = (r->len > 0) ? ROUND_FULL : ROUND_FREE;
+    pthread_cond_broadcast(&poolcond);
+}
+
+// Cuts a round short when stopping. With O_DIRECT, scoop blocks have to
+// stay 4096 byte aligned.
+void
+cutround(struct round *r, uint32_t len) {
+    if (use_direct_io)
+        len -= len % 64;
+    if (len < r->len)
+        r->len = len;
+}
+
+// Gives back a chunk that will not be hashed by whoever claimed it
+void
+returnchunk(struct round *r, uint32_t pos, uint32_t count) {
+    if (stopping) {
+        // Nobody will hash it anymore: the round ends in front of it
+        r->inflight -= count;
+        cutround(r, pos);
+        roundcheck(r);
+        return;
+    }
+    if (r->numlost == r->maxlost) {
+        r->maxlost = r->maxlost ? r->maxlost * 2 : 16;
+        r->lost    = realloc(r->lost, r->maxlost * sizeof *r->lost);
+        if (r->lost == NULL) {
+            printf("Error allocating memory.\n");
+            exit(-1);
+        }
+    }
+    r->lost[r->numlost].pos   = pos;
+    r->lost[r->numlost].count = count;
+    r->numlost++;
+    r->inflight -= count;
+    roundcheck(r);
+    pthread_cond_broadcast(&poolcond);
+}
+
+// Marks count nonces of round r as hashed
+void
+chunkdone(struct round *r, uint32_t count) {
+    r->done     += count;
+    r->inflight -= count;
+    roundcheck(r);
+    // The writer of a failed plot file waits for its rounds to go idle
+    if (r->inflight == 0)
+        pthread_cond_broadcast(&poolcond);
+}
+
+// True once every nonce of every plot file has been hashed, or once
+// nothing is in flight anymore when stopping. Failed plot files are done.
+int
+hashingdone(void) {
+    uint32_t f, k;
+
+    for (f = 0; f < numfiles; f++) {
+        if (plotfiles[f].failed)
+            continue;
+        if (plotfiles[f].run < plotfiles[f].nonces && !stopping)
+            return 0;
+        for (k = 0; k < plotfiles[f].numrounds; k++) {
+            if (plotfiles[f].rounds[k].state == ROUND_HASHING)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// True if no hashing thread fills a round of pf anymore. Must be called
+// with poolmutex held.
+int
+roundsidle(struct plotfile *pf) {
+    uint32_t k;
+
+    for (k = 0; k < pf->numrounds; k++) {
+        if (pf->rounds[k].state == ROUND_HASHING && pf->rounds[k].inflight > 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Stops handing out work. Every plot file keeps the nonces of its oldest
+// hashing round that are contiguously hashed or in flight; later rounds are
+// dropped. Must be called with poolmutex held.
+void
+stopplotting(void) {
+    uint32_t f, k;
+
+    stopping = 1;
+
+    for (f = 0; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[f];
+        struct round *first = NULL;
+
+        for (k = 0; k < pf->numrounds; k++) {
+            struct round *r = &pf->rounds[k];
+
+            if (r->state == ROUND_HASHING && (first == NULL || r->run < first->run))
+                first = r;
+        }
+        for (k = 0; k < pf->numrounds; k++) {
+            struct round *r = &pf->rounds[k];
+            uint32_t c;
+
+            if (r->state != ROUND_HASHING)
+                continue;
+            if (r != first) {
+                r->len = 0;
+            }
+            else {
+                cutround(r, r->next);
+                for (c = 0; c < r->numlost; c++)
+                    cutround(r, r->lost[c].pos);
+            }
+            r->numlost = 0;
+            roundcheck(r);
+        }
+    }
+    pthread_cond_broadcast(&poolcond);
+}
+
+/* }}} */
+/* {{{ hashchunk         run the selected core */
+
+// Hashes count consecutive nonces starting at first into cache positions
+// pos.., noncearguments at a time and the leftovers with the default core.
+void
+hashchunk(char *cache, uint32_t staggersize, uint64_t addr, uint64_t first, uint64_t pos, uint32_t count) {
+    engraver_hash(&engine, cache, staggersize, pos, addr, first, count);
+}
+
+// Makes core the one hashchunk and hashlanes use
+void
+selectcore(uint32_t core) {
+    engraver_free(&engine);
+    if (engraver_init(&engine, core) < 0) {
+        printf("Error selecting the %s core: %s\n", (core == 2) ? "AVX2" : (core == 1) ? "SSE4" : "ORIG", strerror(errno));
+        exit(-1);
+    }
+    selecttype     = engine.core;
+    noncearguments = engine.lanes;
+}
+
+// Nonces of one SIMD batch that belong to one round
+struct laneseg {
+    struct plotfile *pf;
+    struct round *r;
+    uint32_t pos;
+    uint32_t count;
+};
+
+// Hashes a batch put together from several rounds, possibly of different
+// plot jobs: every lane gets the account and nonce of its own job, unused
+// lanes repeat the first one. The lanes are hashed into a buffer of their
+// own and then copied into the stagger buffers of their rounds.
+void
+hashlanes(char *lanes, struct laneseg *seg, uint32_t numsegs) {
+    uint64_t a[8] = { 0 }, n[8] = { 0 };
+    uint32_t k, c, l = 0;
+
+    for (k = 0; k < numsegs; k++) {
+        for (c = 0; c < seg[k].count; c++, l++) {
+            a[l] = seg[k].pf->addr;
+            n[l] = seg[k].pf->startnonce + seg[k].r->run + seg[k].pos + c;
+        }
+    }
+    engraver_batch(&engine, lanes, a, n, l);
+
+    uint64_t t = phase_start();
+
+    for (k = 0, l = 0; k < numsegs; k++) {
+        for (c = 0; c < seg[k].count; c++, l++)
+            engraver_scatterlane(seg[k].r->cache, seg[k].pf->staggersize, seg[k].pos + c, lanes, noncearguments, l);
+    }
+    phase_end(PHASE_SCATTER, t);
+}
+
+/* }}} */
+/* {{{ work_i            hashing pool thread */
+
+// Every thread claims noncearguments nonces at a time. When a round runs
+// out before the batch is full (the end of a plot job, or of a stagger
+// buffer that is no multiple of the batch), the rest of the lanes are
+// filled from the next round, which may belong to another plot job. With
+// phase timing, x_void_ptr is when the thread was created and gets the
+// time it ends.
+void *
+work_i(void *x_void_ptr) {
+    uint64_t *spawned = x_void_ptr;
+    struct plotfile *pf = NULL;
+    struct round *r;
+    struct laneseg seg[8];
+    uint32_t numsegs, total, k;
+    uint64_t ms;
+    char *lanes = NULL;
+    struct perfthread pt;
+    struct perfcount before, after;
+    uint32_t mask = perfcounters ? perf_open(&pt) : 0;
+
+    if (phasing || tracefile) {
+        phase_register("hash");
+        phase_end(PHASE_THREADS, *spawned);
+    }
+
+    if (selecttype > 0 && (lanes = alloc(NONCE_SIZE, noncearguments)) == NULL) {
+        printf("Error allocating memory.\n");
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&poolmutex);
+    perfmask |= mask;
+    hashactive++;
+    for (;;) {
+        // Threads above the active thread count park until it is raised
+        while (activethreads > 0 && hashactive > activethreads && !hashingdone()) {
+            hashactive--;
+            pthread_cond_wait(&poolcond, &poolmutex);
+            hashactive++;
+        }
+
+        // The default core has no lanes to fill: one chunk is a batch
+        for (numsegs = 0, total = 0; total < noncearguments && (numsegs == 0 || selecttype > 0)
+             && (r = claimround(&pf)) != NULL; numsegs++) {
+            seg[numsegs].pf    = pf;
+            seg[numsegs].r     = r;
+            seg[numsegs].count = claimchunk(r, noncearguments - total, &seg[numsegs].pos);
+            total += seg[numsegs].count;
+        }
+        if (numsegs == 0) {
+            // Nothing to hash right now: either all done or all buffers are
+            // busy. A daemon's threads wait for its next batch.
+            if (hashingdone() && !daemonrunning)
+                break;
+            ms = getMS();
+            uint64_t t = phase_start();
+            pthread_cond_wait(&poolcond, &poolmutex);
+            phase_end(PHASE_WAIT, t);
+            hashwait += getMS() - ms;
+            continue;
+        }
+        pthread_mutex_unlock(&poolmutex);
+
+        ms = getMS();
+        uint64_t t = phase_start();
+        if (mask)
+            perf_read(&pt, &before);
+        pf = seg[0].pf;
+        r  = seg[0].r;
+        if (numsegs == 1 && (total == noncearguments || selecttype == 0))
+            hashchunk(r->cache, pf->staggersize, pf->addr, pf->startnonce + r->run + seg[0].pos, seg[0].pos, seg[0].count);
+        else
+            hashlanes(lanes, seg, numsegs);
+        phase_event("hash", r->seq, t, phase_start());
+
+        // If verbose mode is set print out actual nonce plot state
+        if (verbose == 1 && seg[0].pos % (threads * noncearguments) == 0) {
+            printf("Nonces %lu from %u nonces %2.2f %% done...\r\n",
+                   r->run + seg[0].pos, pf->nonces,
+                   ((float) (r->run + seg[0].pos) / (float) pf->nonces) * 100);
+            fflush(stdout);
+        }
+
+        if (mask)
+            perf_read(&pt, &after);
+
+        pthread_mutex_lock(&poolmutex);
+        hashbusy += getMS() - ms;
+        if (mask) {
+            perf_delta(&seg[0].r->hashperf, &before, &after);
+            perf_delta(&perfhash, &before, &after);
+        }
+        for (k = 0; k < numsegs; k++)
+            chunkdone(seg[k].r, seg[k].count);
+    }
+    pthread_mutex_unlock(&poolmutex);
+
+    free(lanes);
+    if (mask)
+        perf_close(&pt);
+    if (phaselog != NULL)
+        *spawned = phase_clock();
+    return NULL;
+}
+
+/* }}} */
+/* {{{ stop_i            SIGINT/SIGTERM handler thread */
+
+// The first signal lets the plot stop at a point it can be resumed from,
+// the second one ends it right away.
+void *
+stop_i(void *x_void_ptr) {
+    sigset_t *set = x_void_ptr;
+    int sig;
+
+    if (sigwait(set, &sig) != 0)
+        return NULL;
+    printf("\n\nStopping: writing what has been hashed so far. Send the signal again to abort right away.\n");
+    fflush(stdout);
+
+    pthread_mutex_lock(&poolmutex);
+    stopplotting();
+    pthread_mutex_unlock(&poolmutex);
+
+    if (sigwait(set, &sig) == 0) {
+        printf("\n\nAborted.\n");
+        fflush(stdout);
+        _exit(1);
+    }
+    return NULL;
+}
+
+/* }}} */
+/* {{{ writeworker_i     per plot file writer thread */
+
+void *
+writeworker_i(void *x_void_ptr) {
+    struct plotfile *pf = x_void_ptr;
+    struct round *r;
+    uint32_t k;
+    struct perfthread pt;
+    struct perfcount before, after;
+    uint32_t mask = perfcounters ? perf_open(&pt) : 0;
+
+    if (phasing || tracefile) {
+        char name[PATH_MAX + 8];
+
+        snprintf(name, sizeof name, "write %s", pf->outputdir);
+        phase_register(name);
+    }
+
+    pthread_mutex_lock(&poolmutex);
+    while (pf->written < pf->nonces) {
+        int pending = 0, err;
+
+        // Rounds have to reach the disk in file order for resume to work
+        for (r = NULL, k = 0; k < pf->numrounds; k++) {
+            if (pf->rounds[k].state == ROUND_FULL && pf->rounds[k].run == pf->written)
+                r = &pf->rounds[k];
+            if (pf->rounds[k].state == ROUND_HASHING || pf->rounds[k].state == ROUND_FULL)
+                pending = 1;
+        }
+        if (r == NULL) {
+            if (stopping && !pending)
+                break;
+            uint64_t t = phase_start();
+            pthread_cond_wait(&poolcond, &poolmutex);
+            phase_end(PHASE_IDLE, t);
+            continue;
+        }
+        r->state = ROUND_WRITING;
+        pthread_mutex_unlock(&poolmutex);
+
+        uint64_t ms = getMS();
+        uint64_t t  = phase_start();
+        if (mask)
+            perf_read(&pt, &before);
+
+        if (pf->ofd < 0)
+            err = streamcache(pf, r);
+        else
+            err = (writecache(pf, r) < 0 || writestatus(pf, r) < 0) ? -1 : 0;
+        phase_event("write", r->seq, t, phase_start());
+        if (mask)
+            perf_read(&pt, &after);
+
+        pthread_mutex_lock(&poolmutex);
+        if (err < 0) {
+            // The file gets no more rounds; its buffers are only let go
+            // once no hashing thread fills them anymore
+            pf->failed = 1;
+            r->state   = ROUND_FREE;
+            while (!roundsidle(pf))
+                pthread_cond_wait(&poolcond, &poolmutex);
+            pthread_cond_broadcast(&poolcond);
+            break;
+        }
+        perfmask |= mask;
+        if (mask) {
+            perf_delta(&r->writeperf, &before, &after);
+            perf_delta(&perfwrite, &before, &after);
+            perfround(r, getMS());
+        }
+        pf->lastwritten = getMS();
+        pf->writebusy  += pf->lastwritten - ms;
+        if (pf->written == 0) {
+            pf->firstwritten = pf->lastwritten;
+            pf->firstlen     = r->len;
+        }
+        pf->written        += r->len;
+        pf->sessionwritten += r->len;
+        pf->byteswritten   += (uint64_t)r->len * NONCE_SIZE;
+        pf->reqs           += pf->roundreqs;
+        pf->reqtime        += pf->roundreqtime;
+        r->state = ROUND_FREE;
+        if (progressmode == PROGRESS_JSON)
+            progressjson(pf, r, pf->lastwritten, pf->lastwritten - ms);
+        if (metricsfile != NULL)
+            progressmetrics(0);
+        pthread_cond_broadcast(&poolcond);
+    }
+    pthread_mutex_unlock(&poolmutex);
+
+    if (mask)
+        perf_close(&pt);
+    return NULL;
+}
+
+/* }}} */
+
+/* {{{ initstackattr     thread stack size  */
+
+// Check the size of the stack and increase if necessary
+int
+initstackattr(pthread_attr_t *stackSizeAttribute) {
+    int err = 0;
+    size_t            stackSize = 0;
+    
+    /*  Initialize the attribute */
+    err = pthread_attr_init(stackSizeAttribute);
+    if (err) {
+        printf("Error retreiving the pthread stack size attribute: %d\n", err);
+        return 1;
+    }
+    
+    /* Get the default value */
+    err = pthread_attr_getstacksize(stackSizeAttribute, &stackSize);
+    if (err) {
+        printf("Error retreving the pthread stack size: %d\n", err);
+        return 1;
+    }
+    
+    if (verbose) {
+        printf("Current stack size is: %ld\n", stackSize);
+    }
+
+    /* If the default size does not fit our needs, set the attribute with our required value */
+    if (stackSize < REQUIRED_STACK_SIZE) {
+        if (verbose) {
+            printf("Initializing pthreads with increased stack size: %d\n", REQUIRED_STACK_SIZE);
+        }
+        err = pthread_attr_setstacksize (stackSizeAttribute, REQUIRED_STACK_SIZE);
+        if (err) {
+            printf("Error setting pthreads stack size attribute: %d\n", err);
+        }
+    }
+
+    return 0;
+}
+
+/* }}} */
+
+/* {{{ network         remote hashing workers */
+
+// Coordinator (--serve) and hashing workers (--worker) talk in netmsg
+// headers. A worker says hello with the number of ranges it wants to have
+// outstanding, gets ranges of nonces and answers each with a data message
+// followed by the hashed range in scoop order (a stagger of <count>). Ranges
+// of workers that disconnect or stay silent for NET_TIMEOUT are re-issued.
+#define NET_HELLO           1
+#define NET_RANGE           2
+#define NET_DATA            3
+#define NET_DONE            4
+#define NET_CREDIT          2
+#define NET_RANGE_NONCES    64
+#define NET_TIMEOUT         600
+
+struct netrange {
+    struct plotfile *pf;
+    struct round *r;
+    uint32_t pos;
+    uint32_t count;
+    uint64_t id;
+};
+
+// Serves one connected worker: acts as a member of the hashing pool that
+// claims bigger chunks and lets the worker hash them. It counts against the
+// active thread count like a local hashing thread.
+void *
+networker_i(void *x_void_ptr) {
+    int fd = *(int *)x_void_ptr;
+    struct netrange out[NET_CREDIT];
+    struct timeval tv = { NET_TIMEOUT, 0 };
+    struct netmsg msg;
+    uint32_t numout = 0, credit, first, k, s;
+    char *buf;
+
+    free(x_void_ptr);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    pthread_mutex_lock(&poolmutex);
+    hashactive++;
+    pthread_mutex_unlock(&poolmutex);
+
+    if ((buf = malloc((uint64_t)NET_RANGE_NONCES * NONCE_SIZE)) == NULL) {
+        printf("\nError allocating memory for hashing worker\n");
+        goto lost;
+    }
+    if (stream_readfull(fd, &msg, sizeof msg) < 0 || msg.type != NET_HELLO) {
+        printf("\nIgnoring connection that is not a hashing worker\n");
+        goto lost;
+    }
+    credit = (msg.count < 1) ? 1 : (msg.count > NET_CREDIT) ? NET_CREDIT : msg.count;
+
+    for (;;) {
+        pthread_mutex_lock(&poolmutex);
+        // Above the active thread count, no new ranges go out, and a worker
+        // with none outstanding parks until the count is raised
+        while (numout == 0 && activethreads > 0 && hashactive > activethreads && !hashingdone()) {
+            hashactive--;
+            pthread_cond_wait(&poolcond, &poolmutex);
+            hashactive++;
+        }
+        for (first = numout; numout < credit && (activethreads == 0 || hashactive <= activethreads); numout++) {
+            struct round *r = claimround(&out[numout].pf);
+
+            if (r == NULL)
+                break;
+            out[numout].r     = r;
+            out[numout].count = claimchunk(r, NET_RANGE_NONCES, &out[numout].pos);
+            out[numout].id    = netrangeid++;
+        }
+        if (numout == 0) {
+            if (hashingdone()) {
+                pthread_mutex_unlock(&poolmutex);
+                msg.type = NET_DONE;
+                stream_writefull(fd, (char *)&msg, sizeof msg);
+                break;
+            }
+            pthread_cond_wait(&poolcond, &poolmutex);
+            pthread_mutex_unlock(&poolmutex);
+            continue;
+        }
+        pthread_mutex_unlock(&poolmutex);
+
+        for (k = first; k < numout; k++) {
+            msg.type  = NET_RANGE;
+            msg.count = out[k].count;
+            msg.addr  = out[k].pf->addr;
+            msg.nonce = out[k].pf->startnonce + out[k].r->run + out[k].pos;
+            msg.id    = out[k].id;
+            if (stream_writefull(fd, (char *)&msg, sizeof msg) < 0)
+                goto lost;
+        }
+
+        if (stream_readfull(fd, &msg, sizeof msg) < 0 || msg.type != NET_DATA)
+            goto lost;
+        for (k = 0; k < numout && out[k].id != msg.id; k++)
+            ;
+        if (k == numout || msg.count != out[k].count) {
+            printf("\nWorker sent a range that was not asked for\n");
+            goto lost;
+        }
+        if (stream_readfull(fd, buf, (uint64_t)msg.count * NONCE_SIZE) < 0)
+            goto lost;
+
+        // Scatter the scoops into the stagger buffer
+        struct netrange *nr = &out[k];
+        uint64_t stride     = (uint64_t)nr->pf->staggersize * SCOOP_SIZE;
+
+        for (s = 0; s < NUM_SCOOPS; s++) {
+            memcpy(&nr->r->cache[s * stride + (uint64_t)nr->pos * SCOOP_SIZE],
+                   &buf[(uint64_t)s * nr->count * SCOOP_SIZE], (uint64_t)nr->count * SCOOP_SIZE);
+        }
+
+        pthread_mutex_lock(&poolmutex);
+        chunkdone(nr->r, nr->count);
+        pthread_mutex_unlock(&poolmutex);
+
+        out[k] = out[--numout];
+    }
+
+    numout = 0;
+
+lost:
+    if (numout > 0) {
+        printf("\nLost hashing worker, re-issuing %u range(s)\n", numout);
+    }
+    pthread_mutex_lock(&poolmutex);
+    for (k = 0; k < numout; k++)
+        returnchunk(out[k].r, out[k].pos, out[k].count);
+    hashactive--;
+    networkers--;
+    pthread_cond_broadcast(&poolcond);
+    pthread_mutex_unlock(&poolmutex);
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+void *
+netaccept_i(void *x_void_ptr) {
+    int lfd = *(int *)x_void_ptr;
+    pthread_t handler;
+
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        int *arg = malloc(sizeof fd);
+        *arg = fd;
+        pthread_mutex_lock(&poolmutex);
+        networkers++;
+        pthread_mutex_unlock(&poolmutex);
+        if (pthread_create(&handler, NULL, networker_i, arg)) {
+            printf("Error creating thread for hashing worker\n");
+            pthread_mutex_lock(&poolmutex);
+            networkers--;
+            pthread_mutex_unlock(&poolmutex);
+            close(fd);
+            free(arg);
+            continue;
+        }
+        pthread_detach(handler);
+        if (verbose) {
+            printf("\nHashing worker connected\n");
+        }
+    }
+
+    return NULL;
+}
+
+void *
+workerhash_i(void *x_void_ptr) {
+    struct workerjob *job = x_void_ptr;
+    uint32_t n;
+
+    for (n = job->index * noncearguments; n < job->msg->count; n += threads * noncearguments) {
+        uint32_t count = (job->msg->count - n < noncearguments) ? job->msg->count - n : noncearguments;
+
+        hashchunk(job->cache, job->msg->count, job->msg->addr, job->msg->nonce + n, n, count);
+    }
+
+    return NULL;
+}
+
+struct workersend {
+    int fd;
+    int failed;
+    struct netmsg msg;
+    char *cache;
+};
+
+void *
+workersend_i(void *x_void_ptr) {
+    struct workersend *ws = x_void_ptr;
+
+    ws->msg.type = NET_DATA;
+    ws->failed   = stream_writefull(ws->fd, (char *)&ws->msg, sizeof ws->msg) < 0 ||
+                   stream_writefull(ws->fd, ws->cache, (uint64_t)ws->msg.count * NONCE_SIZE) < 0;
+
+    return NULL;
+}
+
+int
+runworker(char *target) {
+    pthread_attr_t stackSizeAttribute;
+    pthread_t hasher[threads], sender;
+    struct workerjob job[threads];
+    struct workersend ws[2];
+    struct netmsg msg;
+    int fd, sending = 0, b = 0, reconnect = 0;
+    uint64_t done = 0, ms;
+    uint32_t i;
+
+    if (initstackattr(&stackSizeAttribute))
+        return 1;
+
+    for (i = 0; i < 2; i++) {
+        if ((ws[i].cache = alloc(NONCE_SIZE, NET_RANGE_NONCES)) == NULL) {
+            printf("Error allocating memory.\n");
+            return 1;
+        }
+    }
+
+    for (;;) {
+        if ((fd = stream_connect(target)) < 0) {
+            printf("Unable to connect to coordinator %s\n", target);
+            return 1;
+        }
+        printf("%s coordinator %s\n", reconnect ? "Reconnected to" : "Connected to", target);
+
+        memset(&msg, 0, sizeof msg);
+        msg.type  = NET_HELLO;
+        msg.count = NET_CREDIT;
+        if (stream_writefull(fd, (char *)&msg, sizeof msg) < 0)
+            goto lost;
+
+        for (;;) {
+            if (stream_readfull(fd, &msg, sizeof msg) < 0)
+                goto lost;
+            if (msg.type == NET_DONE) {
+                if (sending)
+                    pthread_join(sender, NULL);
+                close(fd);
+                printf("\nCoordinator is done. %" PRIu64 " nonces hashed.\n", done);
+                return 0;
+            }
+            if (msg.type != NET_RANGE || msg.count == 0 || msg.count > NET_RANGE_NONCES) {
+                printf("\nUnexpected message from coordinator\n");
+                goto lost;
+            }
+
+            ms = getMS();
+            for (i = 0; i < threads; i++) {
+                job[i].cache = ws[b].cache;
+                job[i].msg   = &msg;
+                job[i].index = i;
+                if (pthread_create(&hasher[i], &stackSizeAttribute, workerhash_i, &job[i])) {
+                    printf("Error creating thread. Out of memory? Try less threads\n");
+                    exit(-1);
+                }
+            }
+            for (i = 0; i < threads; i++) {
+                pthread_join(hasher[i], NULL);
+            }
+            ms = getMS() - ms;
+
+            // Send while the next range is hashed
+            if (sending) {
+                pthread_join(sender, NULL);
+                if (ws[1 - b].failed)
+                    goto lost;
+            }
+            ws[b].fd  = fd;
+            ws[b].msg = msg;
+            if (pthread_create(&sender, NULL, workersend_i, &ws[b])) {
+                printf("Error creating thread.\n");
+                exit(-1);
+            }
+            sending = 1;
+            b       = 1 - b;
+            done   += msg.count;
+
+            printf("\r\33[2KHashed nonces %" PRIu64 " to %" PRIu64 ", %i nonces per minute, %" PRIu64 " nonces in total",
+                   msg.nonce, msg.nonce + msg.count, (int)(msg.count * 60000000.0 / ms), done);
+            fflush(stdout);
+        }
+
+lost:
+        // The coordinator re-issues whatever we did not deliver
+        if (sending)
+            pthread_join(sender, NULL);
+        sending = 0;
+        close(fd);
+        reconnect = 1;
+        printf("\nLost connection to coordinator %s\n", target);
+    }
+}
+
+/* }}} */
+
+/* {{{ adddirs           split -d/-B argument */
+
+void
+adddirs(char *parse, int rawdevice) {
+    char *dir, *save = NULL;
+
+    for (dir = strtok_r(parse, ",", &save); dir != NULL; dir = strtok_r(NULL, ",", &save)) {
+        int ds = strlen(dir);
+
+        plotfiles = realloc(plotfiles, (numfiles + 1) * sizeof *plotfiles);
+        if (plotfiles == NULL) {
+            printf("Error allocating memory.\n");
+            exit(-1);
+        }
+        memset(&plotfiles[numfiles], 0, sizeof *plotfiles);
+        plotfiles[numfiles].ofd = -1;
+        plotfiles[numfiles].jfd = -1;
+        plotfiles[numfiles].cfd = -1;
+
+        char *outputdir = (char*) malloc(ds + 2);
+        memcpy(outputdir, dir, ds);
+        plotfiles[numfiles].rawdevice = rawdevice;
+        // Add final slash?
+        if (rawdevice) {
+            outputdir[ds] = 0;
+        }
+        else if (outputdir[ds - 1] != '/') {
+            outputdir[ds] = '/';
+            outputdir[ds + 1] = 0;
+        }
+        else {
+            outputdir[ds] = 0;
+        }
+        plotfiles[numfiles++].outputdir = outputdir;
+    }
+}
+
+/* }}} */
+/* {{{ addaddrs          split -k argument */
+
+// One account for all plot files from first, or one per plot file (-d/-B
+// order)
+void
+addaddrs(char *parse, uint32_t first) {
+    char *key, *save = NULL;
+    uint32_t f = first;
+
+    for (key = strtok_r(parse, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save)) {
+        if (f == numfiles) {
+            printf("More accounts than plot files given.\n");
+            exit(1);
+        }
+        plotfiles[f++].addr = strtoull(key, 0, 10);
+    }
+    if (f == first + 1) {
+        for (; f < numfiles; f++)
+            plotfiles[f].addr = plotfiles[first].addr;
+    }
+    if (f != numfiles) {
+        printf("Give one account for all plot files or one per plot file.\n");
+        exit(1);
+    }
+}
+
+/* }}} */
+/* {{{ calcnonces        nonces from disk space */
+
+// Returns 0 if there is no room for a plot
+uint32_t
+calcnonces(char *outputdir) {
+    uint64_t fs = freespace(outputdir);
+    uint64_t leave = leavespace;
+    uint32_t n;
+
+    if (plotfilesize == 0 && (leave == 0 && userleavespace != 1)) {
+        // Neither plot file size nor remaining disk space is specified.
+        // Leave maximum 1GB if available, or 50% of the remaining diskspace otherwise.
+        leave = (fs > 1024*1024*1024) ? 1024 * 1024 * 1024 : fs * 0.5;
+    }
+    uint64_t usespace = (plotfilesize > 0) ? plotfilesize : fs - leave;
+    if (plotfilesize > 0  && leave > 0 && (plotfilesize + leave > fs)) {
+        printf("Plot file size is set to %0.2f GB and we should leave %0.2f GB of free space, but the disk only has %0.2f GB available.\n",
+                (double)plotfilesize / 1024 / 1024 / 1024, (double)leave / 1024 / 1024 / 1024, (double)fs / 1024 / 1024 / 1024);
+        return 0;
+    }
+    if ((fs < usespace) || ((usespace / NONCE_SIZE) < 1)) {
+        printf("Not enough free space on device. Disk has %0.2f GB available, and we're configured to use %0.2f GB, leaving %0.2f GB.\n",
+                (double)fs / 1024 / 1024 / 1024, (double)usespace / 1024 / 1024 / 1024, (double)leave / 1024 / 1024 / 1024);
+        return 0;
+    }
+    n = (uint64_t)(usespace / NONCE_SIZE);
+    if (noncearguments > 1 && n % (threads * noncearguments)) {
+        n -= n % (threads * noncearguments);
+    }
+    printf("Number of nonces not specified. Attempting to create %d nonces (%0.2f GB) in %s, leaving %0.2f GB remaining free space.\n",
+            n, ((double)n * NONCE_SIZE / 1024 / 1024 / 1024), outputdir, ((double)(fs - usespace) / 1024 / 1024 / 1024));
+
+    return n;
+}
+
+/* }}} */
+/* {{{ calcstagger       stagger from memory */
+
+// Returns 0 if no stagger size fits
+uint32_t
+calcstagger(uint32_t *nonces, uint64_t usememory) {
+    uint32_t stagger = 0;
+    int i;
+
+    if (usememory < NONCE_SIZE) {
+        printf("Unable to plot any nonces (%d bytes) with only %" PRIu64 " bytes of memory available.\n", NONCE_SIZE, usememory);
+        return 0;
+    }
+
+    uint64_t memstag = usememory / NONCE_SIZE;
+    int staggerdiff = (memstag > 1000) ? 1000 : 1;
+    if (*nonces < memstag) {
+        // Small stack: all at once
+        if (noncearguments > 1 && *nonces % (threads * noncearguments)) {
+            printf("All nonces would fit in memory, but number of nonces is not divisible by threads * %d. Adjusting nonces from %d to %d.\n",
+                    noncearguments, *nonces, (*nonces - (*nonces % (threads * noncearguments))));
+            *nonces -= (*nonces % (threads * noncearguments));
+        }
+        else {
+            printf("All nonces will fit in memory. Setting stagger size to %d\n", *nonces);
+        }
+        stagger = *nonces;
+    }
+    else {
+        // Determine stagger that (almost) fits nonces
+        for (i = memstag; i >= staggerdiff; i--) {
+            if (i - (i % (threads * noncearguments)) <=  0) {
+                printf("Unable to find suitable stagger size for selected hashing core based on %d nonces and %d thread(s). Could indicate lack of memory (%0.2f GB).\n",
+                        *nonces, threads, (double)usememory / 1024 / 1024 / 1024);
+                return 0;
+            }
+            if (*nonces % (i - (i % (threads * noncearguments))) <= staggerdiff) {
+                if (selecttype > 0) {
+                    // Optimize stagger sizes for nonces processed per hashing core
+                    i = i - (i % (threads * noncearguments));
+                }
+                stagger = i;
+                printf("Stagger size was set to %u, based on available memory and selected hashing algorithm.\n", stagger);
+                if ((*nonces % stagger) > 0) {
+                    printf("Adjusting nonces from %u to %u to comply with stagger size.\n",
+                            *nonces, (*nonces - (*nonces % i)));
+                    *nonces -= (*nonces % i);
+                }
+                i = 0;
+            }
+        }
+    }
+
+    return stagger;
+}
+
+/* }}} */
+
+/* {{{ optvalue          long options       */
+
+// Matches "--name=value" and "--name value" and returns the value, or NULL
+// if argv[*i] is a different option.
+char *
+optvalue(int argc, char **argv, int *i, const char *name) {
+    size_t len = strlen(name);
+
+    if (strncmp(argv[*i], name, len))
+        return NULL;
+    if (argv[*i][len] == '=')
+        return &argv[*i][len + 1];
+    if (argv[*i][len] == 0 && *i < argc - 1)
+        return argv[++*i];
+    return NULL;
+}
+
+/* }}} */
+
+/* {{{ roundalloc        stagger buffers, kept warm by a daemon */
+
+// A daemon keeps the stagger buffers of its last batch mapped and faulted
+// in, and hands them to the next batch when they are large enough
+struct warmbuffer {
+    char *data;
+    uint64_t size;
+    int used;
+};
+
+struct warmbuffer *warm = NULL;
+uint32_t numwarm        = 0;
+
+char *
+roundalloc(uint64_t size) {
+    struct warmbuffer *w = NULL;
+    char *data;
+    uint32_t k;
+
+    if (daemonspool == NULL && !hugepages)
+        return alloc(size, 1);
+
+    for (k = 0; k < numwarm; k++) {
+        if (!warm[k].used && warm[k].size >= size && (w == NULL || warm[k].size < w->size))
+            w = &warm[k];
+    }
+    if (w != NULL) {
+        w->used = 1;
+        return w->data;
+    }
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (hugepages)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+    // Fault the pages in now, not while hashing the first round
+    memset(data, 0, size);
+
+    if ((w = realloc(warm, (numwarm + 1) * sizeof *warm)) == NULL) {
+        munmap(data, size);
+        return NULL;
+    }
+    warm = w;
+    warm[numwarm].data = data;
+    warm[numwarm].size = size;
+    warm[numwarm].used = 1;
+    numwarm++;
+    return data;
+}
+
+// Unused buffers go away once a batch has taken what it needs; release
+// marks all of them unused for the next one
+void
+roundtrim(int release) {
+    uint32_t k, n = 0;
+
+    for (k = 0; k < numwarm; k++) {
+        if (release) {
+            warm[k].used = 0;
+            n++;
+        }
+        else if (warm[k].used) {
+            warm[n++] = warm[k];
+        }
+        else {
+            munmap(warm[k].data, warm[k].size);
+        }
+    }
+    numwarm = n;
+}
+
+/* }}} */
+/* {{{ setupplots        size, allocate and open plot files */
+
+// Plot files first.. get their nonces, stagger size and buffers, usememory
+// bytes of buffer each, and are created or resumed. Returns non-zero if a
+// plot cannot be set up.
+int
+setupplots(uint32_t first, uint64_t usememory, int resume, int rawinit) {
+    uint32_t f, k;
+
+    for (f = first; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[f];
+
+        if (pf->rawdevice) {
+            uint64_t space;
+
+            if (rawopen(pf, rawinit, &space) < 0)
+                return 1;
+
+            // Regions take whatever is left on the device. Scoop blocks
+            // have to stay 4096 byte aligned for O_DIRECT, so nonces and
+            // stagger size are multiples of 64.
+            pf->nonces = (nonces == 0) ? ((plotfilesize > 0 && plotfilesize < space) ? plotfilesize : space) / NONCE_SIZE : nonces;
+            pf->nonces -= pf->nonces % 64;
+            pf->staggersize = (staggersize == 0) ? calcstagger(&pf->nonces, usememory) : staggersize;
+            pf->staggersize -= pf->staggersize % 64;
+            if (pf->staggersize > 0)
+                pf->nonces -= pf->nonces % pf->staggersize;
+            if ((uint64_t)pf->nonces * NONCE_SIZE > space) {
+                printf("Not enough space on %s. %0.2f GB available for a new region.\n", pf->name, (double)space / 1024 / 1024 / 1024);
+                return 1;
+            }
+        }
+        else {
+            if (sinkmode == SINK_FILE)
+                mkdir(pf->outputdir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+
+            // No nonces specified. Calculate nonces based on disk space
+            pf->nonces = (nonces == 0) ? calcnonces(pf->outputdir) : nonces;
+            if (pf->nonces == 0)
+                return 1;
+
+            // Autodetect stagger size. A resumed plot keeps its size, whatever
+            // stagger size fits now: the last round may be shorter.
+            if (resume && nonces > 0 && !use_direct_io) {
+                uint32_t fitnonces = pf->nonces;
+
+                pf->staggersize = (staggersize == 0) ? calcstagger(&fitnonces, usememory) : staggersize;
+                if (pf->staggersize > pf->nonces)
+                    pf->staggersize = pf->nonces;
+            }
+            else {
+                pf->staggersize = (staggersize == 0) ? calcstagger(&pf->nonces, usememory) : staggersize;
+            }
+        }
+
+        if (pf->nonces == 0 || pf->staggersize == 0) {
+            printf("Ended up with %d nonces and a stagger size of %d. Unable to proceed.", pf->nonces, pf->staggersize);
+            return 1;
+        }
+
+        // Adjust according to stagger size
+        if (pf->nonces % pf->staggersize != 0 && !(resume && nonces > 0 && !use_direct_io && !pf->rawdevice)) {
+            pf->nonces -= pf->nonces % pf->staggersize;
+            pf->nonces += pf->staggersize;
+            printf("Adjusting total nonces to %u to match stagger size\n", pf->nonces);
+        }
+
+        // Plot files of one account get consecutive nonce ranges
+        pf->startnonce = startnonce;
+        for (k = first; k < f; k++) {
+            if (plotfiles[k].addr == pf->addr)
+                pf->startnonce = plotfiles[k].startnonce + plotfiles[k].nonces;
+        }
+
+        printf("Creating plots for %u nonces (%" PRIu64 " to %" PRIu64 ", %0.2f GB) with stagger size %u, using %0.2f MB memory and %u threads\n",
+               pf->nonces, pf->startnonce, (pf->startnonce + pf->nonces), ((double)pf->nonces * NONCE_SIZE / 1024 / 1024 / 1024), pf->staggersize, ((double)pf->staggersize / 4 * (1 + asyncmode)), threads);
+    }
+
+    for (f = first; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[f];
+
+        pf->numrounds = (asyncmode == 1) ? 2 : 1;
+        for (k = 0; k < pf->numrounds; k++) {
+            pf->rounds[k].cache = roundalloc((uint64_t)NONCE_SIZE * pf->staggersize);
+
+            if (pf->rounds[k].cache == NULL) {
+                printf("Error allocating memory. Try lower stagger size%s.\n", (asyncmode == 1) ? " or removing ASYNC mode" : "");
+                return 1;
+            }
+        }
+
+        if (pf->rawdevice) {
+            if (rawassign(pf, resume) < 0)
+                return 1;
+            continue;
+        }
+
+        if (streamtarget != NULL) {
+            struct streamheader sh = { STREAM_MAGIC, STREAM_VERSION, 0, pf->addr, pf->startnonce, pf->nonces };
+
+            if (streamfd < 0 && (streamfd = stream_connect(streamtarget)) < 0) {
+                printf("Unable to open stream %s\n", streamtarget);
+                return 1;
+            }
+            if (stream_writefull(streamfd, (char *)&sh, sizeof sh) < 0) {
+                perror("stream");
+                return 1;
+            }
+            // Fully buffered: no scratch file needed
+            if (pf->staggersize == pf->nonces) {
+                printf("Streaming plot to %s when done\n", streamtarget);
+                pf->ofd = -1;
+                continue;
+            }
+            printf("Plot does not fit into memory, using a scratch file before streaming to %s\n", streamtarget);
+        }
+
+        if (sinkmode != SINK_FILE) {
+            // Everything but the disk: writes go to /dev/null, checksums
+            // are computed and dropped. The plot keeps its name for reports.
+            snprintf(pf->name, sizeof pf->name, "/dev/null");
+            snprintf(pf->finalname, sizeof pf->finalname, "%s%"PRIu64"_%"PRIu64"_%u", pf->outputdir, pf->addr, pf->startnonce, pf->nonces);
+            pf->ofd      = open(pf->name, O_WRONLY);
+            pf->checkrec = calloc(1, sizeof *pf->checkrec);
+            if (pf->ofd < 0 || pf->checkrec == NULL) {
+                perror(pf->name);
+                return 1;
+            }
+            continue;
+        }
+
+        snprintf(pf->name, sizeof pf->name, "%s%"PRIu64"_%"PRIu64"_%u.plotting", pf->outputdir, pf->addr, pf->startnonce, pf->nonces);
+        snprintf(pf->finalname, sizeof pf->finalname, "%s%"PRIu64"_%"PRIu64"_%u", pf->outputdir, pf->addr, pf->startnonce, pf->nonces);
+
+        int readconfig = 0;
+        if ( !resume ) {
+            unlink(pf->name); // no need to see if file exists: unlink can handle that
+        } else if( access( pf->name, F_OK ) != -1 ) {
+            readconfig = 1;
+        }
+
+#if __APPLE__
+        pf->ofd = open(pf->name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#else
+        if (! use_direct_io) {
+            pf->ofd = open(pf->name, O_CREAT | O_LARGEFILE | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
+        else {
+            printf("Using Direct I/O to avoid flushing buffer cache\n");
+            pf->ofd = open(pf->name, O_CREAT | O_LARGEFILE | O_RDWR | O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
+#endif
+        if (pf->ofd < 0) {
+            perror(pf->name);
+            printf("Error opening file %s\n", pf->name);
+            return 1;
+        }
+
+        int64_t durable = journalopen(pf, readconfig);
+
+        if (durable < -1)
+            return 1;
+        if (durable >= 0) {
+            pf->run = pf->written = durable;
+            printf("Resuming at nonce %" PRIu64 " with staggersize %d...\n", pf->startnonce + durable, pf->staggersize);
+        }
+        else if ( readconfig ) {
+            uint32_t id;
+            uint64_t run = 0;
+            char tail[sizeof id + sizeof run];
+
+            // No journal: read last status from the end of the file
+            if (readtail(pf, tail, sizeof tail) < 0)
+                return 1;
+            memcpy(&id, tail, sizeof id);
+            if (id != resumeid) {
+                printf("\n\nThis plot file does not support resuming!\n\n");
+            } else {
+                memcpy(&run, tail + sizeof id, sizeof run);
+            }
+            pf->run = pf->written = run;
+            if (run > 0 && journalappend(pf, JOURNAL_ROUND, 0, run, NUM_SCOOPS) < 0)
+                return 1;
+            printf("Resuming at nonce %" PRIu64 " with staggersize %d...\n", pf->startnonce + run, pf->staggersize);
+        }
+        else {
+            // pre-allocate space to prevent fragmentation
+            uint64_t filesize = (uint64_t)pf->nonces * NONCE_SIZE;
+
+            printf("Pre-allocating space for file (%ld bytes)...\n", filesize);
+            if ( posix_fallocate(pf->ofd, 0, filesize) != 0 ) {
+                printf("File pre-allocation failed.\n");
+                return 1;
+            }
+            else {
+                printf("Done pre-allocating space.\n");
+            }
+        }
 
-uint64_t
-getMS() {
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    return ((uint64_t)time.tv_sec * 1000000) + time.tv_usec;
-}
+        // Spot badly fragmented targets
+        extentmap(pf);
+        if (pf->numextents > 0)
+            printf("%s: %u extent%s%s\n", pf->name, pf->numextents, (pf->numextents > 1) ? "s" : "",
+                   (pf->numextents > 1) ? ", scoops are written in disk order" : "");
 
-/* }}} */
-/* {{{ usage             print usage info   */
+        // A scratch file for streaming is gone after the plot has been sent
+        if (streamtarget == NULL && checkopen(pf, pf->written) < 0)
+            return 1;
+    }
 
-void usage(char **argv) {
-    printf("Usage: %s -k KEY [ -x CORE ] [-v VERBOSE] [-d DIRECTORY] [-s STARTNONCE] [-n NONCES] [-m STAGGERSIZE] [-t THREADS] [-b MAXMEMORY] [-p PLOTFILESIZE] [-a] [-R] [-D]\n\n", argv[0]);
-    printf("   see README.md\n");
-    exit(-1);
+    return 0;
 }
 
 /* }}} */
+/* {{{ finishplots       close, rename and report plot files */
 
-/* {{{ writecache  */
-
-void *
-writecache(void *arguments) {
-    uint64_t cacheblocksize = staggersize * SCOOP_SIZE;
-    uint64_t thisnonce;
-    float percent;
+// Returns 1 if a plot file was stopped or failed before it was complete,
+// -1 if a finished one could not be renamed
+int
+finishplots(uint32_t first) {
+    uint32_t f;
+    int stopped = 0;
+
+    for (f = first; f < numfiles; f++) {
+        struct plotfile *pf = &plotfiles[f];
+
+        if (pf->reordered > 0)
+            printf("\n%s: %u round%s written in disk order", pf->name, pf->reordered, (pf->reordered > 1) ? "s" : "");
+
+        if (pf->failed) {
+            printf("\nWriting %s failed at nonce %" PRIu64 " of %" PRIu64 ".\n", pf->ofd < 0 ? streamtarget : pf->name,
+                   pf->startnonce + pf->written, pf->startnonce + pf->nonces);
+            if (pf->ofd >= 0)
+                close(pf->ofd);
+            pf->ofd = -1;
+            stopped = 1;
+            continue;
+        }
 
-    percent = ((double)100 * lastrun / nonces);
+        if (pf->written < pf->nonces) {
+            printf("\nStopped %s at nonce %" PRIu64 " of %" PRIu64 ".\n", pf->ofd < 0 ? streamtarget : pf->name,
+                   pf->startnonce + pf->written, pf->startnonce + pf->nonces);
+            if (pf->ofd >= 0)
+                close(pf->ofd);
+            stopped = 1;
+            continue;
+        }
 
-    if (lastseconds) {
-        printf("\r\n\33[2K\r%5.2f%% done. %i nonces per minute, %02i:%02i:%02i left [writing%s]",
-               percent, (lastspeed * 60), lasthours, lastminutes, lastseconds, (asyncmode) ? " asynchronously" : "");
-    }
-    else {
-        printf("\33[2K\r%5.2f%% done. [writing%s]",
-               percent, (asyncmode) ? " asynchronously" : "");
-    }
-    fflush(stdout);
+        if (pf->ofd < 0) {
+            printf("\nFinished plotting. %d nonces created and streamed in %.1fs.\n", pf->nonces, totalcreatetime);
+            continue;
+        }
 
-    for (thisnonce = 0; thisnonce < NUM_SCOOPS; thisnonce++ ) {
-        uint64_t cacheposition = thisnonce * cacheblocksize;
-        uint64_t fileposition  = (uint64_t)(thisnonce * (uint64_t)nonces * (uint64_t)SCOOP_SIZE + thisrun * (uint64_t)SCOOP_SIZE);        
-        if ( LSEEK(ofd, fileposition, SEEK_SET) < 0 ) {
-            printf("\n\nError while lseek()ing in file: %d\n\n", errno);
-            exit(1);
+        if (sinkmode != SINK_FILE) {
+            printf("\nFinished plotting. %d nonces created in %.1fs and discarded.\n", pf->nonces, totalcreatetime);
+            close(pf->ofd);
+            continue;
         }
-        if ( write(ofd, &wcache[cacheposition], cacheblocksize) < 0 ) {
-            perror("writecache");
-            printf("\n\nError while writing to file: %d\n\n", errno);
-            exit(1);
+
+        close(pf->ofd);
+
+        if (streamtarget != NULL) {
+            printf("\nFinished plotting. %d nonces created in %.1fs.\n", pf->nonces, totalcreatetime);
+            streamfile(pf);
+            continue;
         }
-    }
 
-    uint64_t ms = getMS() - starttime;
+        if (pf->rawdevice) {
+            printf("\nFinished plotting. %d nonces created in %.1fs into %s at offset %" PRIu64 ".\n", pf->nonces, totalcreatetime, pf->name, pf->baseoffset);
+            continue;
+        }
 
-    percent        = ((double)100 * lastrun / nonces);
-    double runsecs = (double)ms / 1000000;
-    lastspeed      = (int)(staggersize / runsecs);
+        printf("\nFinished plotting. %d nonces created in %.1fs; renaming file...\n", pf->nonces, totalcreatetime);
 
-    int seconds    = (int)(nonces - run) / lastspeed;
-    int remainder  = seconds % 3600;
-    lasthours      = (int)seconds / 3600;
-    lastminutes    = remainder / 60;;
-    lastseconds    = remainder % 60;
+        unlink(pf->finalname);
 
-    printf("\r\n\33[2K\r%5.2f%% done. %i nonces per minute, %02i:%02i:%02i left", percent, (lastspeed * 60), lasthours, lastminutes, lastseconds);
-    fflush(stdout);
+        if ( rename(pf->name, pf->finalname) < 0 ) {
+            printf("Error while renaming file: %d\n", errno);
+            return -1;
+        }
+        if (pf->cfd >= 0) {
+            char from[PATH_MAX + 8], to[PATH_MAX + 8];
+
+            close(pf->cfd);
+            pf->cfd = -1;
+            snprintf(from, sizeof from, "%s.check", pf->name);
+            snprintf(to, sizeof to, "%s.check", pf->finalname);
+            rename(from, to);
+        }
+        journalremove(pf);
+    }
 
-    return NULL;
+    return stopped;
 }
 
-/* }}} */
-/* {{{ writestatus */
-
+// Lets go of a daemon's plot file after finishplots, or after setupplots
+// failed on it (failed): then its partial plot, journal and checksums go
+// as well
 void
-writestatus(void) {
-    // Write current status to the end of the file
-    if ( LSEEK(ofd, -sizeof run, SEEK_END) < 0 ) {
-        printf("\n\nError while lseek()ing in file: %d\n\n", errno);
-        exit(1);
-    }
-    if ( write(ofd, &run, sizeof run) < 0 ) {
-        perror("writestatus");
-        printf("\n\nError while writing to file: %d\n\n", errno);
-        exit(1);
+dropplot(struct plotfile *pf, int failed) {
+    char name[PATH_MAX + 8];
+
+    if (failed && pf->ofd >= 0)
+        close(pf->ofd);
+    if (failed && !pf->rawdevice && sinkmode == SINK_FILE && pf->name[0] != 0) {
+        unlink(pf->name);
+        snprintf(name, sizeof name, "%s.journal", pf->name);
+        unlink(name);
+        snprintf(name, sizeof name, "%s.check", pf->name);
+        unlink(name);
     }
+    pf->ofd = -1;
+    if (pf->jfd >= 0)
+        close(pf->jfd);
+    if (pf->cfd >= 0)
+        close(pf->cfd);
+    pf->jfd = pf->cfd = -1;
+    free(pf->rawheader);
+    free(pf->checkrec);
+    free(pf->extents);
+    free(pf->outputdir);
+    pf->rawheader = NULL;
+    pf->checkrec  = NULL;
+    pf->extents   = NULL;
+    pf->outputdir = NULL;
 }
 
 /* }}} */
-
 /* {{{ main */
 
 int main(int argc, char **argv) {
@@ -496,14 +2716,145 @@ int main(int argc, char **argv) {
         usage(argv);
     }
 
+    uint32_t f;
     int i;
     int startgiven = 0;
+    char *addrlist = NULL;
     int resume = 0;
-    for (uint8_t i = 1; i < argc; i++) {
+    int rawinit = 0;
+    int tuning = 0;
+    int coregiven = 0;
+
+    // When the plot is streamed to stdout, all messages go to stderr
+    for (i = 1; i < argc; i++) {
+        char *target = optvalue(argc, argv, &i, "--stream");
+
+        if (target != NULL && !strcmp(target, "-")) {
+            streamfd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+    }
+
+    for (i = 1; i < argc; i++) {
         // Ignore unknown argument
         if(argv[i][0] != '-')
             continue;
 
+        if (argv[i][1] == '-') {
+            char *value;
+
+            if ((value = optvalue(argc, argv, &i, "--stream")) != NULL) {
+                streamtarget = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--receive")) != NULL) {
+                receivesource = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--serve")) != NULL) {
+                servesource = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--check")) != NULL) {
+                checkfile = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--verify")) != NULL) {
+                verifyfile = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--repair")) != NULL) {
+                repairfile = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--convert")) != NULL) {
+                convertfile = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--mine")) != NULL) {
+                minesource = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--deadlines")) != NULL) {
+                deadlinesource = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--nonce-cache")) != NULL) {
+                noncecachesize = strtoul(value, NULL, 10);
+            }
+            else if ((value = optvalue(argc, argv, &i, "--sink")) != NULL) {
+                if (sinkparse(value) < 0)
+                    exit(1);
+            }
+            else if ((value = optvalue(argc, argv, &i, "--readbench")) != NULL) {
+                benchrounds = strtoul(value, NULL, 10);
+            }
+            else if ((value = optvalue(argc, argv, &i, "--io")) != NULL) {
+                benchvariants = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--merge")) != NULL) {
+                mergefiles = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--split")) != NULL) {
+                splitfile = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--at")) != NULL) {
+                splitat = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--progress")) != NULL) {
+                if (!strcmp(value, "json"))
+                    progressmode = PROGRESS_JSON;
+                else if (strcmp(value, "text")) {
+                    printf("Unknown progress format %s: use text or json\n", value);
+                    exit(1);
+                }
+            }
+            else if ((value = optvalue(argc, argv, &i, "--metrics-file")) != NULL) {
+                metricsfile = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--yield-on")) != NULL) {
+                yieldfile = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--yield")) != NULL) {
+                if (sscanf(value, "%lf,%lf", &yieldwindow, &yieldrate) < 1 || yieldwindow <= 0 || yieldrate < 0) {
+                    printf("Use --yield=<seconds>[,<MB/s>]\n");
+                    exit(1);
+                }
+            }
+            else if ((value = optvalue(argc, argv, &i, "--control")) != NULL) {
+                controlpath = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--daemon")) != NULL) {
+                daemonspool = value;
+            }
+            else if (!strcmp(argv[i], "--hugepages")) {
+                hugepages = 1;
+            }
+            else if (!strcmp(argv[i], "--perf-counters")) {
+                perfcounters = 1;
+            }
+            else if (!strcmp(argv[i], "--phases")) {
+                phasing = 1;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--trace")) != NULL) {
+                tracefile = value;
+            }
+            else if (!strcmp(argv[i], "--autotune")) {
+                tuning = 1;
+            }
+            else if (!strcmp(argv[i], "--autotune=force")) {
+                tuning = 2;
+            }
+            else if (!strcmp(argv[i], "--inplace")) {
+                convertinplace = 1;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--ranges")) != NULL) {
+                repairranges = value;
+            }
+            else if ((value = optvalue(argc, argv, &i, "--sample")) != NULL) {
+                verifysample = strtod(value, NULL);
+            }
+            else if ((value = optvalue(argc, argv, &i, "--worker")) != NULL) {
+                workertarget = value;
+            }
+            else {
+                printf("Unknown option %s\n", argv[i]);
+                usage(argv);
+            }
+            continue;
+        }
+
         if (!strcmp(argv[i],"-a")) {
             asyncmode = 1;
             printf("Async mode set.\n");
@@ -526,10 +2877,15 @@ int main(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(argv[i],"-I")) {
+            rawinit = 1;
+            continue;
+        }
+
         char *parse = NULL;
         uint64_t parsed;
         char param = argv[i][1];
-        int modified, ds;
+        int modified;
 
         if (argv[i][2] == 0) {
             if (i < argc - 1)
@@ -559,6 +2915,7 @@ int main(int argc, char **argv) {
             switch(param) {
             case 'k':
                 addr = parsed;
+                addrlist = parse;
                 break;
             case 's':
                 startnonce = parsed;
@@ -595,52 +2952,105 @@ int main(int argc, char **argv) {
                 break;
             case 'x':
                 selecttype = parsed;
+                coregiven = 1;
                 break;
             case 'd':
-                ds = strlen(parse);
-                outputdir = (char*) malloc(ds + 2);
-                memcpy(outputdir, parse, ds);
-                // Add final slash?
-                if (outputdir[ds - 1] != '/') {
-                    outputdir[ds] = '/';
-                    outputdir[ds + 1] = 0;
-                }
-                else {
-                    outputdir[ds] = 0;
-                }
+                adddirs(parse, 0);
+                break;
+            case 'B':
+                adddirs(parse, 1);
+                // Aligned buffers for O_DIRECT
+                use_direct_io = 1;
             }
         }
     }
 
+    if (numfiles == 0) {
+        char defaultdir[] = DEFAULTDIR;
+        adddirs(defaultdir, 0);
+    }
+
+    if (receivesource != NULL) {
+        return receive(receivesource, plotfiles[0].outputdir);
+    }
+
+    if (benchrounds > 0) {
+        return readbench(benchrounds, benchvariants);
+    }
+
+    if (mergefiles != NULL) {
+        return merge(mergefiles, plotfiles[0].outputdir);
+    }
+
+    if (splitfile != NULL) {
+        return split(splitfile, splitat, plotfiles[0].outputdir);
+    }
+
+    if (convertfile != NULL) {
+        return convert(convertfile, plotfiles[0].outputdir, convertinplace);
+    }
+
+    if (checkfile != NULL) {
+        int ret = check_plot(checkfile, NULL, NULL);
+
+        return (ret < 0) ? 2 : ret;
+    }
+
+    if (streamtarget != NULL && (numfiles > 1 || plotfiles[0].rawdevice)) {
+        printf("Streaming needs exactly one plot directory (used as scratch space if the plot does not fit into memory).\n");
+        exit(1);
+    }
+
+    // A coordinator only hashes locally when asked to with -t
+    int localhash = (servesource == NULL || threads > 0);
+
+    if (tuning)
+        autotune(tuning == 2, coregiven);
+
     // Autodetect threads
     if (threads == 0)
         threads = getNumberOfCores();
 
-    if (selecttype == 1) {
-        noncearguments = 4;
-        printf("Using SSE4 core.\n");
+    selectcore(selecttype > 2 ? 0 : selecttype);
+    printf("Using %s core.\n", (selecttype == 2) ? "AVX2" : (selecttype == 1) ? "SSE4" : "ORIG");
+    // With a predefined stagger size, partial batches are filled across rounds
+    if (noncearguments > 1 && nonces % (threads * noncearguments) && staggersize == 0) {
+        printf("Number of nonces is not divisible by threads * %d, and will be adjusted when calculating stagger size.\n", noncearguments);
     }
-    else if (selecttype == 2) {
-        noncearguments = 8;
-        printf("Using AVX2 core.\n");
+
+    if (verifyfile != NULL) {
+        return verify(verifyfile, verifysample);
     }
-    else {
-        noncearguments = 1;
-        printf("Using ORIG core.\n");
-        selecttype = 0;
+
+    if (repairfile != NULL) {
+        return repair(repairfile, repairranges);
     }
-    if (noncearguments > 1 && nonces % (threads * noncearguments)) {
-        if (staggersize > 0) {
-            printf("Stagger size is predefined, but number of nonces is not divisible by threads * %d. Unable to use selected hashing core.\n", noncearguments);
-            exit(-1);
-        } else {
-            printf("Number of nonces is not divisible by threads * %d, and will be adjusted when calculating stagger size.\n", noncearguments);
-        }
+
+    if (minesource != NULL) {
+        return mine(minesource);
+    }
+
+    if (deadlinesource != NULL) {
+        return deadlines(deadlinesource);
+    }
+
+    if (workertarget != NULL) {
+        signal(SIGPIPE, SIG_IGN);
+        return runworker(workertarget);
     }
 
-    if (addr == 0) {
+    if (addr == 0 && tuning && daemonspool == NULL) {
+        return 0;
+    }
+    if (daemonspool != NULL && (addr != 0 || streamtarget != NULL || servesource != NULL || plotfiles[0].rawdevice)) {
+        printf("--daemon takes the accounts from its jobs and plots into directories only.\n");
+        return 1;
+    }
+    if (addr == 0 && daemonspool == NULL) {
         usage(argv);
     }
+    if (daemonspool == NULL)
+        addaddrs(addrlist, 0);
 
     // No startnonce given: Just pick random one
     if (startgiven == 0) {
@@ -652,312 +3062,175 @@ int main(int argc, char **argv) {
         printf("Both number of nonces and size of plot file is specified. Choose one, and the other will be calculated automatically.\n");
         return(1);
     }
-
-    // No nonces specified. Calculate nonces based on disk space
-    if (nonces == 0) {
-        uint64_t fs = freespace(outputdir);
-        if (plotfilesize == 0 && (leavespace == 0 && userleavespace != 1)) {
-            // Neither plot file size nor remaining disk space is specified.
-            // Leave maximum 1GB if available, or 50% of the remaining diskspace otherwise.
-            leavespace = (fs > 1024*1024*1024) ? 1024 * 1024 * 1024 : fs * 0.5;
-        }
-        uint64_t usespace = (plotfilesize > 0) ? plotfilesize : fs - leavespace;
-        if (plotfilesize > 0  && leavespace > 0 && (plotfilesize + leavespace > fs)) {
-            printf("Plot file size is set to %0.2f GB and we should leave %0.2f GB of free space, but the disk only has %0.2f GB available.\n",
-                    (double)plotfilesize / 1024 / 1024 / 1024, (double)leavespace / 1024 / 1024 / 1024, (double)fs / 1024 / 1024 / 1024);
-            exit(1);
-        }
-        if ((fs < usespace) || ((usespace / NONCE_SIZE) < 1)) {
-            printf("Not enough free space on device. Disk has %0.2f GB available, and we're configured to use %0.2f GB, leaving %0.2f GB.\n",
-                    (double)fs / 1024 / 1024 / 1024, (double)usespace / 1024 / 1024 / 1024, (double)leavespace / 1024 / 1024 / 1024);
-            exit(-1);
-        }
-        nonces = (uint64_t)(usespace / NONCE_SIZE);
-        if (noncearguments > 1 && nonces % (threads * noncearguments)) {
-            nonces -= nonces % (threads * noncearguments);
-        }
-        printf("Number of nonces not specified. Attempting to create %d nonces (%0.2f GB), leaving %0.2f GB remaining free space.\n",
-                nonces, ((double)nonces * NONCE_SIZE / 1024 / 1024 / 1024), ((double)(fs - usespace) / 1024 / 1024 / 1024));
-    }
-
-    // Autodetect stagger size
-    if (staggersize == 0) {
-        // Use max 80% (40% if async mode) of total available memory, unless the user has specified a limit
-        uint64_t usememory = (maxmemory > 0) ? maxmemory : freemem() * 0.8;
-        if (asyncmode) {
-            usememory = (uint64_t)usememory / 2;
-        }
-        if (usememory < NONCE_SIZE) {
-            printf("Unable to plot any nonces (%d bytes) with only %" PRIu64 " bytes of memory available.\n", NONCE_SIZE, usememory);
-            exit(1);
-        }
-
-        uint64_t memstag = usememory / NONCE_SIZE;
-        int staggerdiff = (memstag > 1000) ? 1000 : 1;
-        if (nonces < memstag) {
-            // Small stack: all at once
-            if (noncearguments > 1 && nonces % (threads * noncearguments)) {
-                printf("All nonces would fit in memory, but number of nonces is not divisible by threads * %d. Adjusting nonces from %d to %d.\n",
-                        noncearguments, nonces, (nonces - (nonces % (threads * noncearguments))));
-                nonces -= (nonces % (threads * noncearguments));
-            }
-            else {
-                printf("All nonces will fit in memory. Setting stagger size to %d\n", nonces);
-            }
-            staggersize = nonces;
-        }
-        else {
-            // Determine stagger that (almost) fits nonces
-            for (i = memstag; i >= staggerdiff; i--) {
-                if (i - (i % (threads * noncearguments)) <=  0) {
-                    printf("Unable to find suitable stagger size for selected hashing core based on %d nonces and %d thread(s). Could indicate lack of memory (%0.2f GB).\n",
-                            nonces, threads, (double)usememory / 1024 / 1024 / 1024);
-                    return(1);
-                }
-                if (nonces % (i - (i % (threads * noncearguments))) <= staggerdiff) {
-                    if (selecttype > 0) {
-                        // Optimize stagger sizes for nonces processed per hashing core
-                        i = i - (i % (threads * noncearguments));
-                    }
-                    staggersize = i;
-                    printf("Stagger size was set to %u, based on available memory and selected hashing algorithm.\n", staggersize);
-                    if ((nonces % staggersize) > 0) {
-                        printf("Adjusting nonces from %u to %u to comply with stagger size.\n",
-                                nonces, (nonces - (nonces % i)));
-                        nonces -= (nonces % i);
-                    }
-                    i = 0;
-                }
-            }
-        }
-    }
-    if (nonces == 0 || staggersize == 0) {
-        printf("Ended up with %d nonces and a stagger size of %d. Unable to proceed.", nonces, staggersize);
+    if (sinkmode != SINK_FILE && (nonces == 0 || streamtarget != NULL || plotfiles[0].rawdevice)) {
+        printf("--sink needs the number of nonces (-n) and plots into directories only.\n");
         return(1);
     }
 
-    // Adjust according to stagger size
-    if (nonces % staggersize != 0) {
-        nonces -= nonces % staggersize;
-        nonces += staggersize;
-        printf("Adjusting total nonces to %u to match stagger size\n", nonces);
+    // Use max 80% (40% if async mode) of total available memory, unless the user has
+    // specified a limit. The memory is shared evenly by all plot files.
+    uint64_t usememory = (maxmemory > 0) ? maxmemory : freemem() * 0.8;
+    if (asyncmode) {
+        usememory = (uint64_t)usememory / 2;
     }
 
-    printf("Creating plots for %u nonces (%" PRIu64 " to %" PRIu64 ", %0.2f GB) with stagger size %u, using %0.2f MB memory and %u threads\n",
-           nonces, startnonce, (startnonce + nonces), ((double)nonces * NONCE_SIZE / 1024 / 1024 / 1024), staggersize, ((double)staggersize / 4 * (1 + asyncmode)), threads);
-
     // Comment this out/change it if you really want more than 128 Threads
     if (threads > 128) {
         printf("%u threads? Sure?\n", threads);
         exit(-1);
     }
 
-    if (asyncmode == 1) {
-        acache[0] = alloc( NONCE_SIZE, staggersize );
-        acache[1] = alloc( NONCE_SIZE, staggersize );
-
-        if (acache[0] == NULL || acache[1] == NULL) {
-            printf("Error allocating memory. Try lower stagger size or removing ASYNC mode.\n");
-            exit(-1);
-        }
-    }
-    else {
-        cache = alloc( NONCE_SIZE, staggersize );
-
-        if (cache == NULL) {
-            printf("Error allocating memory. Try lower stagger size.\n");
-            exit(-1);
-        }
-    }
 
-    mkdir(outputdir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+    if (daemonspool == NULL && setupplots(0, usememory / numfiles, resume, rawinit) != 0)
+        return 1;
 
-    char name[200];
-    char finalname[200];
-    sprintf(name, "%s%"PRIu64"_%"PRIu64"_%u.plotting", outputdir, addr, startnonce, nonces);
-    sprintf(finalname, "%s%"PRIu64"_%"PRIu64"_%u", outputdir, addr, startnonce, nonces);
+    pthread_attr_t stackSizeAttribute;
 
-    int readconfig = 0;
-    if ( !resume ) {
-        unlink(name); // no need to see if file exists: unlink can handle that
-    } else if( access( name, F_OK ) != -1 ) {
-        readconfig = 1;
-    }
+    if (initstackattr(&stackSizeAttribute))
+        return 1;
 
-#if __APPLE__
-    ofd = open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-#else
-    if (! use_direct_io) {
-        ofd = open(name, O_CREAT | O_LARGEFILE | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    }
-    else {
-        printf("Using Direct I/O to avoid flushing buffer cache\n");
-        ofd = open(name, O_CREAT | O_LARGEFILE | O_RDWR | O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    pthread_t worker[threads];
+    uint64_t spawned[threads];
+    pthread_t stopper;
+    sigset_t stopsignals;
+
+    // Threads inherit the blocked signals, only stop_i takes them
+    sigemptyset(&stopsignals);
+    sigaddset(&stopsignals, SIGINT);
+    sigaddset(&stopsignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopsignals, NULL);
+    if (pthread_create(&stopper, NULL, stop_i, &stopsignals)) {
+        printf("Error creating thread.\n");
+        exit(-1);
     }
-#endif
-    if (ofd < 0) {
-        perror(name);
-        printf("Error opening file %s\n", name);
-        exit(1);
+    pthread_detach(stopper);
+
+    uint64_t plotstart = getMS();
+
+    plotstarted = plotstart;
+    if (perfcounters) {
+        struct perfthread probe;
+        uint32_t mask = perf_open(&probe);
+        int k, n = 0;
+
+        // Carry on with what there is
+        if (!(mask & (1 << PERF_CYCLES))) {
+            printf("Hardware performance counters unavailable (%s, see /proc/sys/kernel/perf_event_paranoid)%s",
+                   strerror(errno), mask ? ", counting" : ".\n");
+            for (k = 0; k < PERF_COUNTERS; k++) {
+                if (mask & (1 << k))
+                    printf("%s %s", n++ ? "," : "", perf_names[k]);
+            }
+            printf("%s", mask ? " only.\n" : "");
+        }
+        perf_close(&probe);
     }
 
-    if ( readconfig ) {
-        uint32_t id;
-
-        // Read last status from the end of the file
-        if ( LSEEK(ofd, -sizeof run - sizeof id, SEEK_END) < 0 ) {
+    if (phasing || tracefile) {
+        phase_init(tracefile != NULL);
+        phase_register("main");
+    }
 
-            printf("\n\nError while lseek()ing in file: %d\n\n", errno);
-            exit(1);
-        }
-        if ( read(ofd, &id, sizeof id) < sizeof id ) {
-            printf("\n\nError while reading from file: %d\n\n", errno);
-            exit(1);
-        }
-        if (id != resumeid) {
-            printf("\n\nThis plot file does not support resuming!\n\n");
-        } else if ( read(ofd, &run, sizeof run) < sizeof run ) {
-            printf("\n\nError while reading from file: %d\n\n", errno);
-            exit(1);
+    for (f = 0; daemonspool == NULL && f < numfiles; f++) {
+        if (pthread_create(&plotfiles[f].writeworker, NULL, writeworker_i, &plotfiles[f])) {
+            printf("Error creating thread. Out of memory? Try lower stagger size / fewer threads%s\n", (asyncmode == 1) ? " / remove async mode" : "");
+            exit(-1);
         }
-        startnonce += run;
-        printf("Resuming at nonce %ld with staggersize %d...\n", startnonce, staggersize);
     }
-    else {
-        // pre-allocate space to prevent fragmentation
-        uint64_t filesize = (uint64_t)nonces * NONCE_SIZE;
-        printf("Pre-allocating space for file (%ld bytes)...\n", filesize);
-        if ( posix_fallocate(ofd, 0, filesize) != 0 ) {
-            printf("File pre-allocation failed.\n");
-            return 1;
-        }
-        else {
-            printf("Done pre-allocating space.\n");
-        }
-        // Write resume id to the end of the file
-        if ( LSEEK(ofd, -sizeof run - sizeof resumeid, SEEK_END) < 0 ) {
-            printf("\n\nError while lseek()ing in file: %d\n\n", errno);
+
+    if (servesource != NULL) {
+        static int lfd;
+        pthread_t acceptor;
+
+        signal(SIGPIPE, SIG_IGN);
+        if ((lfd = stream_listen(servesource)) < 0) {
+            printf("Unable to listen on %s\n", servesource);
             exit(1);
         }
-        if ( write(ofd, &resumeid, sizeof resumeid) < 0 ) {
-            perror("write");
-            printf("\n\nError while writing to file: %d\n\n", errno);
-            exit(1);
+        if (pthread_create(&acceptor, NULL, netaccept_i, &lfd)) {
+            printf("Error creating thread.\n");
+            exit(-1);
         }
-        writestatus();
+        pthread_detach(acceptor);
+        printf("Waiting for hashing workers on %s\n", servesource);
     }
 
-    // Threads:
-    noncesperthread = (uint64_t)(staggersize / threads);
+    if (controlpath != NULL)
+        controlstart(controlpath);
 
-    if (noncesperthread == 0) {
-        threads = staggersize;
-        noncesperthread = 1;
-    }
+    if (yieldfile != NULL) {
+        pthread_t governor;
 
-    // Check the size of the stack and increase if necessary
-    int err = 0;
-    pthread_attr_t     stackSizeAttribute;
-    size_t            stackSize = 0;
-    
-    /*  Initialize the attribute */
-    err = pthread_attr_init(&stackSizeAttribute);
-    if (err) {
-        printf("Error retreiving the pthread stack size attribute: %d\n", err);
-        return 1;
-    }
-    
-    /* Get the default value */
-    err = pthread_attr_getstacksize(&stackSizeAttribute, &stackSize);
-    if (err) {
-        printf("Error retreving the pthread stack size: %d\n", err);
-        return 1;
-    }
-    
-    if (verbose) {
-        printf("Current stack size is: %ld\n", stackSize);
+        if (pthread_create(&governor, NULL, governor_i, NULL)) {
+            printf("Error creating thread.\n");
+            exit(-1);
+        }
+        pthread_detach(governor);
     }
 
-    /* If the default size does not fit our needs, set the attribute with our required value */
-    if (stackSize < REQUIRED_STACK_SIZE) {
-        if (verbose) {
-            printf("Initializing pthreads with increased stack size: %d\n", REQUIRED_STACK_SIZE);
-        }
-        err = pthread_attr_setstacksize (&stackSizeAttribute, REQUIRED_STACK_SIZE);
-        if (err) {
-            printf("Error setting pthreads stack size attribute: %d\n", err);
+    daemonrunning = (daemonspool != NULL);
+    for (i = 0; localhash && i < threads; i++) {
+        spawned[i] = phase_start();
+        if (pthread_create(&worker[i], &stackSizeAttribute, work_i, &spawned[i])) {
+            printf("Error creating thread. Out of memory? Try lower stagger size / less threads\n");
+            exit(-1);
         }
     }
-    
-    pthread_t worker[threads], writeworker;
-    int workerrunning = 0;
-    uint64_t nonceoffset[threads];
-
-    int asyncbuf = 0;
-    double totalcreatetime = 0.0;
-    uint64_t astarttime;
-    if (asyncmode == 1) cache = acache[asyncbuf];
-    else wcache = cache;
-
-    for (; run < nonces; run += staggersize) {
-        astarttime = getMS();
-
-        for (i = 0; i < threads; i++) {
-            nonceoffset[i] = startnonce + i * noncesperthread;
-            if (pthread_create(&worker[i], &stackSizeAttribute, work_i, &nonceoffset[i])) {
-                printf("Error creating thread. Out of memory? Try lower stagger size / less threads\n");
-                exit(-1);
-            }
-        }
 
-        for (i = 0; i < threads; i++) {           // Wait for Threads to finish;
-            pthread_join(worker[i], NULL);
-        }
+    if (daemonspool != NULL)
+        plotdaemon(usememory, rawinit);
 
-        for (i = threads * noncesperthread; i < staggersize; i++)     // Run leftover nonces
-            nonce(addr, startnonce + i, (uint64_t)i);
+    for (i = 0; localhash && i < threads; i++) {           // Wait for Threads to finish;
+        pthread_join(worker[i], NULL);
+        phase_end(PHASE_THREADS, spawned[i]);
+    }
 
-        // Write plot to disk:
-        createtime = ((double)getMS() - (double)astarttime) / 1000000.0;
-        totalcreatetime += createtime;
-        starttime = astarttime;
-        if (asyncmode == 1) {
-            if (workerrunning) pthread_join(writeworker, NULL);
-            else workerrunning = 1;
-            thisrun = run;
-            lastrun = run + staggersize;
-            wcache = cache;
-            if (pthread_create(&writeworker, NULL, writecache, (void *)NULL)) {
-                printf("Error creating thread. Out of memory? Try lower stagger size / fewer threads / remove async mode\n");
-                exit(-1);
-            }
-            asyncbuf = 1 - asyncbuf;
-            cache = acache[asyncbuf];
-        }
-        else {
-            thisrun = run;
-            lastrun = run + staggersize;
-            if (pthread_create(&writeworker, NULL, writecache, (void *)NULL)) {
-                printf("Error creating thread. Out of memory? Try lower stagger size / fewer threads\n");
-                exit(-1);
-            }
-            pthread_join(writeworker, NULL);
-        }
-        writestatus();
+    for (f = 0; f < numfiles; f++) {
+        pthread_join(plotfiles[f].writeworker, NULL);
+    }
 
-        startnonce += staggersize;
+    // Let connected hashing workers know that we are done
+    pthread_mutex_lock(&poolmutex);
+    while (networkers > 0)
+        pthread_cond_wait(&poolcond, &poolmutex);
+    pthread_mutex_unlock(&poolmutex);
+
+    int stopped;
+    uint64_t plotwall = getMS() - plotstart;
+
+    if (metricsfile != NULL)
+        progressmetrics(1);
+    if (controlpath != NULL)
+        unlink(controlpath);
+    for (f = 0; f < numfiles; f++) {
+        if (plotfiles[f].yields > 0)
+            printf("\n%s yielded to the miner %" PRIu64 " time(s), writes held or slowed for %.1fs.", plotfiles[f].outputdir,
+                   plotfiles[f].yields, (double)plotfiles[f].yieldtime / 1000000);
     }
 
-    if (asyncmode == 1) pthread_join(writeworker, NULL);
+    stopped = finishplots(0);
+    if (stopped < 0)
+        return 1;
 
-    close(ofd);
+    if (phasing)
+        phase_report(plotwall * 1000);
+    if (perfcounters) {
+        uint64_t written = 0;
 
-    printf("\nFinished plotting. %d nonces created in %.1fs; renaming file...\n", nonces, totalcreatetime);
+        for (f = 0; f < numfiles; f++)
+            written += plotfiles[f].sessionwritten;
+        perfreport(written);
+    }
+    if (tracefile != NULL && phase_writetrace(tracefile) == 0)
+        printf("Trace written to %s\n", tracefile);
 
-    unlink(finalname);
+    if (sinkmode != SINK_FILE) {
+        sinkreport(plotwall);
+        return stopped;
+    }
 
-    if ( rename(name, finalname) < 0 ) {
-        printf("Error while renaming file: %d\n", errno);
+    if (stopped) {
+        printf("Run again with the same options and -R to resume.\n");
         return 1;
     }
 
@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Shared by the plotter (plot.c) and the tools built into plot64: the plot
+// files, the hashing pool and the settings from the command line. Needs
+// engraver.h and perf.h.
+
+#if __APPLE__
+int posix_fallocate(int fd, off_t offset, off_t len);
+
+// Also, on MacOS, there is no lseek64. off_t is already 64 bit
+#define LSEEK lseek
+
+#else    // On Linux, use lseek64
+
+#define LSEEK lseek64
+
+#endif
+
+// A round is one stagger buffer worth of nonces of one plot file. It is
+// filled by the hashing pool and then handed to the file's writer thread.
+#define ROUND_FREE      0
+#define ROUND_HASHING   1
+#define ROUND_FULL      2
+#define ROUND_WRITING   3
+
+struct chunk {
+    uint32_t pos;
+    uint32_t count;
+};
+
+struct round {
+    char *cache;
+    uint64_t run;           // first nonce of the round, relative to the file's startnonce
+    uint32_t len;           // nonces in this round
+    uint32_t next;          // next nonce to be handed out to a hashing thread
+    uint32_t done;          // nonces hashed so far
+    uint64_t seq;           // rounds are finished in the order they were opened
+    uint64_t starttime;
+    int state;
+    struct chunk *lost;     // handed out, but never came back: hand out again
+    uint32_t numlost, maxlost;
+    uint32_t inflight;      // nonces handed out and not done yet
+    struct perfcount hashperf, writeperf;
+};
+
+// One plot file per output directory. All plot files share the hashing
+// pool; each one has its own stagger buffer(s) and writer thread.
+struct plotfile {
+    char *outputdir;
+    uint64_t addr;          // account of this plot job
+    char name[PATH_MAX];
+    char finalname[PATH_MAX];
+    int ofd;
+    uint64_t startnonce;
+    uint32_t nonces;
+    uint32_t staggersize;
+    uint64_t run;           // nonces handed to the hashing pool
+    uint64_t written;       // nonces on disk
+    struct round rounds[2];
+    uint32_t numrounds;
+    pthread_t writeworker;
+    int lastspeed, lasthours, lastminutes, lastseconds;
+    int rawdevice;          // plotting into a region of a block device (or file)
+    uint64_t baseoffset;    // byte offset of the plot data within ofd
+    struct rawheader *rawheader;
+    struct rawregion *rawregion;
+    int jfd;                // checkpoint journal, -1 if none
+    int cfd;                // checksum sidecar, -1 if none
+    struct checkrecord *checkrec;
+    uint64_t sinkclock;     // --sink=throttle: when the emulated disk is idle again
+    uint64_t writebusy;     // time spent writing
+    uint64_t firstwritten;  // when the first round was on disk, and its size
+    uint32_t firstlen;
+    uint64_t lastwritten;
+    uint64_t sessionwritten;    // nonces written in this run (not resumed)
+    uint64_t byteswritten;
+    uint64_t reqs, reqtime;     // write requests and their time
+    uint64_t roundreqtime, roundreqmax;
+    uint32_t roundreqs;
+    struct extent *extents; // where the plot file is on disk, sorted by file offset
+    uint32_t numextents;
+    uint32_t reordered;     // rounds written in disk order, not file order
+    uint64_t capclock;      // --control bandwidth: when the cap allows the next write
+    volatile uint64_t yielduntil;   // writes yield to the miner until then
+    uint64_t yieldclock;
+    uint64_t yields, yieldtime;
+    int failed;             // a write failed: no more rounds for this file
+};
+
+struct extent {
+    uint64_t logical, physical, length;
+};
+
+// --sink: plot into nothing (null) or into an emulated disk (throttle)
+#define SINK_FILE       0
+#define SINK_NULL       1
+#define SINK_THROTTLE   2
+
+// --progress, --metrics-file: machine readable progress
+#define PROGRESS_TEXT   0
+#define PROGRESS_JSON   1
+
+// Header of the messages between --serve and --worker (see network in
+// plot.c); a range to hash is also how --repair hashes its batches
+struct netmsg {
+    uint32_t type;
+    uint32_t count;
+    uint64_t addr;
+    uint64_t nonce;
+    uint64_t id;
+};
+
+// Hashing worker: the pieces of one range are spread over the threads
+struct workerjob {
+    char *cache;
+    struct netmsg *msg;
+    uint32_t index;
+};
+
+extern uint64_t addr;
+extern uint64_t startnonce;
+extern uint32_t nonces;
+extern uint32_t staggersize;
+extern uint32_t threads;
+extern uint32_t asyncmode;
+extern uint64_t maxmemory;
+extern double totalcreatetime;
+extern volatile int stopping;
+extern int daemonrunning;
+extern uint32_t schedcursor;
+extern uint32_t selecttype;
+extern uint32_t noncearguments;
+extern struct plotfile *plotfiles;
+extern uint32_t numfiles;
+extern uint32_t networkers;
+extern double yieldwindow;
+extern pthread_mutex_t poolmutex;
+extern pthread_cond_t poolcond;
+extern struct engraver engine;
+extern int use_direct_io;
+extern int sinkmode;
+
+uint64_t getMS(void);
+void *alloc(size_t nmemb, size_t size);
+int initstackattr(pthread_attr_t *stackSizeAttribute);
+void escapestr(char *dst, size_t size, const char *src);
+double progressrate(struct plotfile *pf, uint64_t now, double *eta);
+uint32_t progressbusy(struct plotfile *pf);
+const char *progressname(struct plotfile *pf);
+uint32_t yieldstart(const char *dir);
+void selectcore(uint32_t core);
+void hashchunk(char *cache, uint32_t staggersize, uint64_t addr, uint64_t first, uint64_t pos, uint32_t count);
+void *workerhash_i(void *x_void_ptr);
+void *writeworker_i(void *x_void_ptr);
+void adddirs(char *parse, int rawdevice);
+void roundtrim(int release);
+int setupplots(uint32_t first, uint64_t usememory, int resume, int rawinit);
+int finishplots(uint32_t first);
+void dropplot(struct plotfile *pf, int failed);
+int checkopen(struct plotfile *pf, uint64_t resumeat);
+int checkappend(struct plotfile *pf, uint64_t run, uint32_t len);
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nonce.h"
+#include "engraver.h"
+#include "uring.h"
+#include "perf.h"
+#include "plot.h"
+#include "mine.h"
+#include "readbench.h"
+
+uint32_t benchrounds = 0;
+char *benchvariants  = NULL;
+
+// {{{ readbench         miner read path benchmark
+
+// Bytes per read request, and requests kept in flight with io_uring
+#define BENCH_CHUNK     (4 * 1024 * 1024)
+#define BENCH_DEPTH     4
+
+#define BENCH_BUFFERED  0
+#define BENCH_DIRECT    1
+#define BENCH_URING     2
+
+const char *benchnames[] = { "buffered", "direct", "io_uring" };
+
+struct benchdisk {
+    struct minedisk *disk;
+    int mode;
+    uint32_t scoop;
+    uint64_t bytes;         // read in this round
+    uint64_t usecs;         // time of this round
+    uint64_t totalbytes;
+    uint64_t totalusecs;
+    uint64_t *lat;          // per request latencies in us, all rounds
+    uint32_t numlat, maxlat;
+    int failed;
+};
+
+void
+benchlatency(struct benchdisk *bd, uint64_t us) {
+    if (bd->numlat == bd->maxlat) {
+        bd->maxlat = bd->maxlat ? bd->maxlat * 2 : 1024;
+        bd->lat    = realloc(bd->lat, bd->maxlat * sizeof *bd->lat);
+        if (bd->lat == NULL) {
+            printf("Error allocating memory.\n");
+            exit(-1);
+        }
+    }
+    bd->lat[bd->numlat++] = us;
+}
+
+// Reads the scoop region of one plot file like a miner does: nonces * 64
+// contiguous bytes, rounded out to 4096 byte blocks for O_DIRECT
+int
+benchfile(struct benchdisk *bd, struct minefile *mf, char **bufs) {
+    uint64_t off  = (uint64_t)bd->scoop * mf->nonces * SCOOP_SIZE;
+    uint64_t end  = off + (uint64_t)mf->nonces * SCOOP_SIZE;
+    uint64_t pos, started[BENCH_DEPTH] = { 0 }, lens[BENCH_DEPTH];
+    int fd, k;
+
+    if (bd->mode != BENCH_BUFFERED) {
+        off &= ~(uint64_t)4095;
+        end  = (end + 4095) & ~(uint64_t)4095;
+    }
+    fd = open(mf->name, O_RDONLY | (bd->mode != BENCH_BUFFERED ? O_DIRECT : 0));
+    if (fd < 0) {
+        perror(mf->name);
+        return -1;
+    }
+    if (bd->mode == BENCH_BUFFERED) {
+        // Do not measure the page cache
+        posix_fadvise(fd, off, end - off, POSIX_FADV_DONTNEED);
+    }
+
+    if (bd->mode != BENCH_URING) {
+        for (pos = off; pos < end; pos += BENCH_CHUNK) {
+            uint64_t len = (end - pos < BENCH_CHUNK) ? end - pos : BENCH_CHUNK;
+            uint64_t ms  = getMS();
+
+            if (pread(fd, bufs[0], len, pos) < (ssize_t)len) {
+                printf("Error while reading %s: %d\n", mf->name, errno);
+                close(fd);
+                return -1;
+            }
+            benchlatency(bd, getMS() - ms);
+            bd->bytes += len;
+        }
+        close(fd);
+        return 0;
+    }
+
+    struct uring u;
+    uint32_t inflight = 0;
+    uint64_t data;
+    int32_t res;
+
+    if (uring_init(&u, BENCH_DEPTH) < 0) {
+        perror("io_uring_setup");
+        close(fd);
+        return -1;
+    }
+    // After an error nothing new is queued, but the reads in flight still
+    // land in bufs: they are waited for before the ring and bufs go
+    for (pos = off, k = 0; (pos < end && !bd->failed) || inflight > 0; ) {
+        // Keep the queue full, then wait for one request
+        while (pos < end && !bd->failed && inflight < BENCH_DEPTH) {
+            uint64_t len = (end - pos < BENCH_CHUNK) ? end - pos : BENCH_CHUNK;
+
+            for (k = 0; k < BENCH_DEPTH && started[k] != 0 && inflight > 0; k++)
+                ;
+            started[k] = getMS();
+            lens[k]    = len;
+            uring_read(&u, fd, bufs[k], len, pos, k);
+            inflight++;
+            pos += len;
+        }
+        if (uring_submit(&u, 1) < 0) {
+            perror("io_uring_enter");
+            if (bd->failed) {
+                printf("Cannot wait for the reads of %s in flight.\n", mf->name);
+                exit(-1);
+            }
+            bd->failed = 1;
+            inflight  -= uring_unsubmitted(&u);
+            continue;
+        }
+        while (uring_reap(&u, &data, &res)) {
+            if (res < 0 || (uint64_t)res < lens[data]) {
+                printf("Error while reading %s: %s\n", mf->name, (res < 0) ? strerror(-res) : "short read");
+                bd->failed = 1;
+            }
+            else {
+                bd->bytes += res;
+            }
+            benchlatency(bd, getMS() - started[data]);
+            started[data] = 0;
+            inflight--;
+        }
+    }
+    uring_exit(&u);
+    close(fd);
+    return bd->failed ? -1 : 0;
+}
+
+void *
+benchdisk_i(void *x_void_ptr) {
+    struct benchdisk *bd = x_void_ptr;
+    char *bufs[BENCH_DEPTH];
+    uint64_t ms = getMS();
+    uint32_t f, k;
+
+    for (k = 0; k < BENCH_DEPTH; k++) {
+        if (posix_memalign((void **)&bufs[k], 4096, BENCH_CHUNK)) {
+            printf("Error allocating memory.\n");
+            exit(-1);
+        }
+    }
+    bd->bytes = 0;
+    for (f = 0; f < bd->disk->numfiles && !bd->failed; f++) {
+        if (benchfile(bd, &bd->disk->files[f], bufs) < 0)
+            bd->failed = 1;
+    }
+    bd->usecs       = getMS() - ms;
+    bd->totalbytes += bd->bytes;
+    bd->totalusecs += bd->usecs;
+
+    for (k = 0; k < BENCH_DEPTH; k++)
+        free(bufs[k]);
+    return NULL;
+}
+
+int
+cmpuint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Scans all plot files in the plot directories for rounds random scoops,
+// with every disk (directory) read by a thread of its own
+int
+readbench(uint32_t rounds, char *variants) {
+    struct minedisk disks[numfiles];
+    struct benchdisk bd[numfiles];
+    pthread_t reader[numfiles];
+    uint32_t f, r, mode, numplots = 0;
+
+    memset(disks, 0, sizeof disks);
+    for (f = 0; f < numfiles; f++) {
+        disks[f].dir = plotfiles[f].outputdir;
+        minescan(&disks[f]);
+        numplots += disks[f].numfiles;
+    }
+    if (numplots == 0) {
+        printf("No plot files found.\n");
+        return 2;
+    }
+    srand(time(NULL));
+
+    for (mode = BENCH_BUFFERED; mode <= BENCH_URING; mode++) {
+        uint64_t roundsum = 0, bytes = 0, *lat = NULL, numlat = 0;
+
+        if (variants != NULL && strstr(variants, benchnames[mode]) == NULL && !(mode == BENCH_URING && strstr(variants, "uring")))
+            continue;
+
+        printf("%s reads of %u plot files in %u directories, %u rounds:\n", benchnames[mode], numplots, numfiles, rounds);
+        memset(bd, 0, sizeof bd);
+        for (r = 0; r < rounds; r++) {
+            uint32_t scoop = rand() % NUM_SCOOPS;
+            uint64_t ms    = getMS(), roundbytes = 0;
+
+            for (f = 0; f < numfiles; f++) {
+                bd[f].disk  = &disks[f];
+                bd[f].mode  = mode;
+                bd[f].scoop = scoop;
+                if (pthread_create(&reader[f], NULL, benchdisk_i, &bd[f])) {
+                    printf("Error creating thread.\n");
+                    exit(-1);
+                }
+            }
+            for (f = 0; f < numfiles; f++) {
+                pthread_join(reader[f], NULL);
+                roundbytes += bd[f].bytes;
+            }
+            ms = getMS() - ms;
+            roundsum += ms;
+            bytes    += roundbytes;
+            printf("  round %u: scoop %4u, %.1f MB in %.3fs, %.1f MB/s\n", r + 1, scoop,
+                   (double)roundbytes / 1048576, (double)ms / 1000000, ms ? (double)roundbytes / 1048576 / ((double)ms / 1000000) : 0);
+        }
+
+        for (f = 0; f < numfiles; f++) {
+            if (bd[f].failed)
+                printf("  %s: failed\n", disks[f].dir);
+            else
+                printf("  %s: %.1f MB/s\n", disks[f].dir, bd[f].totalusecs ? (double)bd[f].totalbytes / 1048576 / ((double)bd[f].totalusecs / 1000000) : 0);
+            lat = realloc(lat, (numlat + bd[f].numlat + 1) * sizeof *lat);
+            memcpy(&lat[numlat], bd[f].lat, bd[f].numlat * sizeof *lat);
+            numlat += bd[f].numlat;
+            free(bd[f].lat);
+        }
+        qsort(lat, numlat, sizeof *lat, cmpuint64);
+        printf("  total: %.1f MB/s, %.3fs per round\n",
+               roundsum ? (double)bytes / 1048576 / ((double)roundsum / 1000000) : 0, (double)roundsum / rounds / 1000000);
+        if (numlat > 0) {
+            printf("  latency per %d MB request: p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n", BENCH_CHUNK / 1048576,
+                   lat[numlat / 2] / 1000.0, lat[numlat * 9 / 10] / 1000.0, lat[numlat * 99 / 100] / 1000.0, lat[numlat - 1] / 1000.0);
+        }
+        free(lat);
+    }
+
+    return 0;
+}
+
+// }}}
@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+// --readbench: time the scoop reads of a mining round on every plot
+// directory, buffered, with O_DIRECT and with io_uring
+extern uint32_t benchrounds;
+extern char *benchvariants;
+
+int readbench(uint32_t rounds, char *variants);
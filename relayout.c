@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "check.h"
+#include "plot.h"
+#include "relayout.h"
+
+char *mergefiles     = NULL;
+char *splitfile      = NULL;
+char *splitat        = NULL;
+
+// {{{ relayout          merge and split plot files
+
+// Nonces per column: every scoop of a column is one read and one write
+#define RELAYOUT_CHUNK  131072
+
+struct relayoutfile {
+    char name[PATH_MAX];
+    char finalname[PATH_MAX];
+    uint64_t addr;
+    uint64_t startnonce;
+    uint32_t nonces;
+    int fd;
+};
+
+// A column is a range of nonces that lies in one input and one output file
+struct relayoutcol {
+    struct relayoutfile *in, *out;
+    uint64_t first;
+    uint32_t count;
+    struct checkrecord *rec;
+};
+
+struct relayoutio {
+    struct relayoutcol *col;
+    uint32_t scoop;
+    char *buf;
+    int full;               // read, and not written yet
+};
+
+// One writer thread writes the columns of the whole relayout in order, from
+// two buffers, while the next column is read
+struct relayoutwriter {
+    struct relayoutio io[2];
+    int done;               // no more columns
+    int failed;             // errno of a failed write, columns after it are dropped
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void *
+relayoutwrite_i(void *x_void_ptr) {
+    struct relayoutwriter *rw = x_void_ptr;
+    uint32_t i;
+
+    for (i = 0; ; i++) {
+        struct relayoutio *io = &rw->io[i % 2];
+
+        pthread_mutex_lock(&rw->mutex);
+        while (!io->full && !rw->done)
+            pthread_cond_wait(&rw->cond, &rw->mutex);
+        pthread_mutex_unlock(&rw->mutex);
+        if (!io->full)
+            break;
+
+        struct relayoutcol *c = io->col;
+        uint64_t size = (uint64_t)c->count * SCOOP_SIZE;
+        uint64_t pos  = ((uint64_t)io->scoop * c->out->nonces + (c->first - c->out->startnonce)) * SCOOP_SIZE;
+        int failed    = !rw->failed && pwrite(c->out->fd, io->buf, size, pos) < (ssize_t)size;
+
+        pthread_mutex_lock(&rw->mutex);
+        if (failed)
+            rw->failed = errno ? errno : ENOSPC;
+        io->full = 0;
+        pthread_cond_broadcast(&rw->cond);
+        pthread_mutex_unlock(&rw->mutex);
+    }
+    return NULL;
+}
+
+int
+cmprelayoutfile(const void *a, const void *b) {
+    const struct relayoutfile *x = a, *y = b;
+
+    return (x->startnonce > y->startnonce) - (x->startnonce < y->startnonce);
+}
+
+// Copies the nonces of the input plot files into the output plot files, which
+// cover the same nonce range with other boundaries. Works scoop by scoop, so
+// reads and writes stay large and mostly sequential; a column is written by
+// the writer thread while the next one is read. On errors, the outputs not
+// renamed yet are removed.
+int
+relayout(struct relayoutfile *ins, uint32_t numins, struct relayoutfile *outs, uint32_t numouts) {
+    struct relayoutcol *cols = NULL;
+    struct relayoutwriter rw;
+    struct plotfile pf;
+    pthread_t writer;
+    uint32_t numcols = 0, i = 0, o = 0, c, s, k = 0;
+    uint64_t n, end = outs[numouts - 1].startnonce + outs[numouts - 1].nonces, ms;
+    int writing = 0, ret = 2, b;
+
+    memset(&rw, 0, sizeof rw);
+    pthread_mutex_init(&rw.mutex, NULL);
+    pthread_cond_init(&rw.cond, NULL);
+    for (c = 0; c < numins; c++)
+        ins[c].fd = -1;
+    for (c = 0; c < numouts; c++)
+        outs[c].fd = -1;
+
+    // Direct I/O keeps every block 4096 byte aligned only with multiples of 64
+    for (c = 0; use_direct_io && c < numins + numouts; c++) {
+        struct relayoutfile *f = (c < numins) ? &ins[c] : &outs[c - numins];
+
+        if (f->nonces % 64 || (f->startnonce - ins[0].startnonce) % 64) {
+            printf("Direct I/O needs nonce ranges that are multiples of 64, using buffered I/O.\n");
+            use_direct_io = 0;
+        }
+    }
+
+    for (n = ins[0].startnonce; n < end; ) {
+        uint64_t inend  = ins[i].startnonce + ins[i].nonces;
+        uint64_t outend = outs[o].startnonce + outs[o].nonces;
+        uint64_t stop   = (inend < outend) ? inend : outend;
+
+        cols = realloc(cols, (numcols + 1) * sizeof *cols);
+        if (cols == NULL) {
+            printf("Error allocating memory.\n");
+            return 2;
+        }
+        cols[numcols].in    = &ins[i];
+        cols[numcols].out   = &outs[o];
+        cols[numcols].first = n;
+        cols[numcols].count = (stop - n < RELAYOUT_CHUNK) ? stop - n : RELAYOUT_CHUNK;
+        cols[numcols].rec   = calloc(1, sizeof *cols[numcols].rec);
+        if (cols[numcols].rec == NULL) {
+            printf("Error allocating memory.\n");
+            goto done;
+        }
+        n += cols[numcols++].count;
+        if (n == inend)
+            i++;
+        if (n == outend)
+            o++;
+    }
+
+    for (i = 0; i < numins; i++) {
+        if ((ins[i].fd = open(ins[i].name, O_RDONLY | (use_direct_io ? O_DIRECT : 0))) < 0) {
+            perror(ins[i].name);
+            goto done;
+        }
+        posix_fadvise(ins[i].fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    for (o = 0; o < numouts; o++) {
+        outs[o].fd = open(outs[o].name, O_CREAT | O_TRUNC | O_RDWR | (use_direct_io ? O_DIRECT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (outs[o].fd < 0) {
+            perror(outs[o].name);
+            goto done;
+        }
+        if (posix_fallocate(outs[o].fd, 0, (uint64_t)outs[o].nonces * NONCE_SIZE) != 0) {
+            printf("File pre-allocation failed for %s.\n", outs[o].name);
+            goto done;
+        }
+    }
+    for (b = 0; b < 2; b++) {
+        if ((rw.io[b].buf = alloc(SCOOP_SIZE, RELAYOUT_CHUNK)) == NULL) {
+            printf("Error allocating memory.\n");
+            goto done;
+        }
+    }
+
+    if (pthread_create(&writer, NULL, relayoutwrite_i, &rw)) {
+        printf("Error creating thread.\n");
+        exit(-1);
+    }
+    writing = 1;
+
+    ms = getMS();
+    for (s = 0; s < NUM_SCOOPS; s++) {
+        for (c = 0; c < numcols; c++, k++) {
+            struct relayoutio *io   = &rw.io[k % 2];
+            struct relayoutcol *col = &cols[c];
+            uint64_t size = (uint64_t)col->count * SCOOP_SIZE;
+            uint64_t pos  = ((uint64_t)s * col->in->nonces + (col->first - col->in->startnonce)) * SCOOP_SIZE;
+
+            pthread_mutex_lock(&rw.mutex);
+            while (io->full)
+                pthread_cond_wait(&rw.cond, &rw.mutex);
+            pthread_mutex_unlock(&rw.mutex);
+            if (rw.failed) {
+                printf("\nError while writing: %d\n", rw.failed);
+                goto done;
+            }
+
+            if (pread(col->in->fd, io->buf, size, pos) < (ssize_t)size) {
+                printf("\nError while reading %s: %d\n", col->in->name, errno);
+                goto done;
+            }
+            col->rec->sum[s] = xxh64(io->buf, size, 0);
+            io->col   = col;
+            io->scoop = s;
+
+            pthread_mutex_lock(&rw.mutex);
+            io->full = 1;
+            pthread_cond_broadcast(&rw.cond);
+            pthread_mutex_unlock(&rw.mutex);
+        }
+        if (s % 256 == 255) {
+            printf("\33[2K\r%5.2f%% done", 100.0 * (s + 1) / NUM_SCOOPS);
+            fflush(stdout);
+        }
+    }
+
+    // Let the writer finish the last columns
+    pthread_mutex_lock(&rw.mutex);
+    rw.done = 1;
+    pthread_cond_broadcast(&rw.cond);
+    pthread_mutex_unlock(&rw.mutex);
+    pthread_join(writer, NULL);
+    writing = 0;
+    if (rw.failed) {
+        printf("\nError while writing: %d\n", rw.failed);
+        goto done;
+    }
+    ms = getMS() - ms;
+
+    // Everything is written: checksums and final names
+    for (o = 0; o < numouts; o++) {
+        if (fdatasync(outs[o].fd) < 0) {
+            perror(outs[o].name);
+            goto done;
+        }
+        close(outs[o].fd);
+        outs[o].fd = -1;
+
+        memset(&pf, 0, sizeof pf);
+        snprintf(pf.name, sizeof pf.name, "%s", outs[o].name);
+        pf.addr       = outs[o].addr;
+        pf.startnonce = outs[o].startnonce;
+        pf.nonces     = outs[o].nonces;
+        if (checkopen(&pf, 0) < 0)
+            goto done;
+        free(pf.checkrec);
+        for (c = 0; c < numcols; c++) {
+            if (cols[c].out != &outs[o])
+                continue;
+            pf.checkrec = cols[c].rec;
+            if (checkappend(&pf, cols[c].first - outs[o].startnonce, cols[c].count) < 0) {
+                close(pf.cfd);
+                goto done;
+            }
+        }
+        close(pf.cfd);
+
+        char from[PATH_MAX + 8], to[PATH_MAX + 8];
+
+        snprintf(from, sizeof from, "%s.check", outs[o].name);
+        snprintf(to, sizeof to, "%s.check", outs[o].finalname);
+        if (rename(outs[o].name, outs[o].finalname) < 0 || rename(from, to) < 0) {
+            printf("Error while renaming file: %d\n", errno);
+            goto done;
+        }
+        printf("\33[2K\rWrote %s\n", outs[o].finalname);
+    }
+
+    printf("%" PRIu64 " nonces in %u file(s) laid out into %u file(s) in %.1fs\n",
+           end - ins[0].startnonce, numins, numouts, (double)ms / 1000000);
+    ret = 0;
+
+done:
+    if (writing) {
+        pthread_mutex_lock(&rw.mutex);
+        rw.done = 1;
+        pthread_cond_broadcast(&rw.cond);
+        pthread_mutex_unlock(&rw.mutex);
+        pthread_join(writer, NULL);
+    }
+    for (i = 0; i < numins; i++) {
+        if (ins[i].fd >= 0)
+            close(ins[i].fd);
+    }
+    for (o = 0; o < numouts; o++) {
+        char name[PATH_MAX + 8];
+
+        if (outs[o].fd >= 0)
+            close(outs[o].fd);
+        if (ret == 0)
+            continue;
+        // Outputs that were renamed already are complete
+        unlink(outs[o].name);
+        snprintf(name, sizeof name, "%s.check", outs[o].name);
+        unlink(name);
+    }
+    for (c = 0; c < numcols; c++)
+        free(cols[c].rec);
+    free(cols);
+    free(rw.io[0].buf);
+    free(rw.io[1].buf);
+    pthread_mutex_destroy(&rw.mutex);
+    pthread_cond_destroy(&rw.cond);
+    return ret;
+}
+
+// Parses the KEY_STARTNONCE_NONCES name of a plot file
+int
+relayoutinput(char *name, struct relayoutfile *f, uint64_t *key) {
+    char *base = strrchr(name, '/');
+    struct stat st;
+
+    base = (base == NULL) ? name : base + 1;
+    snprintf(f->name, sizeof f->name, "%s", name);
+    if (sscanf(base, "%" SCNu64 "_%" SCNu64 "_%u", key, &f->startnonce, &f->nonces) != 3 || f->nonces == 0 || strchr(strchr(strchr(base, '_') + 1, '_') + 1, '_') != NULL) {
+        printf("%s is not an optimized plot file named KEY_STARTNONCE_NONCES.\n", name);
+        return -1;
+    }
+    f->addr = *key;
+    if (stat(name, &st) < 0 || (uint64_t)st.st_size < (uint64_t)f->nonces * NONCE_SIZE) {
+        printf("%s is missing or shorter than %u nonces.\n", name, f->nonces);
+        return -1;
+    }
+    return 0;
+}
+
+void
+relayoutoutput(struct relayoutfile *f, char *outputdir, uint64_t key, uint64_t startnonce, uint32_t nonces) {
+    f->addr       = key;
+    f->startnonce = startnonce;
+    f->nonces     = nonces;
+    snprintf(f->name, sizeof f->name, "%s%" PRIu64 "_%" PRIu64 "_%u.relayout", outputdir, key, startnonce, nonces);
+    snprintf(f->finalname, sizeof f->finalname, "%s%" PRIu64 "_%" PRIu64 "_%u", outputdir, key, startnonce, nonces);
+}
+
+// Merges adjacent plot files of one key into a single plot file
+int
+merge(char *list, char *outputdir) {
+    struct relayoutfile *ins = NULL, out;
+    char *name, *save = NULL;
+    uint64_t key = 0, k;
+    uint32_t numins = 0, i;
+    uint64_t total = 0;
+
+    for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        ins = realloc(ins, (numins + 1) * sizeof *ins);
+        if (ins == NULL || relayoutinput(name, &ins[numins], &k) < 0)
+            return 2;
+        if (numins > 0 && k != key) {
+            printf("%s belongs to another key.\n", name);
+            return 2;
+        }
+        key = k;
+        numins++;
+    }
+    if (numins < 2) {
+        printf("Nothing to merge.\n");
+        return 2;
+    }
+    qsort(ins, numins, sizeof *ins, cmprelayoutfile);
+    for (i = 0; i < numins; i++) {
+        if (i > 0 && ins[i].startnonce != ins[i - 1].startnonce + ins[i - 1].nonces) {
+            printf("%s does not follow %s.\n", ins[i].name, ins[i - 1].name);
+            return 2;
+        }
+        total += ins[i].nonces;
+    }
+    if (total > UINT32_MAX) {
+        printf("A plot file can hold at most %u nonces.\n", UINT32_MAX);
+        return 2;
+    }
+
+    mkdir(outputdir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+    relayoutoutput(&out, outputdir, key, ins[0].startnonce, total);
+    printf("Merging %u plot files into %s\n", numins, out.finalname);
+    return relayout(ins, numins, &out, 1);
+}
+
+// Splits a plot file at the given absolute nonces
+int
+split(char *name, char *at, char *outputdir) {
+    struct relayoutfile in, *outs = NULL;
+    char *tok, *save = NULL;
+    uint64_t key, first, cut;
+    uint32_t numouts = 0;
+
+    if (relayoutinput(name, &in, &key) < 0)
+        return 2;
+
+    mkdir(outputdir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+    first = in.startnonce;
+    for (tok = (at != NULL) ? strtok_r(at, ",", &save) : NULL; ; tok = strtok_r(NULL, ",", &save)) {
+        cut = (tok != NULL) ? strtoull(tok, NULL, 10) : in.startnonce + in.nonces;
+        if (cut <= first || cut > in.startnonce + in.nonces) {
+            printf("Cannot split %s at nonce %" PRIu64 ".\n", name, cut);
+            return 2;
+        }
+        outs = realloc(outs, (numouts + 1) * sizeof *outs);
+        if (outs == NULL) {
+            printf("Error allocating memory.\n");
+            return 2;
+        }
+        relayoutoutput(&outs[numouts++], outputdir, key, first, cut - first);
+        first = cut;
+        if (tok == NULL)
+            break;
+    }
+    if (numouts < 2) {
+        printf("Give the nonces to split at with --at.\n");
+        return 2;
+    }
+
+    printf("Splitting %s into %u plot files\n", name, numouts);
+    return relayout(&in, 1, outs, numouts);
+}
+
+// }}}
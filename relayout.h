@@ -0,0 +1,10 @@
+#include <stdint.h>
+
+// --merge, --split: lay the nonces of plot files out into other plot files
+// with other boundaries
+extern char *mergefiles;
+extern char *splitfile;
+extern char *splitat;
+
+int merge(char *list, char *outputdir);
+int split(char *name, char *at, char *outputdir);
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "check.h"
+#include "plot.h"
+#include "repair.h"
+
+char *repairfile     = NULL;
+char *repairranges   = NULL;
+
+// {{{ repair            regenerate nonce ranges in place
+
+// Nonces regenerated per batch: every scoop of a batch is one positioned
+// write of REPAIR_RANGE * 64 bytes
+#define REPAIR_RANGE    512
+
+// Adds the nonce range first..last to the list in *ranges
+void
+addrange(uint64_t **ranges, uint32_t *numranges, uint64_t first, uint64_t last) {
+    *ranges = realloc(*ranges, (*numranges + 1) * 2 * sizeof **ranges);
+    if (*ranges == NULL) {
+        printf("Error allocating memory.\n");
+        exit(-1);
+    }
+    (*ranges)[*numranges * 2]     = (first < last) ? first : last;
+    (*ranges)[*numranges * 2 + 1] = (first < last) ? last : first;
+    (*numranges)++;
+}
+
+// Parses A-B[,C-D...] (single nonces as A), or a file with one range per
+// line: either A-B, or the "nonces A to B" lines printed by --verify/--check
+int
+parseranges(char *spec, uint64_t **ranges, uint32_t *numranges) {
+    FILE *fp = fopen(spec, "r");
+    char line[1024], *tok, *save = NULL, *p;
+    uint64_t first, last;
+
+    if (fp != NULL) {
+        while (fgets(line, sizeof line, fp) != NULL) {
+            if ((p = strcasestr(line, "nonces ")) != NULL
+                && sscanf(p + 7, "%" SCNu64 " to %" SCNu64, &first, &last) == 2) {
+                addrange(ranges, numranges, first, last);
+            }
+            else if (sscanf(line, "%" SCNu64 "-%" SCNu64, &first, &last) == 2) {
+                addrange(ranges, numranges, first, last);
+            }
+        }
+        fclose(fp);
+        return 0;
+    }
+
+    for (tok = strtok_r(spec, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        int n = sscanf(tok, "%" SCNu64 "-%" SCNu64, &first, &last);
+
+        if (n < 1) {
+            printf("Cannot parse nonce range %s\n", tok);
+            return -1;
+        }
+        addrange(ranges, numranges, first, (n == 2) ? last : first);
+    }
+    return 0;
+}
+
+// Regenerates the given nonce ranges of a plot file (from the checksum
+// sidecar if there are none) and writes them back in place
+int
+repair(char *plotfile, char *rangespec) {
+    pthread_attr_t stackSizeAttribute;
+    pthread_t hasher[threads];
+    struct workerjob job[threads];
+    struct netmsg msg;
+    char *base = strrchr(plotfile, '/');
+    uint64_t *ranges = NULL, plotaddr, plotstart, first, done = 0, ms;
+    uint32_t plotnonces, numranges = 0, k, i, s;
+    char *cache;
+    int fd;
+
+    base = (base == NULL) ? plotfile : base + 1;
+    if (sscanf(base, "%" SCNu64 "_%" SCNu64 "_%u", &plotaddr, &plotstart, &plotnonces) != 3 || plotnonces == 0) {
+        printf("%s is not named KEY_STARTNONCE_NONCES.\n", plotfile);
+        return 2;
+    }
+
+    if (rangespec != NULL) {
+        if (parseranges(rangespec, &ranges, &numranges) < 0)
+            return 2;
+    }
+    else if (check_plot(plotfile, &ranges, &numranges) < 0) {
+        printf("No ranges given and no usable checksum sidecar for %s.\n", plotfile);
+        return 2;
+    }
+    if (numranges == 0) {
+        printf("Nothing to repair.\n");
+        return 0;
+    }
+
+    if ((fd = open(plotfile, O_RDWR)) < 0) {
+        perror(plotfile);
+        return 2;
+    }
+    if ((cache = alloc(NONCE_SIZE, REPAIR_RANGE)) == NULL) {
+        printf("Error allocating memory.\n");
+        return 2;
+    }
+    if (initstackattr(&stackSizeAttribute))
+        return 2;
+
+    ms = getMS();
+    for (k = 0; k < numranges; k++) {
+        uint64_t from = ranges[k * 2], to = ranges[k * 2 + 1];
+
+        if (from < plotstart || to >= plotstart + plotnonces) {
+            printf("Nonces %" PRIu64 " to %" PRIu64 " are not in %s, skipping them.\n", from, to, plotfile);
+            continue;
+        }
+        printf("Regenerating nonces %" PRIu64 " to %" PRIu64 "...\n", from, to);
+
+        for (first = from; first <= to; first += msg.count) {
+            memset(&msg, 0, sizeof msg);
+            msg.addr  = plotaddr;
+            msg.nonce = first;
+            msg.count = (to - first + 1 < REPAIR_RANGE) ? to - first + 1 : REPAIR_RANGE;
+
+            // The batch is a stagger of its own, hashed by all threads
+            for (i = 0; i < threads; i++) {
+                job[i].cache = cache;
+                job[i].msg   = &msg;
+                job[i].index = i;
+                if (pthread_create(&hasher[i], &stackSizeAttribute, workerhash_i, &job[i])) {
+                    printf("Error creating thread. Out of memory? Try less threads\n");
+                    exit(-1);
+                }
+            }
+            for (i = 0; i < threads; i++) {
+                pthread_join(hasher[i], NULL);
+            }
+
+            for (s = 0; s < NUM_SCOOPS; s++) {
+                uint64_t size = (uint64_t)msg.count * SCOOP_SIZE;
+                uint64_t pos  = ((uint64_t)s * plotnonces + (first - plotstart)) * SCOOP_SIZE;
+
+                if (pwrite(fd, &cache[(uint64_t)s * size], size, pos) < (ssize_t)size) {
+                    perror("repair");
+                    printf("\nError while writing to file at %" PRIu64 ": %d\n", pos, errno);
+                    exit(2);
+                }
+            }
+            done += msg.count;
+        }
+    }
+    fdatasync(fd);
+    close(fd);
+    ms = getMS() - ms;
+
+    printf("%" PRIu64 " nonces of %s regenerated in %.1fs.\n", done, plotfile, (double)ms / 1000000);
+    free(ranges);
+    return 0;
+}
+
+// }}}
@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+// --repair: regenerate nonce ranges of a plot file and write them back in
+// place
+extern char *repairfile;
+extern char *repairranges;
+
+int repair(char *plotfile, char *rangespec);
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "stream.h"
+#include "helper.h"
+
+// Bytes moved per splice()/sendfile() call
+#define STREAM_CHUNK    (1024 * 1024)
+
+// {{{ stream_address    parse unix:/tcp: target
+
+// Fills in a socket address for "unix:PATH", "tcp:HOST:PORT" or "tcp:PORT".
+// Returns the address length or 0 if the target cannot be parsed.
+static socklen_t
+stream_address(const char *target, struct sockaddr_storage *sa) {
+    memset(sa, 0, sizeof *sa);
+
+    if (!strncmp(target, "unix:", 5)) {
+        struct sockaddr_un *su = (struct sockaddr_un *)sa;
+
+        if (strlen(target + 5) >= sizeof su->sun_path) {
+            printf("Socket path too long: %s\n", target + 5);
+            return 0;
+        }
+        su->sun_family = AF_UNIX;
+        strcpy(su->sun_path, target + 5);
+        return sizeof *su;
+    }
+    if (!strncmp(target, "tcp:", 4)) {
+        struct sockaddr_in *si = (struct sockaddr_in *)sa;
+        char host[256] = "0.0.0.0", ip[100];
+        const char *port = strrchr(target, ':') + 1;
+
+        if (port - target > 4) {
+            int hl = port - target - 5;
+
+            if (hl >= (int)sizeof host)
+                return 0;
+            memcpy(host, target + 4, hl);
+            host[hl] = 0;
+        }
+        if (inet_pton(AF_INET, host, &si->sin_addr) != 1) {
+            if (hostname_to_ip(host, ip) || inet_pton(AF_INET, ip, &si->sin_addr) != 1) {
+                printf("Cannot resolve %s\n", host);
+                return 0;
+            }
+        }
+        si->sin_family = AF_INET;
+        si->sin_port   = htons(atoi(port));
+        return sizeof *si;
+    }
+
+    printf("Unknown stream target %s. Use -, unix:PATH or tcp:HOST:PORT\n", target);
+    return 0;
+}
+
+// }}}
+// {{{ stream_connect    open the sending side
+
+int
+stream_connect(const char *target) {
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    int fd, tries;
+
+    if (!strcmp(target, "-"))
+        return STDOUT_FILENO;
+
+    if ((salen = stream_address(target, &sa)) == 0)
+        return -1;
+
+    // The receiver may still be starting up: retry for up to 30 seconds
+    for (tries = 0; tries < 300; tries++) {
+        fd = socket(sa.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&sa, salen) == 0)
+            return fd;
+        close(fd);
+        if (errno != ECONNREFUSED && errno != ENOENT)
+            break;
+        usleep(100000);
+    }
+    perror(target);
+    return -1;
+}
+
+// }}}
+// {{{ stream_accept     open the receiving side
+
+int
+stream_listen(const char *source) {
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    int lfd, on = 1;
+
+    if ((salen = stream_address(source, &sa)) == 0)
+        return -1;
+
+    if (sa.ss_family == AF_UNIX)
+        unlink(((struct sockaddr_un *)&sa)->sun_path);
+
+    lfd = socket(sa.ss_family, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (bind(lfd, (struct sockaddr *)&sa, salen) < 0 || listen(lfd, 16) < 0) {
+        perror(source);
+        close(lfd);
+        return -1;
+    }
+    return lfd;
+}
+
+int
+stream_accept(const char *source) {
+    int lfd, fd;
+
+    if (!strcmp(source, "-"))
+        return STDIN_FILENO;
+
+    if ((lfd = stream_listen(source)) < 0)
+        return -1;
+
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+        perror("accept");
+    close(lfd);
+    if (!strncmp(source, "unix:", 5))
+        unlink(source + 5);
+
+    return fd;
+}
+
+// }}}
+// {{{ stream_sendbuf    memory -> pipe/socket
+
+// Plain write() loop, used wherever splicing is not possible and for small
+// data that does not outlive the call (vmsplice() only references pages)
+int
+stream_writefull(int fd, const char *buf, uint64_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, (len > STREAM_CHUNK) ? STREAM_CHUNK : len);
+
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int
+stream_sendbuf(int fd, const char *buf, uint64_t len) {
+#ifdef __linux__
+    struct stat st;
+    int pfd[2], topipe;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    topipe = S_ISFIFO(st.st_mode);
+
+    // Pages are mapped into the pipe instead of being copied. For sockets
+    // the pipe is ours and its pages are spliced on into the socket.
+    if (!topipe) {
+        if (!S_ISSOCK(st.st_mode) || pipe(pfd) < 0)
+            return stream_writefull(fd, buf, len);
+        fcntl(pfd[1], F_SETPIPE_SZ, STREAM_CHUNK);
+    }
+    else {
+        pfd[1] = fd;
+    }
+
+    while (len > 0) {
+        struct iovec iov = { (void *)buf, (len > STREAM_CHUNK) ? STREAM_CHUNK : len };
+        ssize_t n = vmsplice(pfd[1], &iov, 1, 0);
+
+        if (n < 0) {
+            int err = errno;
+
+            if (err == EINTR)
+                continue;
+            if (!topipe) {
+                close(pfd[0]);
+                close(pfd[1]);
+            }
+            return (err == EINVAL || err == ENOSYS) ? stream_writefull(fd, buf, len) : -1;
+        }
+        buf += n;
+        len -= n;
+
+        while (!topipe && n > 0) {
+            ssize_t s = splice(pfd[0], NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+            if (s < 0) {
+                if (errno == EINTR)
+                    continue;
+                close(pfd[0]);
+                close(pfd[1]);
+                return -1;
+            }
+            n -= s;
+        }
+    }
+    if (!topipe) {
+        close(pfd[0]);
+        close(pfd[1]);
+    }
+    return 0;
+#else
+    return stream_writefull(fd, buf, len);
+#endif
+}
+
+// }}}
+// {{{ stream_sendfile   file -> pipe/socket
+
+int
+stream_sendfile(int fd, int infd, uint64_t offset, uint64_t len) {
+    char *buf;
+
+#ifdef __linux__
+    while (len > 0) {
+        off_t off = offset;
+        ssize_t n = sendfile(fd, infd, &off, (len > STREAM_CHUNK) ? STREAM_CHUNK : len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS)
+                break;
+            return -1;
+        }
+        if (n == 0)
+            return -1;
+        offset += n;
+        len    -= n;
+    }
+    if (len == 0)
+        return 0;
+#endif
+
+    if ((buf = malloc(STREAM_CHUNK)) == NULL)
+        return -1;
+    while (len > 0) {
+        ssize_t n = pread(infd, buf, (len > STREAM_CHUNK) ? STREAM_CHUNK : len, offset);
+
+        if (n <= 0 || stream_writefull(fd, buf, n) < 0) {
+            free(buf);
+            return -1;
+        }
+        offset += n;
+        len    -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+// }}}
+// {{{ stream_recvfile   pipe/socket -> file
+
+int
+stream_readfull(int fd, void *buf, uint64_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, (len > STREAM_CHUNK) ? STREAM_CHUNK : len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int
+stream_recvfile(int fd, int outfd, uint64_t offset, uint64_t len) {
+#ifdef __linux__
+    struct stat st;
+    int pfd[2], frompipe, ret = 0;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    frompipe = S_ISFIFO(st.st_mode);
+
+    // Sockets are spliced into a pipe of ours first, since splice() needs
+    // a pipe on one side
+    if (frompipe) {
+        pfd[0] = fd;
+    }
+    else if (pipe(pfd) < 0) {
+        return -1;
+    }
+    else {
+        fcntl(pfd[1], F_SETPIPE_SZ, STREAM_CHUNK);
+    }
+
+    while (len > 0 && ret == 0) {
+        ssize_t n = (len > STREAM_CHUNK) ? STREAM_CHUNK : len;
+
+        if (!frompipe) {
+            n = splice(fd, NULL, pfd[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                ret = -1;
+                break;
+            }
+        }
+        while (n > 0) {
+            off_t off = offset;
+            ssize_t s = splice(pfd[0], NULL, outfd, &off, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+            if (s < 0 && errno == EINTR)
+                continue;
+            if (s <= 0) {
+                ret = -1;
+                break;
+            }
+            offset += s;
+            len    -= s;
+            n      -= s;
+        }
+    }
+    if (!frompipe) {
+        close(pfd[0]);
+        close(pfd[1]);
+    }
+    return ret;
+#else
+    char *buf;
+
+    if ((buf = malloc(STREAM_CHUNK)) == NULL)
+        return -1;
+    while (len > 0) {
+        uint64_t n = (len > STREAM_CHUNK) ? STREAM_CHUNK : len;
+
+        if (stream_readfull(fd, buf, n) < 0 || pwrite(outfd, buf, n, offset) < (ssize_t)n) {
+            free(buf);
+            return -1;
+        }
+        offset += n;
+        len    -= n;
+    }
+    free(buf);
+    return 0;
+#endif
+}
+
+// }}}
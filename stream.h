@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+// Sent in front of a streamed plot, so the receiver knows what it gets
+#define STREAM_MAGIC    "ENGRVSTR"
+#define STREAM_VERSION  1
+
+struct streamheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t addr;
+    uint64_t startnonce;
+    uint64_t nonces;
+    uint64_t pad[3];
+};
+
+int stream_connect(const char *target);
+int stream_listen(const char *source);
+int stream_accept(const char *source);
+int stream_writefull(int fd, const char *buf, uint64_t len);
+int stream_sendbuf(int fd, const char *buf, uint64_t len);
+int stream_sendfile(int fd, int infd, uint64_t offset, uint64_t len);
+int stream_recvfile(int fd, int outfd, uint64_t offset, uint64_t len);
+int stream_readfull(int fd, void *buf, uint64_t len);
@@ -6,9 +6,13 @@ use strict;
 use warnings;
 
 use Carp;
+use Digest::MD5;
+use IO::Handle;
+use IO::Socket::UNIX;
 use Getopt::Long;                                                # command line options processing
 
 my $plotbin  = './plot64';
+my $engrave  = './engrave64';
 my $md5sum   = ($^O eq "darwin") ? 'md5 -q' : 'md5sum';
 my $expected = '4f81804ea010744877163a87f56fc225';
 my $keep = 0;
@@ -18,9 +22,11 @@ GetOptions(
 ) or croak "Formal error processing command line options!";
 
 
-if (! -x $plotbin) {
-    print "$plotbin binary not present. Compile it first.\n";
-    exit 1;
+for my $bin ($plotbin, $engrave) {
+    if (! -x $bin) {
+        print "$bin binary not present. Compile it first.\n";
+        exit 1;
+    }
 }
 
 
@@ -42,12 +48,350 @@ else {
     cmp_digest('core2/11424087411148401423_0_128', $expected);
 }
 
+# Test the library's writer through engrave64, in rounds that do not divide
+# the plot and with threads sharing one context
+mkdir 'engrave';
+print qx{$engrave -k 11424087411148401423 -d engrave -s 0 -n 128 -m 48 -t 3};
+cmp_digest('engrave/11424087411148401423_0_128', $expected);
+
+# Test the verifier on the SSE4 plot (all nonces regenerated)
+print qx{$plotbin --verify=core1/11424087411148401423_0_128 --sample=100 -x 1 -t 4};
+if ($? != 0) {
+    print "Verify did not match.\n";
+    exit 1;
+}
+
+# Test converting PoC1 plots (staggered, and optimized in place)
+make_poc1('core1/11424087411148401423_0_128', 'core1/11424087411148401423_0_128_32', 128, 32);
+print qx{$plotbin --convert=core1/11424087411148401423_0_128_32 -d convert};
+cmp_digest('convert/11424087411148401423_0_128', $expected);
+unlink 'convert/11424087411148401423_0_128';
+make_poc1('core1/11424087411148401423_0_128', 'convert/11424087411148401423_0_128_128', 128, 128);
+print qx{$plotbin --convert=convert/11424087411148401423_0_128_128 --inplace};
+cmp_digest('convert/11424087411148401423_0_128', $expected);
+
+# Test splitting a plot and merging the pieces again
+print qx{$plotbin --split=core1/11424087411148401423_0_128 --at=40,100 -d split};
+print qx{$plotbin --merge=split/11424087411148401423_0_40,split/11424087411148401423_40_60,split/11424087411148401423_100_28 -d merge};
+cmp_digest('merge/11424087411148401423_0_128', $expected);
+open(my $sidecar, '<', 'merge/11424087411148401423_0_128.check') or die "No checksums for the merged plot.\n";
+read($sidecar, my $sideheader, 24);
+close $sidecar;
+if (unpack('x16 Q<', $sideheader) ne '11424087411148401423') {
+    print "The checksums of the merged plot name another account.\n";
+    exit 1;
+}
+
+# Test mining a round with the scalar and the SIMD cores
+for my $core (0 .. 2) {
+    my $round = qx{echo 9821beb3b34d9a3b30127c05f8d1e9006f8a02f565a3572145134bbe34d37a76 17 18325193796 | $plotbin --mine=- -d core1 -x $core};
+    if ($round !~ m{^Best\sdeadline\s180153\sfor\saccount\s11424087411148401423,\snonce\s17\.}xms) {
+        print $round, "Mining with core $core did not find the expected deadline.\n";
+        exit 1;
+    }
+}
+
+# Test batch deadline verification: accounts mixed in the SIMD lanes, a
+# nonce submitted twice in a batch and again from the nonce cache
+my $gensig = '9821beb3b34d9a3b30127c05f8d1e9006f8a02f565a3572145134bbe34d37a76';
+my $submissions = join '', map { "11424087411148401423 $_ 17 $gensig 18325193796\n42 $_ 100 $gensig 18325193796\n" } 17, 3 .. 12, 17;
+my %deadlines;
+for my $core (0 .. 2) {
+    $deadlines{$core} = qx{printf '${submissions}\n11424087411148401423 17 17 $gensig 18325193796\n' | $plotbin --deadlines=- -x $core};
+    $deadlines{$core} =~ s{^(Using|\#).*\n}{}xmg;
+    if ($deadlines{$core} !~ m{\A11424087411148401423\s17\s17\s180153\n}xms || $deadlines{$core} !~ m{11424087411148401423\s17\s17\s180153\n\z}xms
+        || $deadlines{$core} ne $deadlines{0}) {
+        print $deadlines{$core}, "Deadline verification with core $core failed.\n";
+        exit 1;
+    }
+}
+
+# Test two plot jobs of different accounts at once: stagger buffers that are
+# no multiple of the batch make the AVX2 core mix both jobs in its lanes.
+# Progress goes out as JSON lines and into a metrics file.
+my $jobs = qx{$plotbin -k 11424087411148401423,42 -d jobs1,jobs2 -x 2 -s 0 -n 100 -m 50 -t 2 --progress=json --metrics-file=jobs.prom};
+my @done = $jobs =~ m{^(\{"file":\s"jobs[12]/[^"]+",[^\n]*"nonces":\s100,[^\n]*"done":\strue\})$}xmsg;
+if (@done != 2 || qx{cat jobs.prom} !~ m{^engraver_nonces_written\{file="jobs2/42_0_100",account="42"\}\s100\n.*^engraver_done\s1$}xms) {
+    print $jobs, "Progress of the plot jobs is wrong.\n";
+    exit 1;
+}
+for my $job ('jobs1/11424087411148401423_0_100', 'jobs2/42_0_100') {
+    print qx{$plotbin --verify=$job --sample=100 -x 0};
+    if ($? != 0) {
+        print "Verification of $job failed.\n";
+        exit 1;
+    }
+}
+
+# Test plotting into the null sink: the whole pipeline runs, nothing is written.
+# Phase timing, the trace timeline and the performance counters come along.
+my $sink = qx{$plotbin -k 11424087411148401423 -d sink -x 1 -s 0 -n 64 -m 32 -t 2 -a --sink=null --phases --trace=sink.json --perf-counters};
+if ($? != 0 || $sink !~ m{Sink\sreport\s\(null\):\n\s+64\snonces}xms || -e 'sink') {
+    print $sink, "Plotting into the null sink failed.\n";
+    exit 1;
+}
+if ($sink !~ m{^\s+shabal\s+16\s}xms || $sink !~ m{^\s+write\s+8192\s}xms || qx{grep -c '"name": "write", "ph": "X"' sink.json} != 2) {
+    print $sink, "Phase timing or trace of the null sink plot is wrong.\n";
+    exit 1;
+}
+if ($sink !~ m{^Round\s1\s\(32\snonces.*^Performance\scounters\s\(SSE4\score|^Hardware\sperformance\scounters\sunavailable\s[^\n]*\.\n}xms) {
+    print $sink, "Performance counters of the null sink plot are missing.\n";
+    exit 1;
+}
+
+# Test the autotuner: calibrate, then plot with the saved profile
+my $tune = qx{HOME=autotune $plotbin --autotune=force -d autotune};
+if ($? != 0 || $tune !~ m{Autotune:\s.*\sMB/s\n}xms || ! glob 'autotune/.engraver/*.profile') {
+    print $tune, "Autotune did not create a profile.\n";
+    exit 1;
+}
+$tune = qx{HOME=autotune $plotbin --autotune -k 11424087411148401423 -d autotune -s 0 -n 128};
+if ($tune =~ m{^Autotune:}xms) {
+    print $tune, "Autotune did not reuse the profile.\n";
+    exit 1;
+}
+cmp_digest('autotune/11424087411148401423_0_128', $expected);
+
+# Test the control socket: pause after the first round(s), then resume
+# with one thread and a bandwidth cap, and let a new block hold the writes.
+# A client that stays silent does not keep the others out.
+system("$plotbin -k 11424087411148401423 -d control -x 1 -s 0 -n 128 -m 32 -t 2 --control=control.sock --yield=1 > /dev/null &");
+sleep 1 while (! -S 'control.sock');
+control('control.sock', 'pause');
+my ($status, $held);
+do {
+    sleep 1;
+    $status = control('control.sock', 'status');
+} while ($status !~ m{"nonces":\s(\d+),\s"hashed":\s\1,.*"buffers_busy":\s0}xms);
+$held = $1;
+sleep 2;
+$status = control('control.sock', 'status');
+if ($status !~ m{"paused":\strue,.*"nonces":\s$held,\s"hashed":\s$held,}xms) {
+    print $status, "Pausing through the control socket did not hold the plot.\n";
+    exit 1;
+}
+my $silent = IO::Socket::UNIX->new(Peer => 'control.sock') or croak "Cannot connect to control.sock: $!";
+if (control('control.sock', 'threads 1') !~ m{^ok\s1\sof\s2}xms || control('control.sock', 'bandwidth 50') !~ m{^ok}xms
+    || control('control.sock', 'newblock control') !~ m{^ok\s1\splot}xms || control('control.sock', 'resume') !~ m{^ok}xms) {
+    print "Control commands failed.\n";
+    exit 1;
+}
+close $silent;
+sleep 1 while (! -e 'control/11424087411148401423_0_128');
+cmp_digest('control/11424087411148401423_0_128', $expected);
+
+# Test the write governor: a touched trigger file holds the writes for a while
+system("(sleep 1; touch yield.trigger) &");
+my $yield = qx{$plotbin -k 11424087411148401423 -d yield -x 1 -s 0 -n 128 -m 32 -t 2 -a --yield=2 --yield-on=yield.trigger};
+if ($yield !~ m{yielded\sto\sthe\sminer\s1\stime}xms) {
+    print $yield, "Writes did not yield to the miner.\n";
+    exit 1;
+}
+cmp_digest('yield/11424087411148401423_0_128', $expected);
+
+# Test the read benchmark with all I/O variants
+my $bench = qx{$plotbin --readbench=1 -d core1};
+if ($? != 0 || $bench !~ m{io_uring.*total:}xms) {
+    print $bench, "Read benchmark failed.\n";
+    exit 1;
+}
+
 # Test Core 0 with Direct IO
 print qx{$plotbin -D -a -v -k 11424087411148401423 -d core0_dio -x 0 -s 0 -n 128 -t 4};
-cmp_digest('core0_dio/11424087411148401423_0_128_128', $expected);
+cmp_digest('core0_dio/11424087411148401423_0_128', $expected);
+
+# Test Core 0 on a raw device (a plain file stands in for the block device)
+make_device('core0.raw', 1024 * 1024 + 128 * 262144);
+print qx{$plotbin -a -v -I -k 11424087411148401423 -B core0.raw -x 0 -s 0 -n 128 -t 4};
+cmp_region_digest('core0.raw', 1024 * 1024, 128 * 262144, $expected);
+
+# Test streaming through a pipe (plot does not fit the stagger: scratch file)
+print qx{$plotbin -k 11424087411148401423 --stream=- -d stream_scratch -x 1 -s 0 -n 128 -m 64 -t 4 | $plotbin --receive=- -d stream_pipe};
+cmp_digest('stream_pipe/11424087411148401423_0_128', $expected);
+
+# Test streaming through a unix socket (fully buffered plot)
+system("$plotbin --receive=unix:stream.sock -d stream_sock > /dev/null &");
+print qx{$plotbin -a -k 11424087411148401423 --stream=unix:stream.sock -d stream_scratch -x 1 -s 0 -n 128 -t 4};
+sleep 1 while (! -e 'stream_sock/11424087411148401423_0_128');
+cmp_digest('stream_sock/11424087411148401423_0_128', $expected);
+
+# Test a coordinator with two remote hashing workers
+system("$plotbin --worker=unix:workers.sock -x 1 -t 2 > /dev/null &") for (1 .. 2);
+print qx{$plotbin -a -k 11424087411148401423 --serve=unix:workers.sock -d workers -s 0 -n 128 -m 64};
+cmp_digest('workers/11424087411148401423_0_128', $expected);
+
+# Test stopping with SIGTERM and resuming with a different stagger size
+system("$plotbin -k 11424087411148401423 -d resume -x 0 -s 0 -n 128 -m 32 -t 1 > /dev/null & sleep 3; kill -TERM \$!; wait");
+print qx{$plotbin -R -k 11424087411148401423 -d resume -x 1 -s 0 -n 128 -m 48 -t 4};
+cmp_digest('resume/11424087411148401423_0_128', $expected);
+
+# Test the checksum sidecar of the resumed plot
+print qx{$plotbin --check=resume/11424087411148401423_0_128};
+if ($? != 0) {
+    print "Checksum sidecar did not match.\n";
+    exit 1;
+}
+
+# Test repairing a damaged scoop from the checksum sidecar
+damage('resume/11424087411148401423_0_128', 1000 * 128 * 64 + 77 * 64);
+print qx{$plotbin --repair=resume/11424087411148401423_0_128 -x 1 -t 4};
+cmp_digest('resume/11424087411148401423_0_128', $expected);
+
+# Test writing into a fragmented plot file: its 1MB pieces are allocated
+# last to first, interleaved with another file, then plotted into with -R
+mkdir 'extents';
+fragment('extents/11424087411148401423_0_128.plotting', 'extents/filler', 128 * 262144);
+my $extents = qx{$plotbin -R -k 11424087411148401423 -d extents -x 1 -s 0 -n 128 -m 64 -t 2};
+if ($extents !~ m{:\s(\d+)\sextents,\sscoops\sare\swritten\sin\sdisk\sorder}xms || $1 < 2
+    || $extents !~ m{:\s[12]\srounds?\swritten\sin\sdisk\sorder}xms) {
+    print $extents, "The fragmented plot file was not written in disk order.\n";
+    exit 1;
+}
+cmp_digest('extents/11424087411148401423_0_128', $expected);
+
+# Test the daemon: a job left running by an earlier daemon comes first, then
+# a queued job on the same directory, with the daemon's default directory.
+# A job sized by a disk that is too small fails on its own, and so does one
+# whose plot file cannot be written to (resumed from /dev/full).
+mkdir 'daemon';
+mkdir 'daemon_bad';
+symlink('/dev/full', 'daemon_bad/43_0_64.plotting');
+qx{echo '-k 43 -d daemon_bad -s 0 -n 64' > daemon/d.running};
+qx{echo '-k 11424087411148401423 -d daemon_plots -s 0 -n 128' > daemon/b.running};
+qx{echo '-k 11424087411148401423 -s 128 -n 64' > daemon/a.job};
+qx{echo '-k 42 -d daemon_full' > daemon/c.job};
+my $daemonpid = open(my $daemonout, '-|', "$plotbin --daemon=daemon -d daemon_plots -x 1 -m 64 -t 2 -p 1000000G");
+for (1 .. 120) {
+    last if (-e 'daemon/a.done');
+    sleep 1;
+}
+kill 'TERM', $daemonpid;
+my $daemon = do { local $/; <$daemonout> };
+close $daemonout;
+if (! -e 'daemon/b.done' || ! -e 'daemon_plots/11424087411148401423_128_64' || $daemon !~ m{Resuming\sjob\sdaemon/b.*Starting\sjob\sdaemon/a}xms) {
+    print $daemon, "The daemon did not plot its jobs in order.\n";
+    exit 1;
+}
+if (! -e 'daemon/c.failed' || glob('daemon_full/*') || $daemon !~ m{Job\sdaemon/c\sfailed}xms) {
+    print $daemon, "The daemon did not fail the job that does not fit.\n";
+    exit 1;
+}
+if (! -e 'daemon/d.failed' || glob('daemon_bad/*') || $daemon !~ m{Writing\sdaemon_bad/43_0_64.plotting\sfailed.*Job\sdaemon/d\sfailed}xms) {
+    print $daemon, "The daemon did not fail the job that cannot be written.\n";
+    exit 1;
+}
+cmp_digest('daemon_plots/11424087411148401423_0_128', $expected);
 
 # cleanup
-qx{rm -rf core0 core1 core2 core0_dio} if (!$keep);
+qx{rm -rf core0 core1 core2 core0_dio core0.raw stream_scratch stream_pipe stream_sock workers workers.sock resume convert split merge jobs1 jobs2 autotune sink.json jobs.prom control yield yield.trigger daemon daemon_plots daemon_full daemon_bad extents engrave} if (!$keep);
+
+# Writes a file of size bytes in 1MB pieces from the end to the start, each
+# synced to disk before a piece of another file, so that the file system
+# allocates them out of order
+sub fragment {
+    my ($file, $other, $size) = @_;
+    my $piece = "\0" x (1024 * 1024);
+
+    open(my $fh, '>', $file) or croak "$file: $!";
+    open(my $oh, '>', $other) or croak "$other: $!";
+    for (my $offset = $size - length $piece; $offset >= 0; $offset -= length $piece) {
+        sysseek($fh, $offset, 0);
+        syswrite($fh, $piece);
+        $fh->sync;
+        syswrite($oh, $piece);
+        $oh->sync;
+    }
+    close $fh;
+    close $oh;
+
+    return;
+}
+
+# Sends one command to a control socket and returns the reply
+sub control {
+    my $path = shift;
+    my $cmd  = shift;
+
+    my $sock = IO::Socket::UNIX->new(Peer => $path) or croak "Cannot connect to $path: $!";
+    print {$sock} "$cmd\n";
+    $sock->shutdown(1);
+    my $reply = <$sock>;
+    close $sock;
+
+    return $reply;
+}
+
+sub make_device {
+    my $file = shift;
+    my $size = shift;
+
+    open my $fh, '>', $file or croak "Cannot create $file: $!";
+    truncate $fh, $size or croak "Cannot size $file: $!";
+    close $fh;
+
+    return;
+}
+
+# Writes a PoC1 plot file with the given stagger size from a PoC2 one
+sub make_poc1 {
+    my $in      = shift;
+    my $out     = shift;
+    my $nonces  = shift;
+    my $stagger = shift;
+
+    open my $ih, '<:raw', $in or croak "Cannot open $in: $!";
+    read $ih, my $data, $nonces * 262144;
+    close $ih;
+
+    open my $oh, '>:raw', $out or croak "Cannot create $out: $!";
+    for (my $group = 0; $group < $nonces; $group += $stagger) {
+        for my $scoop (0 .. 4095) {
+            for my $nonce ($group .. $group + $stagger - 1) {
+                print {$oh} substr($data, ($scoop * $nonces + $nonce) * 64, 32)
+                          . substr($data, ((4095 - $scoop) * $nonces + $nonce) * 64 + 32, 32);
+            }
+        }
+    }
+    close $oh;
+
+    return;
+}
+
+sub damage {
+    my $file   = shift;
+    my $offset = shift;
+
+    open my $fh, '+<:raw', $file or croak "Cannot open $file: $!";
+    seek $fh, $offset, 0;
+    print {$fh} 'damaged';
+    close $fh;
+
+    return;
+}
+
+sub cmp_region_digest {
+    my $file   = shift;
+    my $offset = shift;
+    my $length = shift;
+    my $expect = shift;
+
+    open my $fh, '<:raw', $file or croak "Cannot open $file: $!";
+    seek $fh, $offset, 0;
+    read $fh, my $data, $length;
+    close $fh;
+
+    my $digest = Digest::MD5::md5_hex($data);
+
+    if ($digest eq $expect) {
+        print "Digest OK\n"
+    }
+    else {
+        print "Digest did not match.  Expected $expect got $digest  $file\@$offset\n";
+        exit 1;
+    }
+
+    return;
+}
 
 sub cmp_digest {
     my $file   = shift;
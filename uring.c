@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+// {{{ uring_init        set up the rings
+
+int
+uring_init(struct uring *u, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof *u);
+    memset(&p, 0, sizeof p);
+
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+    u->entries = p.sq_entries;
+
+    u->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqessize   = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sqring = mmap(NULL, u->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cqring = mmap(NULL, u->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes   = mmap(NULL, u->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqring == MAP_FAILED || u->cqring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+
+    u->sqhead  = (unsigned *)((char *)u->sqring + p.sq_off.head);
+    u->sqtail  = (unsigned *)((char *)u->sqring + p.sq_off.tail);
+    u->sqmask  = (unsigned *)((char *)u->sqring + p.sq_off.ring_mask);
+    u->sqarray = (unsigned *)((char *)u->sqring + p.sq_off.array);
+    u->cqhead  = (unsigned *)((char *)u->cqring + p.cq_off.head);
+    u->cqtail  = (unsigned *)((char *)u->cqring + p.cq_off.tail);
+    u->cqmask  = (unsigned *)((char *)u->cqring + p.cq_off.ring_mask);
+    u->cqes    = (struct io_uring_cqe *)((char *)u->cqring + p.cq_off.cqes);
+    u->sqtaillocal = *u->sqtail;
+
+    return 0;
+}
+
+void
+uring_exit(struct uring *u) {
+    munmap(u->sqes, u->sqessize);
+    munmap(u->cqring, u->cqringsize);
+    munmap(u->sqring, u->sqringsize);
+    close(u->fd);
+}
+
+// }}}
+// {{{ uring_read        queue and complete requests
+
+static int
+uring_queue(struct uring *u, int op, int fd, void *buf, uint32_t len, uint64_t offset, uint64_t data) {
+    unsigned head = __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE);
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (u->sqtaillocal - head >= u->entries)
+        return -1;
+
+    idx = u->sqtaillocal & *u->sqmask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)buf;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->user_data = data;
+    u->sqarray[idx] = idx;
+    u->sqtaillocal++;
+    return 0;
+}
+
+int
+uring_read(struct uring *u, int fd, void *buf, uint32_t len, uint64_t offset, uint64_t data) {
+    return uring_queue(u, IORING_OP_READ, fd, buf, len, offset, data);
+}
+
+int
+uring_write(struct uring *u, int fd, const void *buf, uint32_t len, uint64_t offset, uint64_t data) {
+    return uring_queue(u, IORING_OP_WRITE, fd, (void *)buf, len, offset, data);
+}
+
+// Submits everything queued and waits for at least wait completions
+int
+uring_submit(struct uring *u, unsigned wait) {
+    unsigned tosubmit = u->sqtaillocal - *u->sqtail;
+    int ret;
+
+    __atomic_store_n(u->sqtail, u->sqtaillocal, __ATOMIC_RELEASE);
+    do {
+        ret = syscall(__NR_io_uring_enter, u->fd, tosubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Requests queued and handed to io_uring_enter that the kernel has not
+// taken (after a failed submit); they will never complete
+unsigned
+uring_unsubmitted(struct uring *u) {
+    return *u->sqtail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE);
+}
+
+// Takes one completion off the ring; returns 0 if there is none
+int
+uring_reap(struct uring *u, uint64_t *data, int32_t *res) {
+    unsigned head = *u->cqhead;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+        return 0;
+    cqe   = &u->cqes[head & *u->cqmask];
+    *data = cqe->user_data;
+    *res  = cqe->res;
+    __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// }}}
+
+#else
+
+int uring_init(struct uring *u, unsigned entries) { (void)u; (void)entries; errno = ENOSYS; return -1; }
+void uring_exit(struct uring *u) { (void)u; }
+int uring_read(struct uring *u, int fd, void *buf, uint32_t len, uint64_t offset, uint64_t data) { errno = ENOSYS; return -1; }
+int uring_write(struct uring *u, int fd, const void *buf, uint32_t len, uint64_t offset, uint64_t data) { errno = ENOSYS; return -1; }
+int uring_submit(struct uring *u, unsigned wait) { errno = ENOSYS; return -1; }
+unsigned uring_unsubmitted(struct uring *u) { (void)u; return 0; }
+int uring_reap(struct uring *u, uint64_t *data, int32_t *res) { return 0; }
+
+#endif
@@ -0,0 +1,25 @@
+#include <stdint.h>
+
+// Minimal io_uring wrapper on the raw system calls (no liburing needed).
+// Only positioned reads and writes are supported.
+struct uring {
+    int fd;
+    unsigned entries;
+    // submission queue
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned sqtaillocal;
+    // completion queue
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    void *sqring, *cqring;
+    size_t sqringsize, cqringsize, sqessize;
+};
+
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+int uring_read(struct uring *u, int fd, void *buf, uint32_t len, uint64_t offset, uint64_t data);
+int uring_write(struct uring *u, int fd, const void *buf, uint32_t len, uint64_t offset, uint64_t data);
+int uring_submit(struct uring *u, unsigned wait);
+unsigned uring_unsubmitted(struct uring *u);
+int uring_reap(struct uring *u, uint64_t *data, int32_t *res);
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nonce.h"
+#include "engraver.h"
+#include "perf.h"
+#include "plot.h"
+#include "verify.h"
+
+char *verifyfile     = NULL;
+double verifysample  = 1;
+
+// {{{ verify            compare a plot file with regenerated nonces
+
+// Nonces are regenerated in ranges of VERIFY_RANGE, hashed as a stagger of
+// their own. A scoop of a whole range is one contiguous block on disk.
+// Sampled ranges are compared in batches of at least VERIFY_BATCH: while
+// the threads hash the next batch, the main thread reads the current one
+// scoop by scoop, each scoop's ranges in ascending offset order and
+// neighbouring ranges in one read.
+#define VERIFY_RANGE    64
+#define VERIFY_BATCH    8
+
+struct verifyjob {
+    int fd;
+    uint64_t addr;
+    uint64_t startnonce;
+    uint32_t nonces;
+    uint32_t *ranges;       // sampled range indices, ascending
+    uint32_t numranges;
+    uint32_t next;          // next index into ranges to hash
+    uint32_t batchsize;     // ranges per batch
+    uint32_t batch;         // batch being compared
+    char *cache[2];         // hashed batches, a stagger of VERIFY_RANGE per range
+    uint32_t hashed[2];     // ranges of the batch in cache[k] that are hashed
+    int failed;             // a read failed: stop hashing
+    uint64_t checked;
+    uint64_t bad;
+    uint32_t badranges;
+};
+
+pthread_mutex_t verifymutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t verifycond   = PTHREAD_COND_INITIALIZER;
+
+int
+cmpuint32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Nonces of sampled range k
+uint32_t
+verifycount(struct verifyjob *job, uint32_t k) {
+    uint64_t first = (uint64_t)job->ranges[k] * VERIFY_RANGE;
+
+    return (job->nonces - first < VERIFY_RANGE) ? job->nonces - first : VERIFY_RANGE;
+}
+
+// Hashes the sampled ranges, at most one batch ahead of the comparison
+void *
+verify_i(void *x_void_ptr) {
+    struct verifyjob *job = x_void_ptr;
+    uint32_t k, slot;
+
+    pthread_mutex_lock(&verifymutex);
+    while (job->next < job->numranges && !job->failed) {
+        k = job->next;
+        if (k / job->batchsize >= job->batch + 2) {
+            pthread_cond_wait(&verifycond, &verifymutex);
+            continue;
+        }
+        job->next++;
+        slot = (k / job->batchsize) % 2;
+        pthread_mutex_unlock(&verifymutex);
+
+        hashchunk(job->cache[slot] + (uint64_t)(k % job->batchsize) * VERIFY_RANGE * NONCE_SIZE, VERIFY_RANGE, job->addr,
+                  job->startnonce + (uint64_t)job->ranges[k] * VERIFY_RANGE, 0, verifycount(job, k));
+
+        pthread_mutex_lock(&verifymutex);
+        job->hashed[slot]++;
+        pthread_cond_broadcast(&verifycond);
+    }
+    pthread_mutex_unlock(&verifymutex);
+    return NULL;
+}
+
+// Compares the hashed ranges first..first+count with the file. Returns -1
+// on read errors.
+int
+verifybatch(struct verifyjob *job, char *cache, uint32_t first, uint32_t count, char *disk, char *badnonce) {
+    uint32_t k, end, s, n, numbad;
+
+    memset(badnonce, 0, (uint64_t)count * VERIFY_RANGE);
+    for (s = 0; s < NUM_SCOOPS; s++) {
+        for (k = 0; k < count; k = end) {
+            uint32_t len = verifycount(job, first + k);
+
+            // Ranges next to each other are next to each other on disk
+            for (end = k + 1; end < count && job->ranges[first + end] == job->ranges[first + end - 1] + 1; end++)
+                len += verifycount(job, first + end);
+
+            uint64_t pos = ((uint64_t)s * job->nonces + (uint64_t)job->ranges[first + k] * VERIFY_RANGE) * SCOOP_SIZE;
+
+            if (pread(job->fd, disk, (uint64_t)len * SCOOP_SIZE, pos) < (ssize_t)((uint64_t)len * SCOOP_SIZE)) {
+                if (errno == 0)
+                    errno = EIO;
+                return -1;
+            }
+            for (n = 0; n < len; n++) {
+                uint32_t r = k + n / VERIFY_RANGE, i = n % VERIFY_RANGE;
+
+                if (memcmp(&cache[((uint64_t)r * NUM_SCOOPS * VERIFY_RANGE + (uint64_t)s * VERIFY_RANGE + i) * SCOOP_SIZE], &disk[(uint64_t)n * SCOOP_SIZE], SCOOP_SIZE))
+                    badnonce[r * VERIFY_RANGE + i] = 1;
+            }
+        }
+    }
+
+    for (k = 0; k < count; k++) {
+        uint64_t base = job->startnonce + (uint64_t)job->ranges[first + k] * VERIFY_RANGE;
+        char *bad     = &badnonce[k * VERIFY_RANGE];
+        uint32_t len  = verifycount(job, first + k);
+
+        for (numbad = 0, n = 0; n < len; n++)
+            numbad += bad[n];
+        job->checked += len;
+        job->bad     += numbad;
+        if (numbad == 0)
+            continue;
+        for (n = 0; n < len; n++) {
+            if (!bad[n])
+                continue;
+            for (end = n; end + 1 < len && bad[end + 1]; end++)
+                ;
+            printf("\33[2K\rMismatch: nonces %" PRIu64 " to %" PRIu64 "\n", base + n, base + end);
+            n = end;
+        }
+        job->badranges++;
+    }
+    return 0;
+}
+
+// Regenerates a sample of sample percent of the nonces of a plot file and
+// compares them against the file. Returns 0 if everything matches, 1 on
+// mismatches and 2 on errors.
+int
+verify(char *plotfile, double sample) {
+    struct verifyjob job;
+    pthread_attr_t stackSizeAttribute;
+    pthread_t verifier[threads];
+    char *base = strrchr(plotfile, '/');
+    char *disk, *badnonce;
+    uint32_t total, i, first, count;
+    uint64_t ms;
+    int err = 0;
+
+    memset(&job, 0, sizeof job);
+    base = (base == NULL) ? plotfile : base + 1;
+    if (sscanf(base, "%" SCNu64 "_%" SCNu64 "_%u", &job.addr, &job.startnonce, &job.nonces) != 3 || job.nonces == 0) {
+        printf("%s is not named KEY_STARTNONCE_NONCES.\n", plotfile);
+        return 2;
+    }
+    if ((job.fd = open(plotfile, O_RDONLY)) < 0) {
+        perror(plotfile);
+        return 2;
+    }
+    if ((uint64_t)LSEEK(job.fd, 0, SEEK_END) < (uint64_t)job.nonces * NONCE_SIZE) {
+        printf("%s is shorter than %u nonces.\n", plotfile, job.nonces);
+        close(job.fd);
+        return 2;
+    }
+    if (sample <= 0 || sample > 100)
+        sample = 100;
+
+    // Pick distinct ranges at random and sort them, so reads go forward
+    total         = (job.nonces + VERIFY_RANGE - 1) / VERIFY_RANGE;
+    job.numranges = (uint32_t)((double)total * sample / 100 + 0.999999);
+    if (job.numranges > total)
+        job.numranges = total;
+    job.batchsize = (threads > VERIFY_BATCH) ? threads : VERIFY_BATCH;
+    job.ranges    = malloc((uint64_t)total * sizeof *job.ranges);
+    job.cache[0]  = alloc(NONCE_SIZE, (uint64_t)job.batchsize * VERIFY_RANGE);
+    job.cache[1]  = alloc(NONCE_SIZE, (uint64_t)job.batchsize * VERIFY_RANGE);
+    disk          = malloc((uint64_t)job.batchsize * VERIFY_RANGE * SCOOP_SIZE);
+    badnonce      = malloc((uint64_t)job.batchsize * VERIFY_RANGE);
+    if (job.ranges == NULL || job.cache[0] == NULL || job.cache[1] == NULL || disk == NULL || badnonce == NULL) {
+        printf("Error allocating memory.\n");
+        return 2;
+    }
+    for (i = 0; i < total; i++)
+        job.ranges[i] = i;
+    srand(time(NULL));
+    for (i = 0; i < job.numranges && job.numranges < total; i++) {
+        uint32_t j = i + (uint32_t)(((uint64_t)rand() * RAND_MAX + rand()) % (total - i));
+        uint32_t t = job.ranges[i];
+
+        job.ranges[i] = job.ranges[j];
+        job.ranges[j] = t;
+    }
+    qsort(job.ranges, job.numranges, sizeof *job.ranges, cmpuint32);
+
+    printf("Verifying %0.2f%% of %u nonces (%" PRIu64 " to %" PRIu64 ") of %s with %u threads\n",
+           sample, job.nonces, job.startnonce, job.startnonce + job.nonces, plotfile, threads);
+
+    if (initstackattr(&stackSizeAttribute))
+        return 2;
+
+    ms = getMS();
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&verifier[i], &stackSizeAttribute, verify_i, &job)) {
+            printf("Error creating thread. Out of memory? Try less threads\n");
+            exit(-1);
+        }
+    }
+
+    for (first = 0; first < job.numranges; first += count) {
+        uint32_t slot = job.batch % 2;
+
+        count = (job.numranges - first < job.batchsize) ? job.numranges - first : job.batchsize;
+        pthread_mutex_lock(&verifymutex);
+        while (job.hashed[slot] < count)
+            pthread_cond_wait(&verifycond, &verifymutex);
+        pthread_mutex_unlock(&verifymutex);
+
+        if (verifybatch(&job, job.cache[slot], first, count, disk, badnonce) < 0) {
+            err = errno;
+            printf("\33[2K\rError while reading from %s: %d\n", plotfile, err);
+        }
+        else {
+            printf("\33[2K\r%5.2f%% verified, %" PRIu64 " bad nonces", 100.0 * (first + count) / job.numranges, job.bad);
+            fflush(stdout);
+        }
+
+        // Hand the buffer back for the batch after the next one
+        pthread_mutex_lock(&verifymutex);
+        job.hashed[slot] = 0;
+        job.batch++;
+        job.failed = (err != 0);
+        pthread_cond_broadcast(&verifycond);
+        pthread_mutex_unlock(&verifymutex);
+        if (err)
+            break;
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(verifier[i], NULL);
+    }
+    ms = getMS() - ms;
+
+    if (!err)
+        printf("\33[2K\r%" PRIu64 " nonces verified in %.1fs, %" PRIu64 " bad nonces in %u ranges of %d.\n%s: %s\n",
+               job.checked, (double)ms / 1000000, job.bad, job.badranges, VERIFY_RANGE, plotfile, job.bad ? "CORRUPTED" : "OK");
+
+    free(job.ranges);
+    free(job.cache[0]);
+    free(job.cache[1]);
+    free(disk);
+    free(badnonce);
+    close(job.fd);
+    if (err)
+        return 2;
+    return job.bad ? 1 : 0;
+}
+
+// }}}
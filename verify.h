@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+// --verify: regenerate a sample of the nonces of a plot file and compare
+// them with the file
+extern char *verifyfile;
+extern double verifysample;
+
+int verify(char *plotfile, double sample);